@@ -0,0 +1,288 @@
+// admin.c
+
+#include "admin.h"
+#include "sys.h"
+#include "cmd.h"
+
+#define MAXADMINCLIENTS 16
+#define MAXADMININPUT   65536           // longest batch
+#define MAXADMINOUTPUT  65536           // output waiting to be sent, the rest gets dropped
+typedef struct {
+	sockethandle_t socket;              // BADSOCKET if the slot is free
+	unsigned serial;                    // tells the batches of former clients of the slot apart
+	unsigned pending;                   // batches appended but not done yet
+	qboolean_t closing;                 // closed once no batches are pending and the output is sent
+	qboolean_t overflowed;              // output has been dropped
+	unsigned inputsize, outputsize;
+	char input[MAXADMININPUT];
+	char output[MAXADMINOUTPUT];
+} adminclient_t;
+static adminclient_t *admin_clients;
+static sockethandle_t admin_listener = BADSOCKET;
+static unsigned admin_serial;
+
+/*
+=================
+Admin_Init
+=================
+*/
+void Admin_Init(const char *userdir)
+{
+	char path[MAXFILENAME];
+	const char *value;
+	int i;
+
+	if (!COM_CheckArg("-adminsocket"))
+		return;
+
+	value = COM_CheckArgValue("-adminsocket");
+	if (value && value[0] != '-') {
+		Q_strncpy(path, value, MAXFILENAME);
+		path[MAXFILENAME - 1] = 0;
+	} else {
+		Q_snprintf(path, MAXFILENAME, "%s\\%s\\admin.sock", sys_usrdatapath, userdir);
+	}
+
+	admin_listener = Sys_ListenLocal(path);
+	if (admin_listener == BADSOCKET) {
+		COM_Printf("Admin socket \"%s\" failed\n", path);
+		return;
+	}
+
+	admin_clients = Zone_Alloc(MAXADMINCLIENTS * sizeof(adminclient_t));
+	if (!admin_clients)
+		Sys_Error("Admin_Init: out of memory");
+	for (i = 0; i < MAXADMINCLIENTS; i++)
+		admin_clients[i].socket = BADSOCKET;
+
+	COM_Printf("Admin socket listening on \"%s\"\n", path);
+}
+
+/*
+=================
+Admin_Shutdown
+
+Batches still in the command buffer find their clients gone
+=================
+*/
+void Admin_Shutdown(void)
+{
+	int i;
+
+	if (admin_listener == BADSOCKET)
+		return;
+
+	for (i = 0; i < MAXADMINCLIENTS; i++) {
+		if (admin_clients[i].socket != BADSOCKET)
+			Sys_CloseSocket(admin_clients[i].socket);
+		admin_clients[i].socket = BADSOCKET;
+	}
+
+	Sys_CloseSocket(admin_listener);
+	admin_listener = BADSOCKET;
+
+	Zone_Free(admin_clients);
+	admin_clients = 0;
+}
+
+/*
+=================
+Admin_Output
+
+Collects the output of a batch, the tag holds the client slot and serial
+=================
+*/
+static void Admin_Output(int tag, const char *text)
+{
+	adminclient_t *client;
+	unsigned length;
+
+	if (!admin_clients)
+		return;
+
+	client = &admin_clients[tag & 0xff];
+	if (client->socket == BADSOCKET || client->serial != ((unsigned)tag >> 8))
+		return;                         // the client is gone
+
+	if (!text) {
+		client->pending--;
+		if (client->outputsize < MAXADMINOUTPUT) client->output[client->outputsize++] = 0;    // ends the reply
+		else                                     client->output[MAXADMINOUTPUT - 1] = 0;
+		return;
+	}
+
+	length = Q_strlen(text);
+	if (client->outputsize + length > MAXADMINOUTPUT) {
+		client->overflowed = true;
+		length = MAXADMINOUTPUT - client->outputsize;
+	}
+	Q_memcpy(client->output + client->outputsize, text, length);
+	client->outputsize += length;
+}
+
+/*
+=================
+Admin_Accept
+=================
+*/
+static void Admin_Accept(void)
+{
+	sockethandle_t socket;
+	adminclient_t *client;
+	int i;
+
+	while ((socket = Sys_AcceptLocal(admin_listener)) != BADSOCKET) {
+		for (i = 0; i < MAXADMINCLIENTS; i++) {
+			if (admin_clients[i].socket == BADSOCKET)
+				break;
+		}
+		if (i == MAXADMINCLIENTS) {
+			COM_DevPrintf("Admin_Accept: too many clients\n");
+			Sys_CloseSocket(socket);
+			continue;
+		}
+
+		client = &admin_clients[i];
+		client->socket = socket;
+		client->serial = ++admin_serial & 0xffffff;
+		client->pending = 0;
+		client->closing = false;
+		client->overflowed = false;
+		client->inputsize = client->outputsize = 0;
+	}
+}
+
+/*
+=================
+Admin_Receive
+
+Reads all the pending input, every batch ended by an empty line
+goes to the command buffer, the rest waits for more input
+=================
+*/
+static void Admin_Receive(adminclient_t *client, int slot)
+{
+	char *p, *end, *start;
+	unsigned consumed;
+	int r;
+
+	while (client->inputsize < MAXADMININPUT - 1) {
+		r = Sys_SocketRecv(client->socket, client->input + client->inputsize, MAXADMININPUT - 1 - client->inputsize);
+		if (r == BADRETURN)
+			client->closing = true;
+		if (r <= 0)
+			break;
+		client->inputsize += r;
+	}
+	client->input[client->inputsize] = 0;
+
+	//
+	// look for empty lines
+	//
+	start = client->input;
+	consumed = 0;
+	for (p = client->input; (end = Q_strchr(p, '\n')) != 0; p = end + 1) {
+		if (end != p && !(end == p + 1 && *p == '\r'))
+			continue;
+
+		*p = 0;
+		if (p != start) {
+			Cbuf_AppendBatch(cmdsource_remote, start, Admin_Output, (int)(client->serial << 8 | slot));
+			client->pending++;
+		}
+		start = end + 1;
+		consumed = (unsigned)(start - client->input);
+	}
+
+	//
+	// a peer that has done sending needs no empty line for the last batch
+	//
+	if (client->closing && start[0]) {
+		Cbuf_AppendBatch(cmdsource_remote, start, Admin_Output, (int)(client->serial << 8 | slot));
+		client->pending++;
+		consumed = client->inputsize;
+	}
+
+	if (consumed) {
+		client->inputsize -= consumed;
+		Q_memmove(client->input, client->input + consumed, client->inputsize);
+	} else if (client->inputsize == MAXADMININPUT - 1) {
+		client->inputsize = 0;
+		Admin_Output((int)(client->serial << 8 | slot), "batch is too long, dropped\n");
+		client->pending++;
+		Admin_Output((int)(client->serial << 8 | slot), 0);
+	}
+}
+
+/*
+=================
+Admin_Send
+=================
+*/
+static void Admin_Send(adminclient_t *client)
+{
+	int r;
+
+	if (client->overflowed) {
+		COM_DevPrintf("Admin_Send: output overflow, some dropped\n");
+		client->overflowed = false;
+	}
+
+	r = Sys_SocketSend(client->socket, client->output, client->outputsize);
+	if (r == BADRETURN) {
+		client->closing = true;
+		client->outputsize = 0;
+		return;
+	}
+
+	client->outputsize -= r;
+	Q_memmove(client->output, client->output + r, client->outputsize);
+}
+
+/*
+=================
+Admin_Frame
+=================
+*/
+void Admin_Frame(void)
+{
+	sockethandle_t sockets[MAXADMINCLIENTS + 1];
+	qboolean_t readable[MAXADMINCLIENTS + 1], writable[MAXADMINCLIENTS + 1];
+	int slots[MAXADMINCLIENTS + 1];
+	adminclient_t *client;
+	unsigned count, i;
+
+	if (admin_listener == BADSOCKET)
+		return;
+
+	sockets[0] = admin_listener;
+	slots[0] = BADRETURN;
+	count = 1;
+	for (i = 0; i < MAXADMINCLIENTS; i++) {
+		if (admin_clients[i].socket == BADSOCKET)
+			continue;
+		sockets[count] = admin_clients[i].socket;
+		slots[count] = i;
+		count++;
+	}
+
+	if (!Sys_PollSockets(sockets, count, readable, writable, 0))
+		return;
+
+	if (readable[0])
+		Admin_Accept();
+
+	for (i = 1; i < count; i++) {
+		client = &admin_clients[slots[i]];
+
+		if (readable[i] && !client->closing)
+			Admin_Receive(client, slots[i]);
+		if (writable[i] && client->outputsize)
+			Admin_Send(client);
+
+		if (client->closing && !client->pending && !client->outputsize) {
+			Sys_CloseSocket(client->socket);
+			client->socket = BADSOCKET;
+		}
+	}
+}
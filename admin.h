@@ -0,0 +1,28 @@
+// admin.h - local admin command socket
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "common.h"
+
+/*
+============================================================================================
+
+ADMIN SOCKET
+
+Lets local tools drive a running server through a local stream socket, enabled by
+"-adminsocket [path]", the path defaults to admin.sock in the user directory.
+
+A client sends commands one per line, an empty line ends a batch. Every batch runs as
+a whole within a single frame with cmdsource_remote, and whatever the commands print
+gets sent back followed by a zero byte. Connections are polled once per frame, there
+are no threads involved.
+
+============================================================================================
+*/
+void Admin_Init(const char *userdir);
+void Admin_Shutdown(void);
+
+void Admin_Frame(void);                   // gets called before Cbuf_Execute, so batches received run in the same frame
+
+#endif // #ifndef ADMIN_H
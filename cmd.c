@@ -1,7 +1,10 @@
 // cmd.c
 
 #include "common.h"
+#include "sys.h"
 #include "console.h"
+#include "cvar.h"
+#include "hunk.h"
 
 /*
 ================================================================================================
@@ -11,16 +14,63 @@ COMMAND SYSTEM CODE
 ================================================================================================
 */
 #define MAXCMDNAME 64
+#define MAXCMDLINE 2048
+#define MINCMDTABLE 64                  // power of two
+typedef struct {
+	struct cmd_s *cmds;                 // the block start
+	unsigned live;                      // commands of the block still registered
+} cmdblock_t;
 typedef struct cmd_s {
 	char name[MAXCMDNAME];
+	unsigned hash;                      // COM_HashString of the name
 	cmdfunc_t func;
+	cmdblock_t *block;                  // null if allocated alone
+	struct cmdalias_s *alias;           // null if it's not an alias
+
+	// profiling stats, see cmdprof
+	unsigned calls;
+	unsigned allocs;                    // zone allocations made meanwhile by any thread
+	double   totaltime, maxtime;        // secs
 	
 	struct cmd_s *next;
 	struct cmd_s *prev;
 } cmd_t;
 static cmd_t *cmd_commands;
-static qboolean_t cmd_inscript;         // true if processing a script file
-static critialcode_t cmdcriticalcode;
+static cmd_t **cmd_table;               // open addressing index over cmd_commands, null slots are empty
+static unsigned cmd_tablesize, cmd_tablecount;
+static unsigned cmd_generation;         // changes every time a command is added or removed
+static qboolean_t cmd_profiling;        // true to collect the stats for cmdprof
+static criticalcode_t cmdcriticalcode;
+
+static void Cmd_FlushScripts(void);
+static void Cmd_Alias_f(cmdcontext_t *ctx);
+static void Cmd_Unalias_f(cmdcontext_t *ctx);
+static struct cmdalias_s * Cmd_AcquireAlias(cmd_t *cmd);
+static void Cmd_FreeAlias(struct cmdalias_s *alias);
+static void Cmd_ExecuteAlias(struct cmdalias_s *alias, char **tokens, unsigned numtokens, cmdsource_t source, qboolean_t buffered);
+static void Cbuf_DeferScript(const char *filename);
+
+/*
+==================
+Cmd_FindCommand
+==================
+*/
+static cmd_t * Cmd_FindCommand(const char *name)
+{
+	cmd_t *cmd;
+	unsigned hash, i;
+
+	if (!cmd_tablecount)
+		return 0;
+
+	hash = COM_HashString(name);
+	for (i = hash & (cmd_tablesize - 1); (cmd = cmd_table[i]) != 0; i = (i + 1) & (cmd_tablesize - 1)) {
+		if (cmd->hash == hash && Q_strcmp(cmd->name, name) == 0)
+			return cmd;
+	}
+
+	return 0;
+}
 
 /*
 ==================
@@ -34,24 +84,75 @@ static void Cmd_Exec_f(cmdcontext_t *ctx)
 		return;
 	}
 
-	Cmd_ExecuteScript(ctx->argv[0]);
+	if (ctx->buffered) Cbuf_DeferScript(ctx->argv[0]);      // runs line by line within the frame budget
+	else               Cmd_ExecuteScript(ctx->argv[0]);
+}
+
+/*
+==================
+Cmd_PrintName
+==================
+*/
+static void Cmd_PrintName(const char *name, unsigned kinds, void *param)
+{
+	((cmdcontext_t *)param)->printf("%s\n", name);
 }
 
 /*
 ==================
 Cmd_LsCmds_f
+
+lscmds [prefix | pattern]
 ==================
 */
 static void Cmd_LsCmds_f(cmdcontext_t *ctx)
 {
-	cmd_t *p;
-	
-	EnterCriticalCode(&cmdcriticalcode);
+	unsigned count;
 
-	for (p = cmd_commands; p; p = p->next)
-		ctx->printf("%s\n", p->name);
+	count = COM_MatchNames(ctx->argc ? ctx->argv[0] : "", NAMEKIND_COMMAND, Cmd_PrintName, ctx);
+	ctx->printf("%u commands\n", count);
+}
 
-	LeaveCriticalCode(&cmdcriticalcode);
+/*
+==================
+Cmd_Prof_f
+
+cmdprof [on | off | reset | print]
+==================
+*/
+static void Cmd_Prof_f(cmdcontext_t *ctx)
+{
+	cmd_t *p;
+	const char *arg;
+
+	arg = ctx->argc >= 1 ? ctx->argv[0] : "print";
+
+	if (!Q_stricmp(arg, "on")) {
+		cmd_profiling = true;
+	} else if (!Q_stricmp(arg, "off")) {
+		cmd_profiling = false;
+	} else if (!Q_stricmp(arg, "reset")) {
+		EnterCriticalCode(&cmdcriticalcode);
+		for (p = cmd_commands; p; p = p->next) {
+			p->calls = p->allocs = 0;
+			p->totaltime = p->maxtime = 0;
+		}
+		LeaveCriticalCode(&cmdcriticalcode);
+	} else if (!Q_stricmp(arg, "print")) {
+		ctx->printf("profiling is %s\n", cmd_profiling ? "on" : "off");
+		ctx->printf("%-24s %8s %10s %10s %10s %8s\n", "command", "calls", "total ms", "avg ms", "max ms", "allocs");
+
+		EnterCriticalCode(&cmdcriticalcode);
+		for (p = cmd_commands; p; p = p->next) {
+			if (!p->calls)
+				continue;
+			ctx->printf("%-24s %8u %10.3f %10.3f %10.3f %8u\n", p->name, p->calls,
+				p->totaltime * 1000, p->totaltime * 1000 / p->calls, p->maxtime * 1000, p->allocs);
+		}
+		LeaveCriticalCode(&cmdcriticalcode);
+	} else {
+		ctx->printf("usage: cmdprof [on | off | reset | print]\n");
+	}
 }
 
 /*
@@ -59,10 +160,17 @@ static void Cmd_LsCmds_f(cmdcontext_t *ctx)
 Cmd_Init
 ==================
 */
+static const cmddef_t cmd_defs[] = {
+	{"exec",    Cmd_Exec_f},
+	{"lscmds",  Cmd_LsCmds_f},
+	{"cmdprof", Cmd_Prof_f},
+	{"alias",   Cmd_Alias_f},
+	{"unalias", Cmd_Unalias_f}
+};
+
 void Cmd_Init(void)
 {
-	Cmd_NewCommand("exec", Cmd_Exec_f);
-	Cmd_NewCommand("lscmds", Cmd_LsCmds_f);
+	Cmd_NewCommands(cmd_defs, sizeof(cmd_defs) / sizeof(cmd_defs[0]));
 	
 	COM_Printf("Command exec initialized\n");
 }
@@ -74,6 +182,10 @@ Cmd_Shutdown
 */
 void Cmd_Shutdown(void)
 {
+	EnterCriticalCode(&cmdcriticalcode);
+	Cmd_FlushScripts();
+	LeaveCriticalCode(&cmdcriticalcode);
+
 	Cmd_ForgetAllCommands();
 }
 
@@ -85,6 +197,7 @@ Cmd_Check
 void Cmd_Check(void)
 {
 	cmd_t *p;
+	unsigned count = 0;
 
 	EnterCriticalCode(&cmdcriticalcode);
 	
@@ -94,11 +207,113 @@ void Cmd_Check(void)
 			if (p->next && p->next->prev != p) Sys_Error("Cmd_Check: linked list corrupted on \"%s\"", p->name);
 			if (p->prev && p->prev->next != p) Sys_Error("Cmd_Check: linked list corrupted on \"%s\"", p->name);
 		}
+		if (p->hash != COM_HashString(p->name)) Sys_Error("Cmd_Check: bad hash on \"%s\"", p->name);
+		if (Cmd_FindCommand(p->name) != p)      Sys_Error("Cmd_Check: \"%s\" is missing in the index", p->name);
+		count++;
 	}
+	if (count != cmd_tablecount)
+		Sys_Error("Cmd_Check: index has %d commands instead of %d", cmd_tablecount, count);
 
 	LeaveCriticalCode(&cmdcriticalcode);
 }
 
+/*
+==================
+Cmd_IndexCommand
+==================
+*/
+static void Cmd_IndexCommand(cmd_t *cmd)
+{
+	cmd_t **old;
+	unsigned oldsize, i;
+
+	//
+	// keep the load under 3/4 so probe chains stay short
+	//
+	if ((cmd_tablecount + 1) * 4 > cmd_tablesize * 3) {
+		old = cmd_table;
+		oldsize = cmd_tablesize;
+
+		cmd_tablesize = oldsize ? oldsize * 2 : MINCMDTABLE;
+		cmd_table = Zone_Alloc(cmd_tablesize * sizeof(cmd_t *));
+		if (!cmd_table)
+			Sys_Error("Cmd_IndexCommand: out of memory");
+		Q_memset(cmd_table, 0, cmd_tablesize * sizeof(cmd_t *));
+		cmd_tablecount = 0;
+
+		if (old) {
+			for (i = 0; i < oldsize; i++) {
+				if (old[i])
+					Cmd_IndexCommand(old[i]);
+			}
+			Zone_Free(old);
+		}
+	}
+
+	for (i = cmd->hash & (cmd_tablesize - 1); cmd_table[i]; i = (i + 1) & (cmd_tablesize - 1))
+		;
+	cmd_table[i] = cmd;
+	cmd_tablecount++;
+}
+
+/*
+==================
+Cmd_UnindexCommand
+
+Shifts the following entries of the probe chain back,
+so no tombstones are needed
+==================
+*/
+static void Cmd_UnindexCommand(cmd_t *cmd)
+{
+	unsigned i, j, home, mask;
+
+	mask = cmd_tablesize - 1;
+	for (i = cmd->hash & mask; cmd_table[i] != cmd; i = (i + 1) & mask) {
+		if (!cmd_table[i])
+			Sys_Error("Cmd_UnindexCommand: \"%s\" isn't indexed", cmd->name);
+	}
+
+	for (j = (i + 1) & mask; cmd_table[j]; j = (j + 1) & mask) {
+		home = cmd_table[j]->hash & mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;                   // entry is still reachable from its home slot
+
+		cmd_table[i] = cmd_table[j];
+		i = j;
+	}
+	cmd_table[i] = 0;
+	cmd_tablecount--;
+}
+
+/*
+==================
+Cmd_LinkCommand
+
+Fills a new command and puts it to the list and the index,
+the commands are expected to be locked
+==================
+*/
+static void Cmd_LinkCommand(cmd_t *new, const char *name, cmdfunc_t func, cmdblock_t *block)
+{
+	Q_strncpy(new->name, name, MAXCMDNAME);
+	new->name[MAXCMDNAME - 1] = 0;
+	new->hash = COM_HashString(new->name);
+	new->func = func;
+	new->block = block;
+	new->alias = 0;
+	new->calls = new->allocs = 0;
+	new->totaltime = new->maxtime = 0;
+	new->prev = 0;
+	new->next = cmd_commands;
+	if (cmd_commands)
+		cmd_commands->prev = new;
+	cmd_commands = new;
+
+	Cmd_IndexCommand(new);
+	COM_IndexName(new->name, NAMEKIND_COMMAND);
+}
+
 /*
 ==================
 Cmd_NewCommand
@@ -106,7 +321,7 @@ Cmd_NewCommand
 Registers new command
 ==================
 */
-void Cmd_NewCommand(const char *name, commandfunc_t func)
+void Cmd_NewCommand(const char *name, cmdfunc_t func)
 {
 	cmd_t *new;
 	
@@ -118,36 +333,92 @@ void Cmd_NewCommand(const char *name, commandfunc_t func)
 #endif
 
 	EnterCriticalCode(&cmdcriticalcode);
+
+	if (Cmd_FindCommand(name)) {
+		LeaveCriticalCode(&cmdcriticalcode);
+		COM_DevPrintf("Cmd_NewCommand: \"%s\" already defined\n", name);
+		return;
+	}
 	
-	new = Zone_Alloc(sizeof(command_t));
+	new = Zone_Alloc(sizeof(cmd_t));
 	if (!new)
 		Sys_Error("Cmd_NewCommand: out of memory");
-	Q_strncpy(new->name, name, MAXCMDNAME);
-	new->func = func;
-	new->prev = 0;
-	new->next = com_commands;
-	if (cmd_commands)
-		cmd_commands->prev = new;
-	cmd_commands = new;
+	Cmd_LinkCommand(new, name, func, 0);
+	cmd_generation++;
 
 	LeaveCriticalCode(&cmdcriticalcode);
 }
 
 /*
 ==================
-Cmd_FindCommand
+Cmd_NewCommands
+
+Registers a static table in one go: all the commands share a single
+zone block and the list gets validated once for the whole table
+==================
+*/
+void Cmd_NewCommands(const cmddef_t *defs, unsigned count)
+{
+	cmdblock_t *block;
+	cmd_t *new;
+	unsigned i;
+
+#ifdef PARANOID
+	if (!defs || count == 0)
+		Sys_Error("Cmd_NewCommands: bad params");
+
+	Cmd_Check();
+#endif
+
+	EnterCriticalCode(&cmdcriticalcode);
+
+	new = Zone_Alloc(count * sizeof(cmd_t) + sizeof(cmdblock_t));
+	if (!new)
+		Sys_Error("Cmd_NewCommands: out of memory");
+	block = (cmdblock_t *)(new + count);
+	block->cmds = new;
+	block->live = 0;
+
+	for (i = 0; i < count; i++) {
+#ifdef PARANOID
+		if (!defs[i].name || !defs[i].name[0] || !defs[i].func)
+			Sys_Error("Cmd_NewCommands: bad def %d", i);
+#endif
+		if (Cmd_FindCommand(defs[i].name)) {
+			COM_DevPrintf("Cmd_NewCommands: \"%s\" already defined\n", defs[i].name);
+			continue;
+		}
+
+		Cmd_LinkCommand(new, defs[i].name, defs[i].func, block);
+		block->live++;
+		new++;
+	}
+
+	if (!block->live)
+		Zone_Free(block->cmds);
+	cmd_generation++;
+
+	LeaveCriticalCode(&cmdcriticalcode);
+}
+
+/*
+==================
+Cmd_FreeCommand
 ==================
 */
-inline cmd_t * Cmd_FindCommand(const char *name)
+static void Cmd_FreeCommand(cmd_t *cmd)
 {
-	cmd_t *it;
+	if (cmd->alias)
+		Cmd_FreeAlias(cmd->alias);
 
-	for (it = cmd_commands; it; it = it->next) {
-		if (Q_strcmp(it->name, name) == 0)
-			return it;
+	if (!cmd->block) {
+		Zone_Free(cmd);
+		return;
 	}
 
-	return 0;
+	cmd->block->live--;
+	if (!cmd->block->live)
+		Zone_Free(cmd->block->cmds);
 }
 
 /*
@@ -167,16 +438,21 @@ void Cmd_ForgetCommand(const char *name)
 	EnterCriticalCode(&cmdcriticalcode);
 
 	cmd = Cmd_FindCommand(name);
-	if (!it) {
-		COM_DevPrintf("Cmd_ForgetCommand: \"%s\" missing", name);
+	if (!cmd) {
+		LeaveCriticalCode(&cmdcriticalcode);
+		COM_DevPrintf("Cmd_ForgetCommand: \"%s\" missing\n", name);
 		return;
 	}
+
+	Cmd_UnindexCommand(cmd);
+	COM_UnindexName(cmd->name, NAMEKIND_COMMAND);
+	cmd_generation++;
 	
 	if (cmd->prev) cmd->prev->next = cmd->next;
 	if (cmd->next) cmd->next->prev = cmd->prev;
-	if (!cmd->prev && !cmd->next) cmd_commands = 0;
+	if (cmd_commands == cmd) cmd_commands = cmd->next;
 			
-	Zone_Free(cmd);
+	Cmd_FreeCommand(cmd);
 
 	LeaveCriticalCode(&cmdcriticalcode);
 }
@@ -197,12 +473,72 @@ void Cmd_ForgetAllCommands(void)
 		target = it;
 		it = it->next;
 
-		Zone_Free(target);
+		COM_UnindexName(target->name, NAMEKIND_COMMAND);
+		Cmd_FreeCommand(target);
 	}
+	cmd_commands = 0;
+
+	if (cmd_table)
+		Zone_Free(cmd_table);
+	cmd_table = 0;
+	cmd_tablesize = cmd_tablecount = 0;
+	cmd_generation++;
 
 	LeaveCriticalCode(&cmdcriticalcode);
 }
 
+/*
+==================
+Cmd_CompleteMatch
+
+Cuts the completion down to the common part with the name
+==================
+*/
+typedef struct {
+	char *out;
+	unsigned outsize;
+	unsigned count;
+} cmdcompletion_t;
+
+static void Cmd_CompleteMatch(const char *name, unsigned kinds, void *param)
+{
+	cmdcompletion_t *c = param;
+	unsigned i;
+
+	if (!c->count++) {
+		Q_strncpy(c->out, name, c->outsize);
+		c->out[c->outsize - 1] = 0;
+		return;
+	}
+
+	for (i = 0; c->out[i] && c->out[i] == name[i]; i++)
+		;
+	c->out[i] = 0;
+}
+
+/*
+==================
+Cmd_CompleteName
+==================
+*/
+unsigned Cmd_CompleteName(const char *partial, char *out, unsigned outsize)
+{
+	cmdcompletion_t c;
+
+#ifdef PARANOID
+	if (!partial || !out || outsize == 0)
+		Sys_Error("Cmd_CompleteName: bad params");
+#endif
+
+	c.out = out;
+	c.outsize = outsize;
+	c.count = 0;
+	out[0] = 0;
+
+	COM_MatchNames(partial, NAMEKIND_COMMAND | NAMEKIND_VARIABLE, Cmd_CompleteMatch, &c);
+	return c.count;
+}
+
 /*
 ==================
 NullPrintf
@@ -216,21 +552,91 @@ static void NullDevPrintf(const char *fmt, ...) {}
 
 /*
 ==================
-Cmd_ExecuteTokens
+CapturePrintf
+CaptureDevPrintf
+
+for cmdsource_remote, prints to the output of the batch being executed
+==================
+*/
+static cmdoutput_t cmd_capture;         // null if no batch is being executed
+static int cmd_capturetag;
+
+static void CapturePrintf(const char *fmt, ...)
+{
+	va_list args;
+	char buf[MAXBUF];
+
+	va_start(args, fmt);
+	Q_vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (cmd_capture) cmd_capture(cmd_capturetag, buf);
+	else             COM_Printf("%s", buf);
+}
+
+static void CaptureDevPrintf(const char *fmt, ...)
+{
+	va_list args;
+	char buf[MAXBUF];
+
+	if (!com_devmode)
+		return;
+
+	va_start(args, fmt);
+	Q_vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	CapturePrintf("%s", buf);
+}
+
+/*
+==================
+Cmd_ProfiledCall
+
+Looks the command up again after the call,
+as it might have been forgotten meanwhile
 ==================
 */
-static void Cmd_ExecuteTokens(char **tokens, unsigned numtokens)
+static void Cmd_ProfiledCall(cmdfunc_t func, cmdcontext_t *ctx, const char *name)
 {
 	cmd_t *cmd;
+	double start, time;
+	unsigned allocs;
+
+	allocs = Zone_AllocCount();
+	start = Sys_FloatTime();
+
+	func(ctx);
+
+	time = Sys_FloatTime() - start;
+	allocs = Zone_AllocCount() - allocs;
+
+	EnterCriticalCode(&cmdcriticalcode);
+	cmd = Cmd_FindCommand(name);
+	if (cmd && cmd->func == func) {
+		cmd->calls++;
+		cmd->allocs += allocs;
+		cmd->totaltime += time;
+		if (cmd->maxtime < time)
+			cmd->maxtime = time;
+	}
+	LeaveCriticalCode(&cmdcriticalcode);
+}
+
+/*
+==================
+Cmd_Dispatch
+
+Calls a command func or prints out a cvar if func is null,
+no locks are held, so commands can execute other commands
+==================
+*/
+static void Cmd_Dispatch(cmdfunc_t func, char **tokens, unsigned numtokens, cmdsource_t source, qboolean_t buffered)
+{
 	cmdcontext_t ctx;
-	qboolean_t printvar;
 
-	cmd = Cmd_FindCommand(tokens[0]);
-	if (cmd) printvar = false;
-	else     printvar = true;
-	
-	if (cmd_inscript) ctx.source = cmdsource_script;
-	else              ctx.source = cmdsource_code;
+	ctx.source = source;
+	ctx.buffered = buffered;
 	switch (ctx.source) {
 	case cmdsource_code:
 		ctx.printf = NullPrintf;
@@ -241,169 +647,1420 @@ static void Cmd_ExecuteTokens(char **tokens, unsigned numtokens)
 		ctx.devprintf = COM_DevPrintf;
 		break;
 	case cmdsource_console:
-		ctx.printf = 0; // TODO: Con_Printf in a future
-		ctx.devprintf = 0; // TODO: Con_DevPrintf in a future
+		ctx.printf = COM_Printf; // TODO: Con_Printf in a future
+		ctx.devprintf = COM_DevPrintf; // TODO: Con_DevPrintf in a future
+		break;
+	case cmdsource_remote:
+		ctx.printf = CapturePrintf;
+		ctx.devprintf = CaptureDevPrintf;
 		break;
 	}
 
-	if (printvar) {
-		Cvar_PrintVariable(tokens[0], ctx.printf);
+	if (!func) {
+		Cvar_PrintVariable(ctx.printf, tokens[0]);
 	} else {
 		ctx.argc = numtokens - 1;
-		ctx.argv = numtokens >=2 ? &tokens[1] : 0;
+		ctx.argv = numtokens >= 2 ? &tokens[1] : 0;
 
-		cmd->func(&ctx);
+		if (cmd_profiling) Cmd_ProfiledCall(func, &ctx, tokens[0]);
+		else               func(&ctx);
 	}
 }
 
 /*
 ==================
-Cmd_ExecuteCommand
+Cmd_ExecuteTokens
 ==================
 */
-void Cmd_ExecuteCommand(const char *command)
+static void Cmd_ExecuteTokens(char **tokens, unsigned numtokens, cmdsource_t source, qboolean_t buffered)
 {
-	char **tokens;
-	unsigned numtokens;
-	
-#ifdef PARANOID
-	if (!command || !command[0])
-		Sys_Error("Cmd_ExecuteCommand: bad command");
-#endif
+	cmd_t *cmd;
+	cmdfunc_t func;
+	struct cmdalias_s *alias;
 
 	EnterCriticalCode(&cmdcriticalcode);
-
-	tokens = COM_Parse(command, " \t\n", &numtokens);
-	if (tokens) {
-		Cmd_ExecuteTokens(tokens, numtokens);
-		COM_FreeParse(tokens, numtokens);
-	}
-
+	cmd = Cmd_FindCommand(tokens[0]);
+	func = cmd ? cmd->func : 0;
+	alias = cmd ? Cmd_AcquireAlias(cmd) : 0;
 	LeaveCriticalCode(&cmdcriticalcode);
+
+	if (alias) Cmd_ExecuteAlias(alias, tokens, numtokens, source, buffered);
+	else       Cmd_Dispatch(func, tokens, numtokens, source, buffered);
 }
 
 /*
 ==================
-Cmd_ExecuteScript
+Cmd_ExecuteLine
 ==================
 */
-void Cmd_ExecuteScript(const char *filename)
+static void Cmd_ExecuteLine(const char *command, cmdsource_t source, qboolean_t buffered)
 {
-	filehandle_t file;
+	char buf[MAXCMDLINE];
+	char *tokens[MAXTOKENS];
+	unsigned numtokens;
 	
 #ifdef PARANOID
-	if (!filename || !filename[0])
-		Sys_Error("Cmd_ExecuteScript: bad filename");
+	if (!command || !command[0])
+		Sys_Error("Cmd_ExecuteLine: bad command");
 #endif
 
-	EnterCriticalCode(&cmdcriticalcode);
-
-	file = Sys_FOpenForReading(filename);
-	if (file != BADFILE) {
-		char line[2048];
-
-		while (COM_FReadLine(file, line, sizeof(line))) {
-			char **tokens;
-			unsigned numtokens;
-
-			tokens = COM_Parse(command, " \t\n", &numtokens);
-			if (tokens) {
-				cmd_inscript = true;
-				Cmd_ExecuteTokens(tokens, numtokens);
-				cmd_inscript = false;
-				
-				COM_FreeParse(tokens, numtokens);
-			}
-		}
+	numtokens = COM_Tokenize(command, buf, sizeof(buf), tokens, MAXTOKENS);
+	if (numtokens)
+		Cmd_ExecuteTokens(tokens, numtokens, source, buffered);
+}
 
-		Sys_FClose(file);
-	}
+/*
+==================
+Cmd_ExecuteCommand
+==================
+*/
+void Cmd_ExecuteCommand(const char *command)
+{
+	Cmd_ExecuteSourceCommand(cmdsource_code, command);
+}
 
-	LeaveCriticalCode(&cmdcriticalcode);
+/*
+==================
+Cmd_ExecuteSourceCommand
+==================
+*/
+void Cmd_ExecuteSourceCommand(cmdsource_t source, const char *command)
+{
+	Cmd_ExecuteLine(command, source, false);
 }
 
 /*
 ================================================================================================
 
-COMMANDS BUFFER CODE
+COMPILED SCRIPTS
+
+Scripts get compiled once into a single zone block holding the lines with their resolved
+commands, the token pointers and the token text. Compiled scripts are cached by file name
+and get recompiled once the file CRC changes, so executing them again skips any parsing.
+Pinned file names keep their scripts out of the LRU eviction, whatever version they have.
 
 ================================================================================================
 */
-#define INITBUFSIZE 128
-
-static char *cmd_buf;
-static unsigned cmd_bufpos, cmd_bufsize;
-static criticalcode_t cmdbufcriticalcode;
+#define MAXSCRIPTCACHE  16              // not counting the pinned ones
+#define MAXSCRIPTDEPTH  16              // stops scripts executing themselves forever
+#define MAXSCRIPTPINS   8
+typedef struct {
+	cmd_t *cmd;                         // null if it's a cvar name
+	unsigned argc;                      // including the command name
+	unsigned first;                     // index of the first token in args
+} cmdline_t;
+typedef struct cmdscript_s {
+	char filename[MAXFILENAME];
+	unsigned crc, size;                 // of the source file
+	unsigned generation;                // cmd_generation the lines are resolved at
+	int busy;                           // count of running executions
+	qboolean_t orphan;                  // out of the cache, freed once not busy
+
+	unsigned numlines;
+	cmdline_t *lines;
+	char **args;
+
+	struct cmdscript_s *next;
+} cmdscript_t;
+static cmdscript_t *cmd_scripts;        // most recently used first
+static struct {
+	char filename[MAXFILENAME];
+	int refs;                           // 0 if the slot is free
+} cmd_scriptpins[MAXSCRIPTPINS];
+static THREADLOCAL int cmd_scriptdepth;    // scripts are executed by the admin and loader threads too
 
 /*
 ==================
-Cbuf_Init
+Cmd_NextScriptLine
+
+Copies out the line starting at pos, returns false at the end of text
 ==================
 */
-void Cbuf_Init(void)
+static qboolean_t Cmd_NextScriptLine(const char *text, unsigned size, unsigned *pos, char *out)
 {
-	cmd_buflen = 0;
-	cmd_bufsize = INITBUFSIZE;
-	cmd_buf = Zone_Alloc(cmd_bufsize);
-	if (!cmd_buf)
-		Sys_Error("Cbuf_Init: out of memory");
-	
-	COM_Printf("Command buffer initialized\n");
+	unsigned len = 0;
+
+	if (*pos >= size || !text[*pos])
+		return false;
+
+	while (*pos < size && text[*pos] && text[*pos] != '\n') {
+		if (len < MAXCMDLINE - 1)
+			out[len++] = text[*pos];
+		(*pos)++;
+	}
+	if (*pos < size && text[*pos] == '\n')
+		(*pos)++;
+
+	if (len && out[len - 1] == '\r')    // CRLF
+		len--;
+	out[len] = 0;
+
+	return true;
 }
 
 /*
 ==================
-Cbuf_Shutdown
+Cmd_CompileScript
+
+Counts everything on the first pass, fills the block on the second one
 ==================
 */
-void Cbuf_Shutdown(void)
+static cmdscript_t * Cmd_CompileScript(const char *filename, const char *text, unsigned size, unsigned crc)
 {
-	if (cmd_buf)
-		Zone_Free(cmd_buf);
+	cmdscript_t *script;
+	cmdline_t *line;
+	char linetext[MAXCMDLINE];
+	tokenview_t tokens[MAXTOKENS];
+	char *p;
+	unsigned numtokens, numlines, numargs, textsize, pos, i;
+	int pass;
+
+	numlines = numargs = textsize = 0;
+	script = 0;
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			script = Zone_Alloc(sizeof(cmdscript_t) + numlines * sizeof(cmdline_t) + numargs * sizeof(char *) + textsize);
+			if (!script)
+				Sys_Error("Cmd_CompileScript: out of memory for \"%s\"", filename);
+			Q_memset(script, 0, sizeof(cmdscript_t));
+			Q_strncpy(script->filename, filename, MAXFILENAME);
+			script->filename[MAXFILENAME - 1] = 0;
+			script->crc = crc;
+			script->size = size;
+			script->generation = cmd_generation - 1;   // resolved on the first execution
+			script->lines = (cmdline_t *)(script + 1);
+			script->args = (char **)(script->lines + numlines);
+			p = (char *)(script->args + numargs);
+			numlines = numargs = 0;
+		}
+
+		pos = 0;
+		while (Cmd_NextScriptLine(text, size, &pos, linetext)) {
+			numtokens = COM_TokenizeViews(linetext, tokens, MAXTOKENS);
+			if (!numtokens)
+				continue;
+
+			if (pass == 0) {
+				for (i = 0; i < numtokens; i++)
+					textsize += tokens[i].length + 1;
+			} else {
+				line = &script->lines[numlines];
+				line->cmd = 0;
+				line->argc = numtokens;
+				line->first = numargs;
+				for (i = 0; i < numtokens; i++) {
+					Q_memcpy(p, tokens[i].start, tokens[i].length);
+					p[tokens[i].length] = 0;
+					script->args[numargs + i] = p;
+					p += tokens[i].length + 1;
+				}
+			}
+			numlines++;
+			numargs += numtokens;
+		}
+	}
+
+	script->numlines = numlines;
+	return script;
 }
 
 /*
 ==================
-Cbuf_Clear
+Cmd_FreeScript
 ==================
 */
-void Cbuf_Clear(void)
+static void Cmd_FreeScript(cmdscript_t *script)
 {
-	EnterCriticalCode(&cmdbufcriticalcode);
-
-	if (cmd_buf)
-		cmd_buf[0] = 0;
-	cmd_bufpos = 0;
-
-	LeaveCriticalCode(&cmdbufcriticalcode);
+	if (script->busy) script->orphan = true;
+	else              Zone_Free(script);
 }
 
 /*
 ==================
-Cbuf_Grow
+Cmd_ScriptPinned
+
+The cache is expected to be locked
 ==================
 */
-static void Cbuf_Grow(unsigned size)
+static qboolean_t Cmd_ScriptPinned(const char *filename)
 {
-	char *new;
-	unsigned newsize;
+	int i;
+
+	for (i = 0; i < MAXSCRIPTPINS; i++) {
+		if (cmd_scriptpins[i].refs && !Q_strcmp(cmd_scriptpins[i].filename, filename))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+==================
+Cmd_AcquireScript
+
+Returns the compiled script for the file contents, marked as busy,
+the cache is expected to be locked
+==================
+*/
+static cmdscript_t * Cmd_AcquireScript(const char *filename, const char *text, unsigned size)
+{
+	cmdscript_t *script, *victim, **link, **last;
+	unsigned crc, count;
+
+	crc = COM_ComputeCRC((void *)text, size);
+
+	for (link = &cmd_scripts; *link; link = &(*link)->next) {
+		if (!Q_strcmp((*link)->filename, filename))
+			break;
+	}
+
+	script = *link;
+	if (script) {
+		*link = script->next;           // unlink, goes back to the front
+		if (script->crc != crc || script->size != size) {
+			Cmd_FreeScript(script);     // file has been changed
+			script = 0;
+		}
+	}
+	if (!script)
+		script = Cmd_CompileScript(filename, text, size, crc);
+
+	script->next = cmd_scripts;
+	cmd_scripts = script;
+
+	//
+	// throw out the least recently used one, but never a pinned one
+	//
+	count = 0;
+	last = 0;
+	for (link = &cmd_scripts; *link; link = &(*link)->next) {
+		if (Cmd_ScriptPinned((*link)->filename))
+			continue;
+		count++;
+		last = link;
+	}
+	if (count > MAXSCRIPTCACHE) {
+		victim = *last;
+		*last = victim->next;
+		Cmd_FreeScript(victim);
+	}
+
+	script->busy++;
+	return script;
+}
+
+/*
+==================
+Cmd_ResolveScript
+
+Resolves the commands of the lines, the cache is expected to be locked
+==================
+*/
+static void Cmd_ResolveScript(cmdscript_t *script)
+{
+	unsigned i;
+
+	for (i = 0; i < script->numlines; i++)
+		script->lines[i].cmd = Cmd_FindCommand(script->args[script->lines[i].first]);
+
+	script->generation = cmd_generation;
+}
+
+/*
+==================
+Cmd_FlushScripts
+==================
+*/
+static void Cmd_FlushScripts(void)
+{
+	cmdscript_t *script, *next;
+
+	for (script = cmd_scripts; script; script = next) {
+		next = script->next;
+		Cmd_FreeScript(script);
+	}
+	cmd_scripts = 0;
+}
+
+/*
+==================
+Cmd_LoadScript
+
+Returns the compiled script marked as busy, or null if the file is missing or empty
+==================
+*/
+static cmdscript_t * Cmd_LoadScript(const char *filename)
+{
+	cmdscript_t *script;
+	char *text;
+	unsigned size;
+
+	text = COM_FileData(filename, &size);
+	if (!text)
+		return 0;
+	if (!size) {
+		Zone_Free(text);
+		return 0;
+	}
+
+	EnterCriticalCode(&cmdcriticalcode);
+	script = Cmd_AcquireScript(filename, text, size);
+	LeaveCriticalCode(&cmdcriticalcode);
+
+	Zone_Free(text);
+	return script;
+}
+
+/*
+==================
+Cmd_ReleaseScript
+==================
+*/
+static void Cmd_ReleaseScript(cmdscript_t *script)
+{
+	EnterCriticalCode(&cmdcriticalcode);
+	script->busy--;
+	if (!script->busy && script->orphan)
+		Zone_Free(script);
+	LeaveCriticalCode(&cmdcriticalcode);
+}
+
+/*
+==================
+Cmd_ExecuteScriptLine
+==================
+*/
+static void Cmd_ExecuteScriptLine(cmdscript_t *script, unsigned index, qboolean_t buffered)
+{
+	cmdline_t *line;
+	cmdfunc_t func;
+	struct cmdalias_s *alias;
+
+	line = &script->lines[index];
+
+	EnterCriticalCode(&cmdcriticalcode);
+	if (script->generation != cmd_generation)
+		Cmd_ResolveScript(script);      // previous lines might have changed commands
+	func = line->cmd ? line->cmd->func : 0;
+	alias = line->cmd ? Cmd_AcquireAlias(line->cmd) : 0;
+	LeaveCriticalCode(&cmdcriticalcode);
+
+	if (alias) Cmd_ExecuteAlias(alias, &script->args[line->first], line->argc, cmdsource_script, buffered);
+	else       Cmd_Dispatch(func, &script->args[line->first], line->argc, cmdsource_script, buffered);
+}
+
+/*
+==================
+Cmd_ExecuteScript
+
+Runs the whole script at once
+==================
+*/
+void Cmd_ExecuteScript(const char *filename)
+{
+	cmdscript_t *script;
+	unsigned i;
 	
-	if (size == 0 || size <= cmd_bufsize)
-		Sys_Error("Cbuf_Grow: bad size");
+#ifdef PARANOID
+	if (!filename || !filename[0])
+		Sys_Error("Cmd_ExecuteScript: bad filename");
+#endif
+
+	if (cmd_scriptdepth >= MAXSCRIPTDEPTH) {
+		COM_Printf("Cmd_ExecuteScript: \"%s\" is nested too deep\n", filename);
+		return;
+	}
+
+	script = Cmd_LoadScript(filename);
+	if (!script)
+		return;
+
+	cmd_scriptdepth++;
+	for (i = 0; i < script->numlines; i++)
+		Cmd_ExecuteScriptLine(script, i, false);
+	cmd_scriptdepth--;
+
+	Cmd_ReleaseScript(script);
+}
+
+/*
+==================
+Cmd_CacheScript
+
+Gets the script compiled, so Cmd_ExecuteScriptChanges has a version to compare with
+==================
+*/
+qboolean_t Cmd_CacheScript(const char *filename)
+{
+	cmdscript_t *script;
+
+#ifdef PARANOID
+	if (!filename || !filename[0])
+		Sys_Error("Cmd_CacheScript: bad filename");
+#endif
+
+	script = Cmd_LoadScript(filename);
+	if (!script)
+		return false;
+
+	Cmd_ReleaseScript(script);
+	return true;
+}
+
+/*
+==================
+Cmd_PinScript
+
+Keeps the cached versions of the script out of the LRU eviction till as many
+Cmd_UnpinScript calls, gets it compiled, returns false if missing or empty
+==================
+*/
+qboolean_t Cmd_PinScript(const char *filename)
+{
+	int i, slot;
+
+#ifdef PARANOID
+	if (!filename || !filename[0])
+		Sys_Error("Cmd_PinScript: bad filename");
+#endif
+
+	EnterCriticalCode(&cmdcriticalcode);
+
+	slot = -1;
+	for (i = 0; i < MAXSCRIPTPINS; i++) {
+		if (cmd_scriptpins[i].refs && !Q_strcmp(cmd_scriptpins[i].filename, filename)) {
+			slot = i;
+			break;
+		}
+		if (!cmd_scriptpins[i].refs && slot < 0)
+			slot = i;
+	}
+	if (slot < 0)
+		Sys_Error("Cmd_PinScript: too many pinned scripts");
+
+	if (!cmd_scriptpins[slot].refs) {
+		Q_strncpy(cmd_scriptpins[slot].filename, filename, MAXFILENAME);
+		cmd_scriptpins[slot].filename[MAXFILENAME - 1] = 0;
+	}
+	cmd_scriptpins[slot].refs++;
+
+	LeaveCriticalCode(&cmdcriticalcode);
+
+	return Cmd_CacheScript(filename);
+}
+
+/*
+==================
+Cmd_UnpinScript
+==================
+*/
+void Cmd_UnpinScript(const char *filename)
+{
+	int i;
+
+	EnterCriticalCode(&cmdcriticalcode);
+
+	for (i = 0; i < MAXSCRIPTPINS; i++) {
+		if (cmd_scriptpins[i].refs && !Q_strcmp(cmd_scriptpins[i].filename, filename)) {
+			cmd_scriptpins[i].refs--;
+			break;
+		}
+	}
+
+#ifdef PARANOID
+	if (i == MAXSCRIPTPINS)
+		Sys_Error("Cmd_UnpinScript: \"%s\" isn't pinned", filename);
+#endif
+
+	LeaveCriticalCode(&cmdcriticalcode);
+}
+
+/*
+==================
+Cmd_ScriptLineHash
+==================
+*/
+static unsigned Cmd_ScriptLineHash(cmdscript_t *script, unsigned index)
+{
+	cmdline_t *line;
+	unsigned hash, i;
+
+	line = &script->lines[index];
+	hash = line->argc;
+	for (i = 0; i < line->argc; i++)
+		hash = hash * 31 + COM_HashString(script->args[line->first + i]);
+
+	return hash;
+}
+
+/*
+==================
+Cmd_SameScriptLines
+==================
+*/
+static qboolean_t Cmd_SameScriptLines(cmdscript_t *a, unsigned aindex, cmdscript_t *b, unsigned bindex)
+{
+	cmdline_t *aline, *bline;
+	unsigned i;
+
+	aline = &a->lines[aindex];
+	bline = &b->lines[bindex];
+	if (aline->argc != bline->argc)
+		return false;
+
+	for (i = 0; i < aline->argc; i++) {
+		if (Q_strcmp(a->args[aline->first + i], b->args[bline->first + i]))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+==================
+Cmd_ExecuteScriptChanges
+
+Runs the "set <name> <value>" lines whose value differs from the live cvar value,
+so cvars changed from the console since are set back as the file says, and the
+other lines of the file that the cached version of the script doesn't have,
+wherever they have been moved to; removed lines undo nothing. Runs the whole script
+if there's no cached version, so watched scripts are to be pinned by Cmd_PinScript
+==================
+*/
+void Cmd_ExecuteScriptChanges(const char *filename)
+{
+	cmdscript_t *old, *script;
+	cmdline_t *line;
+	char *text, **args, value[MAXCMDLINE];
+	unsigned *oldhashes, size, hash, i, j;
+
+#ifdef PARANOID
+	if (!filename || !filename[0])
+		Sys_Error("Cmd_ExecuteScriptChanges: bad filename");
+#endif
+
+	if (cmd_scriptdepth >= MAXSCRIPTDEPTH) {
+		COM_Printf("Cmd_ExecuteScriptChanges: \"%s\" is nested too deep\n", filename);
+		return;
+	}
+
+	text = COM_FileData(filename, &size);
+	if (!text)
+		return;
+	if (!size) {
+		Zone_Free(text);
+		return;
+	}
+
+	EnterCriticalCode(&cmdcriticalcode);
+	for (old = cmd_scripts; old; old = old->next) {
+		if (!Q_strcmp(old->filename, filename))
+			break;
+	}
+	if (old)
+		old->busy++;                    // stays around when the new version replaces it
+	script = Cmd_AcquireScript(filename, text, size);
+	LeaveCriticalCode(&cmdcriticalcode);
+
+	Zone_Free(text);
+
+	oldhashes = 0;
+	if (old && old != script) {
+		oldhashes = Zone_Alloc((old->numlines ? old->numlines : 1) * sizeof(unsigned));
+		if (!oldhashes)
+			Sys_Error("Cmd_ExecuteScriptChanges: out of memory");
+		for (j = 0; j < old->numlines; j++)
+			oldhashes[j] = Cmd_ScriptLineHash(old, j);
+	}
+
+	cmd_scriptdepth++;
+	for (i = 0; i < script->numlines; i++) {
+		line = &script->lines[i];
+		args = &script->args[line->first];
+		if (line->argc >= 3 && !Q_strcmp(args[0], "set")) {
+			if (Cvar_VariableString(args[1], value, sizeof(value), "") && !Q_strcmp(value, args[2]))
+				continue;               // already has the value
+		} else if (old == script) {
+			continue;                   // the file is the same
+		} else if (old) {
+			hash = Cmd_ScriptLineHash(script, i);
+			for (j = 0; j < old->numlines; j++) {
+				if (oldhashes[j] == hash && Cmd_SameScriptLines(old, j, script, i))
+					break;
+			}
+			if (j < old->numlines)
+				continue;               // left as it was
+		}
+		Cmd_ExecuteScriptLine(script, i, false);
+	}
+	cmd_scriptdepth--;
+
+	if (oldhashes)
+		Zone_Free(oldhashes);
+	if (old)
+		Cmd_ReleaseScript(old);
+	Cmd_ReleaseScript(script);
+}
+
+/*
+================================================================================================
+
+ALIASES
+
+An alias body gets split by ';' and tokenized once at definition time into a single zone
+block laid out the same way as compiled scripts. Tokens holding '$' are flagged, so only
+those get substituted from the alias arguments on execution and the rest of the lines
+are dispatched right from the block without any parsing.
+
+================================================================================================
+*/
+#define MAXALIASDEPTH 16                // stops aliases executing themselves forever
+typedef struct cmdalias_s {
+	unsigned generation;                // cmd_generation the lines are resolved at
+	int busy;                           // count of running executions
+	qboolean_t orphan;                  // redefined or forgotten, freed once not busy
+
+	unsigned numlines;
+	cmdline_t *lines;
+	char **args;
+	qboolean_t *expands;                // per arg, true if it holds '$'
+	char *body;                         // as defined, for printing
+} cmdalias_t;
+static THREADLOCAL int cmd_aliasdepth;
+
+/*
+==================
+Cmd_AliasStub_f
+
+Never dispatched, aliases run through Cmd_ExecuteAlias
+==================
+*/
+static void Cmd_AliasStub_f(cmdcontext_t *ctx)
+{
+}
+
+/*
+==================
+Cmd_NextAliasCommand
+
+Copies out the command starting at pos up to ';' or line ending outside of quotes,
+returns false at the end of body
+==================
+*/
+static qboolean_t Cmd_NextAliasCommand(const char *body, unsigned *pos, char *out)
+{
+	unsigned len = 0;
+	qboolean_t quoted = false;
+	char c;
+
+	if (!body[*pos])
+		return false;
+
+	for (; (c = body[*pos]) != 0; (*pos)++) {
+		if (c == '"')
+			quoted = !quoted;
+		else if (!quoted && (c == ';' || c == '\n'))
+			break;
+
+		if (len < MAXCMDLINE - 1)
+			out[len++] = c;
+	}
+	if (c)
+		(*pos)++;
+	out[len] = 0;
+
+	return true;
+}
+
+/*
+==================
+Cmd_CompileAlias
+
+Counts everything on the first pass, fills the block on the second one
+==================
+*/
+static cmdalias_t * Cmd_CompileAlias(const char *name, const char *body)
+{
+	cmdalias_t *alias;
+	cmdline_t *line;
+	char text[MAXCMDLINE];
+	tokenview_t tokens[MAXTOKENS];
+	char *p;
+	unsigned numtokens, numlines, numargs, textsize, bodysize, pos, i;
+	int pass;
+
+	numlines = numargs = textsize = 0;
+	bodysize = Q_strlen(body) + 1;
+	alias = 0;
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			alias = Zone_Alloc(sizeof(cmdalias_t) + numlines * sizeof(cmdline_t) + numargs * (sizeof(char *) + sizeof(qboolean_t)) + textsize + bodysize);
+			if (!alias)
+				Sys_Error("Cmd_CompileAlias: out of memory for \"%s\"", name);
+			Q_memset(alias, 0, sizeof(cmdalias_t));
+			alias->generation = cmd_generation - 1;   // resolved on the first execution
+			alias->lines = (cmdline_t *)(alias + 1);
+			alias->args = (char **)(alias->lines + numlines);
+			alias->expands = (qboolean_t *)(alias->args + numargs);
+			alias->body = (char *)(alias->expands + numargs);
+			Q_memcpy(alias->body, body, bodysize);
+			p = alias->body + bodysize;
+			numlines = numargs = 0;
+		}
+
+		pos = 0;
+		while (Cmd_NextAliasCommand(body, &pos, text)) {
+			numtokens = COM_TokenizeViews(text, tokens, MAXTOKENS);
+			if (!numtokens)
+				continue;
+
+			if (pass == 0) {
+				for (i = 0; i < numtokens; i++)
+					textsize += tokens[i].length + 1;
+			} else {
+				line = &alias->lines[numlines];
+				line->cmd = 0;
+				line->argc = numtokens;
+				line->first = numargs;
+				for (i = 0; i < numtokens; i++) {
+					Q_memcpy(p, tokens[i].start, tokens[i].length);
+					p[tokens[i].length] = 0;
+					alias->args[numargs + i] = p;
+					alias->expands[numargs + i] = Q_strchr(p, '$') != 0;
+					p += tokens[i].length + 1;
+				}
+			}
+			numlines++;
+			numargs += numtokens;
+		}
+	}
+
+	alias->numlines = numlines;
+	return alias;
+}
+
+/*
+==================
+Cmd_FreeAlias
+
+The commands are expected to be locked
+==================
+*/
+static void Cmd_FreeAlias(cmdalias_t *alias)
+{
+	if (alias->busy) alias->orphan = true;
+	else             Zone_Free(alias);
+}
+
+/*
+==================
+Cmd_AcquireAlias
+
+Returns the alias of the command marked as busy, or null if it's not an alias,
+the commands are expected to be locked
+==================
+*/
+static cmdalias_t * Cmd_AcquireAlias(cmd_t *cmd)
+{
+	if (!cmd->alias)
+		return 0;
+
+	cmd->alias->busy++;
+	return cmd->alias;
+}
+
+/*
+==================
+Cmd_ReleaseAlias
+==================
+*/
+static void Cmd_ReleaseAlias(cmdalias_t *alias)
+{
+	EnterCriticalCode(&cmdcriticalcode);
+	alias->busy--;
+	if (!alias->busy && alias->orphan)
+		Zone_Free(alias);
+	LeaveCriticalCode(&cmdcriticalcode);
+}
+
+/*
+==================
+Cmd_NewAlias
+
+Defines an alias or replaces the body of an existing one
+==================
+*/
+qboolean_t Cmd_NewAlias(const char *name, const char *body)
+{
+	cmd_t *cmd;
+	cmdalias_t *alias;
+
+#ifdef PARANOID
+	if (!name || !name[0] || !body)
+		Sys_Error("Cmd_NewAlias: bad params");
+#endif
+
+	alias = Cmd_CompileAlias(name, body);
+
+	EnterCriticalCode(&cmdcriticalcode);
+
+	cmd = Cmd_FindCommand(name);
+	if (cmd && !cmd->alias) {
+		Zone_Free(alias);
+		LeaveCriticalCode(&cmdcriticalcode);
+		return false;
+	}
+
+	if (cmd) {
+		Cmd_FreeAlias(cmd->alias);
+	} else {
+		cmd = Zone_Alloc(sizeof(cmd_t));
+		if (!cmd)
+			Sys_Error("Cmd_NewAlias: out of memory");
+		Cmd_LinkCommand(cmd, name, Cmd_AliasStub_f, 0);
+		cmd_generation++;
+	}
+	cmd->alias = alias;
+
+	LeaveCriticalCode(&cmdcriticalcode);
+	return true;
+}
+
+/*
+==================
+Cmd_ExpandAliasLine
+
+Substitutes $1..$9 by the alias arguments and $* by all of them, $$ gives '$',
+a token being just $* expands into as many tokens as there are arguments,
+returns the tokens count
+==================
+*/
+static unsigned Cmd_ExpandAliasLine(cmdalias_t *alias, cmdline_t *line, char **params, unsigned numparams, char *buf, unsigned bufsize, char **out)
+{
+	unsigned count = 0, used = 0, i, j;
+	const char *s, *v;
+
+	for (i = line->first; i < line->first + line->argc && count < MAXTOKENS; i++) {
+		if (!alias->expands[i]) {
+			out[count++] = alias->args[i];
+			continue;
+		}
+
+		if (!Q_strcmp(alias->args[i], "$*")) {
+			for (j = 1; j < numparams && count < MAXTOKENS; j++)
+				out[count++] = params[j];
+			continue;
+		}
+
+		if (used >= bufsize)
+			break;
+		out[count++] = buf + used;
+		for (s = alias->args[i]; *s; s++) {
+			if (s[0] == '$' && s[1] >= '0' && s[1] <= '9') {
+				j = s[1] - '0';
+				for (v = j < numparams ? params[j] : ""; *v && used < bufsize - 1; v++)
+					buf[used++] = *v;
+				s++;
+			} else if (s[0] == '$' && s[1] == '*') {
+				for (j = 1; j < numparams; j++) {
+					if (j > 1 && used < bufsize - 1)
+						buf[used++] = ' ';
+					for (v = params[j]; *v && used < bufsize - 1; v++)
+						buf[used++] = *v;
+				}
+				s++;
+			} else {
+				if (s[0] == '$' && s[1] == '$')
+					s++;
+				if (used < bufsize - 1)
+					buf[used++] = *s;
+			}
+		}
+		buf[used++] = 0;
+	}
+
+	return count;
+}
+
+/*
+==================
+Cmd_ExecuteAlias
+
+Runs the lines of an acquired alias and releases it,
+tokens are the alias name followed by its arguments
+==================
+*/
+static void Cmd_ExecuteAlias(cmdalias_t *alias, char **tokens, unsigned numtokens, cmdsource_t source, qboolean_t buffered)
+{
+	cmdline_t *line;
+	cmdfunc_t func;
+	cmdalias_t *nested;
+	char buf[MAXCMDLINE];
+	char *args[MAXTOKENS];
+	unsigned numargs, i, j;
+
+	if (cmd_aliasdepth >= MAXALIASDEPTH) {
+		COM_Printf("Cmd_ExecuteAlias: \"%s\" is nested too deep\n", tokens[0]);
+		Cmd_ReleaseAlias(alias);
+		return;
+	}
+
+	cmd_aliasdepth++;
+	for (i = 0; i < alias->numlines; i++) {
+		line = &alias->lines[i];
+
+		for (j = line->first; j < line->first + line->argc; j++) {
+			if (alias->expands[j])
+				break;
+		}
+		if (j < line->first + line->argc) {
+			//
+			// the command name itself might be substituted, so look it up again
+			//
+			numargs = Cmd_ExpandAliasLine(alias, line, tokens, numtokens, buf, sizeof(buf), args);
+			if (numargs && args[0][0])
+				Cmd_ExecuteTokens(args, numargs, source, buffered);
+			continue;
+		}
+
+		EnterCriticalCode(&cmdcriticalcode);
+		if (alias->generation != cmd_generation) {
+			for (j = 0; j < alias->numlines; j++)
+				alias->lines[j].cmd = Cmd_FindCommand(alias->args[alias->lines[j].first]);
+			alias->generation = cmd_generation;
+		}
+		func = line->cmd ? line->cmd->func : 0;
+		nested = line->cmd ? Cmd_AcquireAlias(line->cmd) : 0;
+		LeaveCriticalCode(&cmdcriticalcode);
+
+		if (nested) Cmd_ExecuteAlias(nested, &alias->args[line->first], line->argc, source, buffered);
+		else        Cmd_Dispatch(func, &alias->args[line->first], line->argc, source, buffered);
+	}
+	cmd_aliasdepth--;
+
+	Cmd_ReleaseAlias(alias);
+}
+
+/*
+==================
+Cmd_Alias_f
+
+alias [name [body]]
+==================
+*/
+static void Cmd_Alias_f(cmdcontext_t *ctx)
+{
+	cmd_t *p;
+	char body[MAXCMDLINE];
+	unsigned i;
+
+	if (ctx->argc <= 1) {
+		EnterCriticalCode(&cmdcriticalcode);
+		for (p = cmd_commands; p; p = p->next) {
+			if (p->alias && (ctx->argc == 0 || !Q_strcmp(p->name, ctx->argv[0])))
+				ctx->printf("%s: %s\n", p->name, p->alias->body);
+		}
+		LeaveCriticalCode(&cmdcriticalcode);
+		return;
+	}
 
-	newsize = (size_t)(((float)size * 1.5f) + 1);
-	newsize += newsize % 8;
-	new = Zone_Alloc(newsize);
-	if (!new)
-		Sys_Error("Cbuf_Grow: out of memory");
+	body[0] = 0;
+	for (i = 1; i < ctx->argc; i++) {
+		if (i > 1)
+			Q_strncat(body, " ", sizeof(body) - Q_strlen(body) - 1);
+		Q_strncat(body, ctx->argv[i], sizeof(body) - Q_strlen(body) - 1);
+	}
+
+	if (!Cmd_NewAlias(ctx->argv[0], body))
+		ctx->printf("\"%s\" is a command\n", ctx->argv[0]);
+}
+
+/*
+==================
+Cmd_Unalias_f
+==================
+*/
+static void Cmd_Unalias_f(cmdcontext_t *ctx)
+{
+	cmd_t *cmd;
+	qboolean_t isalias;
+
+	if (ctx->argc == 0) {
+		ctx->printf("usage: unalias <name>\n");
+		return;
+	}
+
+	EnterCriticalCode(&cmdcriticalcode);
+	cmd = Cmd_FindCommand(ctx->argv[0]);
+	isalias = cmd && cmd->alias;
+	LeaveCriticalCode(&cmdcriticalcode);
+
+	if (!isalias) {
+		ctx->printf("\"%s\" is not an alias\n", ctx->argv[0]);
+		return;
+	}
+
+	Cmd_ForgetCommand(ctx->argv[0]);
+}
+
+/*
+================================================================================================
+
+COMMANDS BUFFER CODE
 
-	if (cmd_buf) {
-		Q_strcpy(new, cmd_buf);
-		Zone_Free(cmd_buf);
+The buffer is a bounded ring of fixed size command records. Any thread can append records
+without locking: producers claim slots by a compare-exchange on the enqueue position, and
+each slot's sequence number tells whether it's free, being written or ready. Only the frame
+thread drains the ring, so Cbuf_Clear, Cbuf_SetText and Cbuf_Execute are frame thread only.
+Records the ring has no room for spill over to a locked list of zone allocated records, which runs
+after the ring; new records keep going to the list till it drains, so they stay in order.
+
+Cbuf_Execute stops once the frame budget is spent and goes on next frame. Scripts executed
+from the buffer run line by line ahead of the remaining records, so they obey the budget too.
+Commands delayed by "at" wait on a timing wheel and get appended once due.
+
+A batch takes a single record pointing to its zone allocated text, however many lines it
+has, and counts as a single command against the budget, so it always lands in one frame.
+
+================================================================================================
+*/
+#define CBUFSLOTS     256               // power of two
+#define MAXCBUFRECORD 512
+typedef struct {
+	cmdoutput_t output;
+	int tag;
+	char text[1];                       // allocated to fit
+} cbufbatch_t;
+typedef struct {
+	volatile unsigned sequence;         // slot index if free, index + 1 once ready
+	cmdsource_t source;
+	cbufbatch_t *batch;                 // text is unused if set
+	char text[MAXCBUFRECORD];
+} cbufrecord_t;
+static cbufrecord_t cbuf_records[CBUFSLOTS];
+static volatile unsigned cbuf_enqueuepos;  // claimed by producers, positions wrap around
+static unsigned cbuf_dequeuepos;           // frame thread only
+
+typedef struct cbufspill_s {
+	struct cbufspill_s *next;
+	cmdsource_t source;
+	cbufbatch_t *batch;                 // text is unused if set
+	char text[1];                       // allocated to fit
+} cbufspill_t;
+static cbufspill_t * volatile cbuf_spillhead;    // records the ring had no room for
+static cbufspill_t *cbuf_spilltail;
+static criticalcode_t cbufspillcriticalcode;
+
+#define CBUFDEFBUDGET "2"               // msecs
+static struct {
+	cmdscript_t *script;
+	unsigned line;                      // next line to execute
+} cbuf_scripts[MAXSCRIPTDEPTH];         // deferred scripts stack, top runs first
+static int cbuf_numscripts;
+static int cbuf_waitframes;             // set by "wait"
+static cvarhandle_t cbuf_budget, cbuf_maxcmds;
+
+#define CBUFWHEELSLOTS 256              // power of two
+#define CBUFWHEELTICK  0.01             // secs per slot
+typedef struct cbuftimer_s {
+	unsigned rounds;                    // full wheel turns left
+	cmdsource_t source;
+	struct cbuftimer_s *next;
+	char text[1];                       // allocated to fit
+} cbuftimer_t;
+static cbuftimer_t *cbuf_wheel[CBUFWHEELSLOTS];
+static unsigned cbuf_wheeltick;         // all ticks up to this one are processed
+static double cbuf_wheelbase;
+static criticalcode_t cbufwheelcriticalcode;
+
+/*
+==================
+Cbuf_Wait_f
+
+Only delays the command buffer, commands run synchronously have nothing to wait for
+==================
+*/
+static void Cbuf_Wait_f(cmdcontext_t *ctx)
+{
+	int frames = 1;
+
+	if (!ctx->buffered) {
+		ctx->printf("wait is ignored outside of the command buffer\n");
+		return;
+	}
+
+	if (ctx->argc >= 1)
+		frames = Q_atoi(ctx->argv[0]);
+	if (frames < 1)
+		frames = 1;
+
+	cbuf_waitframes = frames;
+}
+
+/*
+==================
+Cbuf_At_f
+
+at <secs> <command> [args]
+==================
+*/
+static void Cbuf_At_f(cmdcontext_t *ctx)
+{
+	char text[MAXCBUFRECORD];
+	unsigned i, len, arglen;
+
+	if (ctx->argc < 2) {
+		ctx->printf("usage: at <secs> <command> [args]\n");
+		return;
+	}
+
+	//
+	// glue the command back, quoting args with blanks
+	//
+	len = 0;
+	for (i = 1; i < ctx->argc; i++) {
+		arglen = Q_strlen(ctx->argv[i]);
+		if (len + arglen + 4 > sizeof(text)) {
+			ctx->printf("command is too long\n");
+			return;
+		}
+		if (len)
+			text[len++] = ' ';
+		if (Q_strchr(ctx->argv[i], ' ') || Q_strchr(ctx->argv[i], '\t') || !arglen) {
+			text[len++] = '"';
+			Q_memcpy(text + len, ctx->argv[i], arglen);
+			len += arglen;
+			text[len++] = '"';
+		} else {
+			Q_memcpy(text + len, ctx->argv[i], arglen);
+			len += arglen;
+		}
 	}
-	cmd_buf = new;
-	cmd_bufsize = newsize;
+	text[len] = 0;
+
+	Cbuf_AppendDelayedText(ctx->source, text, (float)Q_atof(ctx->argv[0]));
+}
+
+/*
+==================
+Cbuf_Init
+==================
+*/
+static const cvardef_t cbuf_cvardefs[] = {
+	{"cbuf_budget",  CBUFDEFBUDGET, 0, &cbuf_budget},      // msecs of command execution per frame, 0 for no limit
+	{"cbuf_maxcmds", "0",           0, &cbuf_maxcmds}      // commands executed per frame, 0 for no limit
+};
+static const cmddef_t cbuf_cmddefs[] = {
+	{"wait", Cbuf_Wait_f},
+	{"at",   Cbuf_At_f}
+};
+
+void Cbuf_Init(void)
+{
+	int i;
+
+	for (i = 0; i < CBUFSLOTS; i++)
+		cbuf_records[i].sequence = i;
+	cbuf_enqueuepos = 0;
+	cbuf_dequeuepos = 0;
+
+	cbuf_wheelbase = Sys_FloatTime();
+	cbuf_wheeltick = 0;
+
+	Cvar_DefineVariables(cbuf_cvardefs, sizeof(cbuf_cvardefs) / sizeof(cbuf_cvardefs[0]));
+	Cmd_NewCommands(cbuf_cmddefs, sizeof(cbuf_cmddefs) / sizeof(cbuf_cmddefs[0]));
 	
+	COM_Printf("Command buffer initialized\n");
+}
+
+/*
+==================
+Cbuf_Shutdown
+==================
+*/
+void Cbuf_Shutdown(void)
+{
+	cbuftimer_t *timer;
+	int i;
+
+	Cbuf_Clear();
+
+	EnterCriticalCode(&cbufwheelcriticalcode);
+	for (i = 0; i < CBUFWHEELSLOTS; i++) {
+		while (cbuf_wheel[i]) {
+			timer = cbuf_wheel[i];
+			cbuf_wheel[i] = timer->next;
+			Zone_Free(timer);
+		}
+	}
+	LeaveCriticalCode(&cbufwheelcriticalcode);
+}
+
+/*
+==================
+Cbuf_PushRing
+
+Returns false if the ring is full
+==================
+*/
+static qboolean_t Cbuf_PushRing(cmdsource_t source, const char *text, unsigned length, cbufbatch_t *batch)
+{
+	cbufrecord_t *record;
+	unsigned pos;
+	int diff;
+
+	pos = cbuf_enqueuepos;
+	while (true) {
+		record = &cbuf_records[pos & (CBUFSLOTS - 1)];
+		diff = (int)(record->sequence - pos);
+		if (diff == 0) {
+			if ((unsigned)AtomicCompareExchange32((volatile int *)&cbuf_enqueuepos, (int)(pos + 1), (int)pos) == pos)
+				break;                  // slot is ours
+			pos = cbuf_enqueuepos;
+		} else if (diff < 0) {
+			return false;               // the consumer hasn't freed it yet
+		} else {
+			pos = cbuf_enqueuepos;      // another producer took it
+		}
+	}
+
+	record->source = source;
+	record->batch = batch;
+	Q_memcpy(record->text, text, length);
+	record->text[length] = 0;
+	MemoryBarrier();
+	record->sequence = pos + 1;         // publish
+
+	return true;
+}
+
+/*
+==================
+Cbuf_PushSpill
+
+Returns false if out of memory
+==================
+*/
+static qboolean_t Cbuf_PushSpill(cmdsource_t source, const char *text, unsigned length, cbufbatch_t *batch)
+{
+	cbufspill_t *spill;
+
+	spill = Zone_Alloc(sizeof(cbufspill_t) + length);
+	if (!spill)
+		return false;
+	spill->next = 0;
+	spill->source = source;
+	spill->batch = batch;
+	Q_memcpy(spill->text, text, length);
+	spill->text[length] = 0;
+
+	EnterCriticalCode(&cbufspillcriticalcode);
+	if (cbuf_spillhead) cbuf_spilltail->next = spill;
+	else                cbuf_spillhead = spill;
+	cbuf_spilltail = spill;
+	LeaveCriticalCode(&cbufspillcriticalcode);
+
+	return true;
+}
+
+/*
+==================
+Cbuf_PushRecord
+
+Goes to the spill list while it has anything, so the order is kept,
+returns false if out of memory
+==================
+*/
+static qboolean_t Cbuf_PushRecord(cmdsource_t source, const char *text, unsigned length, cbufbatch_t *batch)
+{
+	if (!cbuf_spillhead && Cbuf_PushRing(source, text, length, batch))
+		return true;
+
+	return Cbuf_PushSpill(source, text, length, batch);
+}
+
+/*
+==================
+Cbuf_PopSpill
+
+Returns null if the spill list is empty, the record is to be freed by Zone_Free
+==================
+*/
+static cbufspill_t * Cbuf_PopSpill(void)
+{
+	cbufspill_t *spill;
+
+	EnterCriticalCode(&cbufspillcriticalcode);
+	spill = cbuf_spillhead;
+	if (spill) {
+		cbuf_spillhead = spill->next;
+		if (!cbuf_spillhead)
+			cbuf_spilltail = 0;
+	}
+	LeaveCriticalCode(&cbufspillcriticalcode);
+
+	return spill;
+}
+
+/*
+==================
+Cbuf_PopRecord
+
+Returns null if nothing is ready, the record stays owned
+by the consumer till Cbuf_FreeRecord
+==================
+*/
+static cbufrecord_t * Cbuf_PopRecord(void)
+{
+	cbufrecord_t *record;
+
+	record = &cbuf_records[cbuf_dequeuepos & (CBUFSLOTS - 1)];
+	if (record->sequence != cbuf_dequeuepos + 1)
+		return 0;
+
+	MemoryBarrier();
+	return record;
+}
+
+/*
+==================
+Cbuf_FreeRecord
+==================
+*/
+static void Cbuf_FreeRecord(cbufrecord_t *record)
+{
+	record->sequence = cbuf_dequeuepos + CBUFSLOTS;
+	cbuf_dequeuepos++;
+}
+
+/*
+==================
+Cbuf_Clear
+==================
+*/
+void Cbuf_Clear(void)
+{
+	cbufrecord_t *record;
+	cbufspill_t *spill;
+
+	while ((record = Cbuf_PopRecord()) != 0) {
+		if (record->batch) {
+			record->batch->output(record->batch->tag, 0);
+			Zone_Free(record->batch);
+		}
+		Cbuf_FreeRecord(record);
+	}
+	while ((spill = Cbuf_PopSpill()) != 0) {
+		if (spill->batch) {
+			spill->batch->output(spill->batch->tag, 0);
+			Zone_Free(spill->batch);
+		}
+		Zone_Free(spill);
+	}
+
+	while (cbuf_numscripts)
+		Cmd_ReleaseScript(cbuf_scripts[--cbuf_numscripts].script);
+	cbuf_waitframes = 0;
 }
 
 /*
@@ -413,24 +2070,13 @@ Cbuf_SetText
 */
 void Cbuf_SetText(const char *string)
 {
-	unsigned len;
-	
 #ifdef PARANOID
 	if (!string || !string[0])
 		Sys_Error("Cbuf_SetText: bad string");
 #endif
 
-	EnterCriticalCode(&cmdbufcriticalcode);
-	
-	len = Q_strlen(string);
-	if (len > cmd_bufsize)
-		Cbuf_Grow(len);
-
-	Q_strcpy(cmd_buf, string);
-	cmd_buf[len] = 0;
-	cmd_bufpos += (len + 1);
-	
-	LeaveCriticalCode(&cmdbufcriticalcode);
+	Cbuf_Clear();
+	Cbuf_AppendText(string);
 }
 
 /*
@@ -440,45 +2086,294 @@ Cbuf_AppendText
 */
 void Cbuf_AppendText(const char *string)
 {
-	unsigned len;
-	char *p;
+	Cbuf_AppendSourceText(cmdsource_code, string);
+}
+
+/*
+==================
+Cbuf_AppendSourceText
+
+Every line goes as a separate record, so lines
+appended by different threads never interleave
+==================
+*/
+void Cbuf_AppendSourceText(cmdsource_t source, const char *string)
+{
+	const char *end;
+	unsigned length;
 	
 #ifdef PARANOID
 	if (!string || !string[0])
 		Sys_Error("Cbuf_AppendText: bad string");
 #endif
 
-	len = Q_strlen(string);
-	if (cmd_bufpos + len >= cmd_bufsize)
-		Cbuf_Grow(cmd_bufpos + len);
+	while (*string) {
+		for (end = string; *end && *end != '\n'; end++)
+			;
+		length = (unsigned)(end - string);
+		if (length && string[length - 1] == '\r')
+			length--;
+
+		if (length >= MAXCBUFRECORD)
+			COM_Printf("Cbuf_AppendText: line is too long, dropped \"%.32s...\"\n", string);
+		else if (length && !Cbuf_PushRecord(source, string, length, 0))
+			COM_Printf("Cbuf_AppendText: out of memory, dropped \"%.*s\"\n", (int)length, string);
+
+		string = *end ? end + 1 : end;
+	}
+}
+
+/*
+==================
+Cbuf_AppendBatch
+==================
+*/
+void Cbuf_AppendBatch(cmdsource_t source, const char *string, cmdoutput_t output, int tag)
+{
+	cbufbatch_t *batch;
+
+#ifdef PARANOID
+	if (!string || !output)
+		Sys_Error("Cbuf_AppendBatch: bad params");
+#endif
+
+	batch = Zone_Alloc(sizeof(cbufbatch_t) + Q_strlen(string));
+	if (!batch)
+		Sys_Error("Cbuf_AppendBatch: out of memory");
+	Q_strcpy(batch->text, string);
+	batch->output = output;
+	batch->tag = tag;
+
+	if (!Cbuf_PushRecord(source, "", 0, batch)) {
+		COM_Printf("Cbuf_AppendBatch: out of memory, dropped\n");
+		output(tag, "command buffer is out of memory, batch dropped\n");
+		output(tag, 0);
+		Zone_Free(batch);
+	}
+}
+
+/*
+==================
+Cbuf_AppendDelayedText
+
+The text gets appended once the delay passes
+==================
+*/
+void Cbuf_AppendDelayedText(cmdsource_t source, const char *string, float delay)
+{
+	cbuftimer_t *timer;
+	unsigned ticks, target;
 	
-	p = cmd_buf + cmd_bufpos;
-	Q_strncpy(p, string, len);
-	cmd_buf[cmd_bufpos + len] = 0;
-	cmd_bufpos += (len + 1);
+#ifdef PARANOID
+	if (!string || !string[0])
+		Sys_Error("Cbuf_AppendDelayedText: bad string");
+#endif
+
+	timer = Zone_Alloc(sizeof(cbuftimer_t) + Q_strlen(string));
+	if (!timer)
+		Sys_Error("Cbuf_AppendDelayedText: out of memory");
+	Q_strcpy(timer->text, string);
+	timer->source = source;
+
+	ticks = delay > 0 ? (unsigned)(delay / CBUFWHEELTICK) : 0;
+
+	EnterCriticalCode(&cbufwheelcriticalcode);
+
+	target = cbuf_wheeltick + (ticks ? ticks : 1);
+	timer->rounds = (target - cbuf_wheeltick - 1) / CBUFWHEELSLOTS;
+	timer->next = cbuf_wheel[target & (CBUFWHEELSLOTS - 1)];
+	cbuf_wheel[target & (CBUFWHEELSLOTS - 1)] = timer;
+
+	LeaveCriticalCode(&cbufwheelcriticalcode);
+}
+
+/*
+==================
+Cbuf_RunTimers
+
+Turns the timing wheel up to the current time
+==================
+*/
+static void Cbuf_RunTimers(void)
+{
+	cbuftimer_t *timer, **link;
+	unsigned now;
+
+	now = (unsigned)((Sys_FloatTime() - cbuf_wheelbase) / CBUFWHEELTICK);
+
+	EnterCriticalCode(&cbufwheelcriticalcode);
+
+	while ((int)(now - cbuf_wheeltick) > 0) {
+		cbuf_wheeltick++;
+
+		link = &cbuf_wheel[cbuf_wheeltick & (CBUFWHEELSLOTS - 1)];
+		while ((timer = *link) != 0) {
+			if (timer->rounds) {
+				timer->rounds--;
+				link = &timer->next;
+				continue;
+			}
+
+			*link = timer->next;
+			Cbuf_AppendSourceText(timer->source, timer->text);
+			Zone_Free(timer);
+		}
+	}
+
+	LeaveCriticalCode(&cbufwheelcriticalcode);
+}
+
+/*
+==================
+Cbuf_DeferScript
+
+Pushes a script to be executed line by line by Cbuf_Execute
+==================
+*/
+static void Cbuf_DeferScript(const char *filename)
+{
+	cmdscript_t *script;
+
+	if (cbuf_numscripts >= MAXSCRIPTDEPTH) {
+		COM_Printf("Cbuf_DeferScript: \"%s\" is nested too deep\n", filename);
+		return;
+	}
+
+	script = Cmd_LoadScript(filename);
+	if (!script)
+		return;
+
+	cbuf_scripts[cbuf_numscripts].script = script;
+	cbuf_scripts[cbuf_numscripts].line = 0;
+	cbuf_numscripts++;
+}
+
+/*
+==================
+Cbuf_ExecuteBatch
+
+Runs all the lines at once and frees the batch
+==================
+*/
+static void Cbuf_ExecuteBatch(cmdsource_t source, cbufbatch_t *batch)
+{
+	char line[MAXCMDLINE];
+	const char *p, *end;
+	unsigned length;
+
+	cmd_capture = batch->output;
+	cmd_capturetag = batch->tag;
+
+	for (p = batch->text; *p; p = *end ? end + 1 : end) {
+		for (end = p; *end && *end != '\n'; end++)
+			;
+		length = (unsigned)(end - p);
+		if (length && p[length - 1] == '\r')
+			length--;
+		if (!length)
+			continue;
+		if (length >= MAXCMDLINE) {
+			batch->output(batch->tag, "line is too long, skipped\n");
+			continue;
+		}
+
+		Q_memcpy(line, p, length);
+		line[length] = 0;
+		Cmd_ExecuteLine(line, source, true);
+	}
+
+	cmd_capture = 0;
+	batch->output(batch->tag, 0);
+	Zone_Free(batch);
 }
 
 /*
 ==================
 Cbuf_Execute
 
-executes command buffer
+Executes the records appended before the call, till the frame budget
+is spent, at least one command is always executed,
 gets called at the end of Host_Frame
 ==================
 */
 void Cbuf_Execute(void)
 {
-	char line[256];
-	unsigned pos = 0;
-	
-	EnterCriticalCode(&cmdbufcriticalcode);
+	cbufrecord_t *record;
+	cbufspill_t *spill, *spillend;
+	cbufbatch_t *batch;
+	char text[MAXCBUFRECORD];
+	cmdsource_t source;
+	float budget;
+	double start;
+	unsigned end;
+	int maxcmds, count, top;
+
+	Cbuf_RunTimers();
+
+	if (cbuf_waitframes) {
+		cbuf_waitframes--;
+		if (cbuf_waitframes)
+			return;
+	}
+
+	budget = Cvar_Float(cbuf_budget);
+	maxcmds = Cvar_Int(cbuf_maxcmds);
+	start = Sys_FloatTime();
+
+	end = cbuf_enqueuepos;              // records appended by the commands wait for the next frame
+	EnterCriticalCode(&cbufspillcriticalcode);
+	spillend = cbuf_spilltail;
+	LeaveCriticalCode(&cbufspillcriticalcode);
+	for (count = 0; !cbuf_waitframes; count++) {
+		if (count && maxcmds > 0 && count >= maxcmds)
+			break;
+		if (count && budget > 0 && (Sys_FloatTime() - start) * 1000 >= budget)
+			break;
+
+		//
+		// deferred scripts go first
+		//
+		if (cbuf_numscripts) {
+			top = cbuf_numscripts - 1;
+			if (cbuf_scripts[top].line >= cbuf_scripts[top].script->numlines) {
+				Cmd_ReleaseScript(cbuf_scripts[top].script);
+				cbuf_numscripts--;
+				continue;
+			}
 
-	while (COM_ParseLine(cmd_buf, &pos, line, sizeof(line)))
-		Cmd_Execute(line);
+			Cmd_ExecuteScriptLine(cbuf_scripts[top].script, cbuf_scripts[top].line++, true);
+			continue;
+		}
 
-	if (cmd_buf)
-		cmd_buf[0] = 0;
-	cmd_bufpos = 0;
+		//
+		// the ring goes before the spill list, free the record before
+		// executing, so commands can append freely
+		//
+		if ((int)(cbuf_dequeuepos - end) < 0) {
+			record = Cbuf_PopRecord();
+			if (!record)
+				break;                  // claimed but still being written
+
+			source = record->source;
+			batch = record->batch;
+			if (!batch)
+				Q_strcpy(text, record->text);
+			Cbuf_FreeRecord(record);
+		} else if (spillend) {
+			spill = Cbuf_PopSpill();
+			if (spill == spillend)
+				spillend = 0;
+
+			source = spill->source;
+			batch = spill->batch;
+			if (!batch)
+				Q_strcpy(text, spill->text);
+			Zone_Free(spill);
+		} else {
+			break;
+		}
 
-	LeaveCriticalCode(&cmdbufcriticalcode);
+		if (batch) Cbuf_ExecuteBatch(source, batch);
+		else       Cmd_ExecuteLine(text, source, true);
+	}
 }
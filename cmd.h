@@ -17,7 +17,8 @@ COMMANDS SYSTEM
 typedef enum {
     cmdsource_code = 0,                           // executed directly from native code
     cmdsource_console,                            // executed from developer console
-    cmdsource_script                              // executed from a script file
+    cmdsource_script,                             // executed from a script file
+    cmdsource_remote                              // executed by a local admin tool, see admin.h
 } cmdsource_t;
 
 // command execution context
@@ -26,22 +27,40 @@ typedef struct {
 	char **  argv;
 	
 	cmdsource_t source;                           // where has been called from
+	qboolean_t buffered;                          // executed by Cbuf_Execute, so can be spread over frames
 	printf_t printf;
 	printf_t devprintf;
 } cmdcontext_t;
 typedef void (*cmdfunc_t)(cmdcontext_t *ctx);
 
+// static registration table entry
+typedef struct {
+	const char *name;
+	cmdfunc_t   func;
+} cmddef_t;
+
 void Cmd_Init(void);
 void Cmd_Shutdown(void);
 
 void Cmd_Check(void);
 
 void Cmd_NewCommand(const char *name, cmdfunc_t func);
-void Cmd_ForgetCommand(const char *name);
+void Cmd_NewCommands(const cmddef_t *defs, unsigned count);            // registers a whole table at once
+void Cmd_ForgetCommand(const char *name);                             // aliases too
 void Cmd_ForgetAllCommands(void);
 
+qboolean_t Cmd_NewAlias(const char *name, const char *body);          // false if name is taken by a command
+
+unsigned Cmd_CompleteName(const char *partial, char *out, unsigned outsize);   // commands and cvars, writes out the longest common completion, returns matches count
+
 void Cmd_ExecuteCommand(const char *command);
+void Cmd_ExecuteSourceCommand(cmdsource_t source, const char *command);
 void Cmd_ExecuteScript(const char *filename);
+void Cmd_ExecuteScriptChanges(const char *filename);                  // runs only the lines not in the version cached before
+                                                                      // and the "set" lines differing from the live cvar values
+qboolean_t Cmd_CacheScript(const char *filename);                     // compiles with no execution, false if missing or empty
+qboolean_t Cmd_PinScript(const char *filename);                       // Cmd_CacheScript keeping the script out of the LRU eviction
+void Cmd_UnpinScript(const char *filename);
 
 /*
 ============================================================================================
@@ -53,10 +72,19 @@ COMMAND BUFFER
 void Cbuf_Init(void);
 void Cbuf_Shutdown(void);
 
+// appending is thread safe, it only takes a short lock once the buffer is full and lines
+// spill over to a zone allocated list; the rest is for the frame thread only
 void Cbuf_Clear(void);
 void Cbuf_SetText(const char *string);
 void Cbuf_AppendText(const char *string);
+void Cbuf_AppendSourceText(cmdsource_t source, const char *string);
+void Cbuf_AppendDelayedText(cmdsource_t source, const char *string, float delay);     // delay is in secs
+
+// batches run all their lines within a single frame, whatever the budget is, printing
+// of cmdsource_remote commands goes to output, which gets null text once the batch is done
+typedef void (*cmdoutput_t)(int tag, const char *text);
+void Cbuf_AppendBatch(cmdsource_t source, const char *string, cmdoutput_t output, int tag);
 
-void Cbuf_Execute(void);
+void Cbuf_Execute(void);                  // spends up to cbuf_budget msecs or cbuf_maxcmds commands per frame
 
 #endif // #ifdef CMD_H
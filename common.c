@@ -2,7 +2,9 @@
 
 #include "common.h"
 #include "sys.h"
+#include "cmd.h"
 #include "cvar.h"
+#include "hunk.h"
 
 /*
 ======================================================================================================
@@ -355,18 +357,18 @@ static void COM_Quit_f(cmdcontext_t *ctx)
 COM_Error_f
 =================
 */
-static void COM_Error_f(int argc, char **argv)
+static void COM_Error_f(cmdcontext_t *ctx)
 {
-	int i = 0;
+	unsigned i;
 	char error[2048] = {0};
 
-	for (i = 0; i < (argc - 1); i++) {
-		Q_strcat(error, argv[i]);
-		Q_strcat(error, " ");
+	for (i = 0; i < ctx->argc; i++) {
+		if (i)
+			Q_strncat(error, " ", sizeof(error) - Q_strlen(error) - 1);
+		Q_strncat(error, ctx->argv[i], sizeof(error) - Q_strlen(error) - 1);
 	}
-	Q_strcat(error, argv[i + 1]);
 
-	Sys_Error(error);
+	Sys_Error("%s", error);
 }
 
 /*
@@ -374,7 +376,7 @@ static void COM_Error_f(int argc, char **argv)
 COM_Abort_f
 =================
  */
-static void COM_Abort_f(int argc, char **argv)
+static void COM_Abort_f(cmdcontext_t *ctx)
 {
 	COM_Printf("** Abort invoked **\n");
 	Sys_Quit(0);
@@ -385,25 +387,42 @@ static void COM_Abort_f(int argc, char **argv)
 COM_Init
 =================
 */
+static const cmddef_t com_cmddefs[] = {
+	{"quit",  COM_Quit_f},
+	{"error", COM_Error_f},
+	{"abort", COM_Abort_f}
+};
+
 void COM_Init(void *membase, size_t memsize, const char *rootpath, const char *basedir, const char *userdir)
 {
+	char storename[MAXFILENAME];
+	const char *storesize;
+
 	//
 	// complete subsystems init
 	//	
 	Hunk_Init(membase, memsize, 0, UGLYPARAM);         // hunk memory and allocators init
 
-	Cmd_Init();                                        // command system init
+	if (COM_CheckArg("-cachestore")) {                 // persistent cache store, "-cachestore <megs>"
+		Q_snprintf(storename, MAXFILENAME, "%s\\%s", sys_usrdatapath, userdir);
+		Sys_Mkdir(storename);
+		Q_snprintf(storename, MAXFILENAME, "%s\\%s\\cache.dat", sys_usrdatapath, userdir);
 
-	Cbuf_Init();                                       // commands buffer init
+		storesize = COM_CheckArgValue("-cachestore");
+		if (storesize && Q_atoi(storesize) > 0) Cache_OpenStore(storename, (size_t)Q_atoi(storesize) * 1024 * 1024);
+		else                                    Cache_OpenStore(storename, CACHESTOREDEFSIZE);
+	}
+
+	Cmd_Init();                                        // command system init
 
 	Cvar_Init();                                       // config vars init
 
+	Cbuf_Init();                                       // commands buffer init
+
 	//
 	// register commands
 	//
-	Cmd_NewCommand("quit", &COM_Quit_f);
-	Cmd_NewCommand("error", &COM_Error_f);
-	Cmd_NewCommand("abort", &COM_Abort_f);
+	Cmd_NewCommands(com_cmddefs, sizeof(com_cmddefs) / sizeof(com_cmddefs[0]));
 }
 
 /*
@@ -419,6 +438,8 @@ void COM_Shutdown(void)
 
 	Cmd_Shutdown();
 
+	Cache_Shutdown();
+
 	if (log_enabled && logfile != BADFILE)
 		Sys_FClose(logfile);
 
@@ -476,7 +497,7 @@ Returns 0 in case given arg is not present
 */
 int COM_CheckArg(const char *arg)
 {
-	int i, out = BADRETURN;
+	int i, out = 0;
 	
 #ifdef PARANOID
 	if (!arg || !arg[0])
@@ -688,82 +709,91 @@ void COM_DevPrintf(const char *fmt, ...)
 
 /*
 =================
-COM_Parse
+COM_NextToken
 
-Tokenizes a given string into a separate pieces
-using a given delimiters string
+Skips blanks and scans one token, quoted strings go as a single token
+without quotes, "//" ends the string, returns false if no tokens left
 =================
 */
-char ** COM_Parse(const char *string, const char *delims, unsigned *o_count)
+static qboolean_t COM_NextToken(const char **string, const char **o_start, unsigned *o_length)
 {
-	unsigned i = 0;
-	const char *p = string;
-	const char *l = string;
-	char **out;
-	qboolean_t wasdelim = true;
+	const char *p = *string;
 
-#ifdef PARANOID
-	if (!string || !delims || !delims[0] || !o_count)
-		Sys_Error("COM_Parse: bad params");
-#endif
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	if (!*p || (p[0] == '/' && p[1] == '/'))
+		return false;
 
-	if (!string[0])
-		return 0;
+	if (*p == '"') {
+		*o_start = ++p;
+		while (*p && *p != '"')
+			p++;
+		*o_length = (unsigned)(p - *o_start);
+		if (*p)
+			p++;                                     // closing quote
+	} else {
+		*o_start = p;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '"')
+			p++;
+		*o_length = (unsigned)(p - *o_start);
+	}
 
-	//
-	// iterate to count tokens
-	//
-	*o_count = 0;
-	while (true) {
-		if (Q_strchr(delims, *p) || *p == 0) {
-			if (!wasdelim)
-				(*o_count)++;
+	*string = p;
+	return true;
+}
 
-			wasdelim = true;
-		} else {
-			wasdelim = false;
-		}
+/*
+=================
+COM_Tokenize
 
-		if (*p == 0)
-			break;
+Splits a string into tokens in a single pass, copying them
+null terminated into buf, never allocates, returns tokens count,
+tokens not fitting buf or maxtokens are dropped
+=================
+*/
+unsigned COM_Tokenize(const char *string, char *buf, unsigned bufsize, char **tokens, unsigned maxtokens)
+{
+	const char *start;
+	unsigned length, count = 0, used = 0;
 
-		p++;
-	}
+#ifdef PARANOID
+	if (!string || !buf || bufsize == 0 || !tokens || maxtokens == 0)
+		Sys_Error("COM_Tokenize: bad params");
+#endif
 
-	if ((*o_count) == 0)
-		return 0;
-	out = Zone_Alloc(sizeof(char *) * (*o_count));
+	while (count < maxtokens && COM_NextToken(&string, &start, &length)) {
+		if (used + length + 1 > bufsize)
+			break;
 
-	//
-	// iterate all over again to capture tokens
-	//
-	wasdelim = true;
-	while (true) {
-		if (Q_strchr(delims, *p) || *p == 0) {
-			if (wasdelims) {
-				unsigned diff = (unsigned)(p - l);
+		Q_memcpy(buf + used, start, length);
+		buf[used + length] = 0;
+		tokens[count++] = buf + used;
+		used += length + 1;
+	}
 
-				out[diff] = Zone_Alloc(diff + 1);
-				Q_strncpy(out[it], l, diff);
+	return count;
+}
 
-				l = p + 1;
-				i++;
-			} else {
-				l++;
-			}
+/*
+=================
+COM_TokenizeViews
 
-			wasdelim = true;
-		} else {
-			wasdelim = false;
-		}
+Same as above, but only points the tokens inside the string
+=================
+*/
+unsigned COM_TokenizeViews(const char *string, tokenview_t *views, unsigned maxtokens)
+{
+	unsigned count = 0;
 
-		if (*p == 0)
-			break;
+#ifdef PARANOID
+	if (!string || !views || maxtokens == 0)
+		Sys_Error("COM_TokenizeViews: bad params");
+#endif
 
-		p++;
-	}
+	while (count < maxtokens && COM_NextToken(&string, &views[count].start, &views[count].length))
+		count++;
 
-	return out;
+	return count;
 }
 
 /*
@@ -809,27 +839,6 @@ unsigned COM_ParseLine(const char *string, unsigned *pos, char *out, unsigned si
 	return total;
 }
 
-/*
-=================
-COM_FreeParse
-
-Frees up memory allocated and returned by COM_Parse
-=================
-*/
-void COM_FreeParse(char **tokens, unsigned count)
-{
-	unsigned i;
-
-#ifndef PARANOID	
-	if (!tokens || !(*tokens) || count == 0)
-		Sys_Error("COM_FreeParse: bad params");
-#endif
-
-	for (i = 0; i < count; i++)
-		Zone_Free(tokens[i]);
-	Zone_Free(tokens);
-}
-
 /*
 =================
 COM_FileExists
@@ -1133,10 +1142,47 @@ unsigned COM_FPrintf(filehandle_t id, const char *fmt, ...)
 #endif
 	
 	va_start(args, fmt);
-	Q_snprintf(buf, MAXBUF, fmt, args);
+	Q_vsnprintf(buf, MAXBUF, fmt, args);
 	va_end(args);
+	buf[MAXBUF - 1] = 0;
+
+	return Sys_FWrite(id, buf, Q_strlen(buf));
+}
+
+/*
+=================
+COM_ReplaceFile
+
+Writes the data in one go to "filename.tmp", flushes it to the disk and
+renames it over the file
+=================
+*/
+qboolean_t COM_ReplaceFile(const char *filename, const void *data, unsigned size)
+{
+	char tempname[MAXFILENAME];
+	filehandle_t file;
+	qboolean_t succeeded;
+
+#ifdef PARANOID
+	if (!filename || !filename[0] || (!data && size))
+		Sys_Error("COM_ReplaceFile: bad params");
+#endif
 
-	return Sys_FWrite(id, buf, Q_strlen(buf) + 1);
+	Q_snprintf(tempname, sizeof(tempname), "%s.tmp", filename);
+	file = Sys_FOpenForWriting(tempname, false);
+	if (file == BADFILE)
+		return false;
+	succeeded = Sys_FWrite(file, (void *)data, size) == size;
+	if (succeeded)
+		succeeded = Sys_FFlush(file);    // a crash after the rename must not leave an empty file
+	Sys_FClose(file);
+
+	if (succeeded)
+		succeeded = Sys_Rename(tempname, filename);
+	if (!succeeded)
+		Sys_Unlink(tempname);
+
+	return succeeded;
 }
 
 /*
@@ -1147,6 +1193,7 @@ COM_ComputeCRC
 unsigned COM_ComputeCRC(void *data, size_t size)
 {
 	unsigned crc = 0;
+	byte_t *p = (byte_t *)data;
 	
 #ifdef PARANOID
 	if (!data || size == 0)
@@ -1154,9 +1201,775 @@ unsigned COM_ComputeCRC(void *data, size_t size)
 #endif
 
 	while (size--) {
-		crc = (crc << 8) ^ crc_table[((crc >> 24) ^ *data) & 255];
-		data++;
+		crc = (crc << 8) ^ crc_table[((crc >> 24) ^ *p) & 255];
+		p++;
 	}
 
 	return crc;
 }
+
+/*
+=================
+COM_HashString
+
+FNV-1a hash for lookup tables, never returns 0
+=================
+*/
+unsigned COM_HashString(const char *string)
+{
+	unsigned hash = 2166136261u;
+
+#ifdef PARANOID
+	if (!string)
+		Sys_Error("COM_HashString: null string");
+#endif
+
+	while (*string) {
+		hash ^= (byte_t)*string++;
+		hash *= 16777619u;
+	}
+
+	return hash ? hash : 1;
+}
+
+/*
+======================================================================================================
+
+NAMES INDEX
+
+A radix trie over the command and cvar names, so prefix and glob queries cost the prefix
+length plus the matches instead of a full scan. Siblings are kept sorted by their first
+label char, so matches come out in alphabetical order. Nodes are compacted on removal
+to keep every inner node branching.
+
+======================================================================================================
+*/
+#define MAXINDEXNAME 64
+typedef struct namenode_s {
+	unsigned kinds;                                               // NAMEKIND_ bits of the names ending here
+	unsigned length;                                              // of the label
+	struct namenode_s *child;                                     // first one
+	struct namenode_s *sibling;
+	char label[1];                                                // allocated to fit
+} namenode_t;
+static namenode_t     names_root;
+static criticalcode_t namescriticalcode;
+
+/*
+=================
+COM_NewNameNode
+=================
+*/
+static namenode_t * COM_NewNameNode(const char *label, unsigned length, unsigned kinds)
+{
+	namenode_t *node;
+
+	node = Zone_Alloc(sizeof(namenode_t) + length);
+	if (!node)
+		Sys_Error("COM_NewNameNode: out of memory");
+	Q_memcpy(node->label, label, length);
+	node->label[length] = 0;
+	node->length = length;
+	node->kinds = kinds;
+	node->child = 0;
+	node->sibling = 0;
+
+	return node;
+}
+
+/*
+=================
+COM_IndexName
+=================
+*/
+void COM_IndexName(const char *name, unsigned kind)
+{
+	namenode_t *node, *child, *split, **link;
+	unsigned len, common;
+
+#ifdef PARANOID
+	if (!name || !name[0] || !kind)
+		Sys_Error("COM_IndexName: bad params");
+#endif
+
+	len = Q_strlen(name);
+	if (len >= MAXINDEXNAME)
+		len = MAXINDEXNAME - 1;
+
+	EnterCriticalCode(&namescriticalcode);
+
+	node = &names_root;
+	while (len) {
+		for (link = &node->child; (child = *link) != 0 && (byte_t)child->label[0] < (byte_t)name[0]; link = &child->sibling)
+			;
+
+		if (!child || child->label[0] != name[0]) {
+			child = COM_NewNameNode(name, len, kind);
+			child->sibling = *link;
+			*link = child;
+			LeaveCriticalCode(&namescriticalcode);
+			return;
+		}
+
+		for (common = 1; common < child->length && common < len && child->label[common] == name[common]; common++)
+			;
+
+		if (common < child->length) {
+			//
+			// split the label, the tail goes down keeping its kinds and children
+			//
+			split = COM_NewNameNode(child->label, common, 0);
+			split->sibling = child->sibling;
+			split->child = child;
+			child->sibling = 0;
+			child->length -= common;
+			Q_memmove(child->label, child->label + common, child->length + 1);
+			*link = split;
+			child = split;
+		}
+
+		node = child;
+		name += common;
+		len -= common;
+	}
+	node->kinds |= kind;
+
+	LeaveCriticalCode(&namescriticalcode);
+}
+
+/*
+=================
+COM_CompactNameNode
+
+Returns the node taking the place of the passed one in its parent list
+=================
+*/
+static namenode_t * COM_CompactNameNode(namenode_t *node)
+{
+	namenode_t *merged, *child;
+
+	if (node->kinds)
+		return node;
+
+	child = node->child;
+	if (!child) {
+		merged = node->sibling;
+		Zone_Free(node);
+		return merged;
+	}
+	if (child->sibling)
+		return node;
+
+	//
+	// a single child, merge it into one node
+	//
+	merged = Zone_Alloc(sizeof(namenode_t) + node->length + child->length);
+	if (!merged)
+		Sys_Error("COM_CompactNameNode: out of memory");
+	Q_memcpy(merged->label, node->label, node->length);
+	Q_memcpy(merged->label + node->length, child->label, child->length + 1);
+	merged->length = node->length + child->length;
+	merged->kinds = child->kinds;
+	merged->child = child->child;
+	merged->sibling = node->sibling;
+	Zone_Free(child);
+	Zone_Free(node);
+
+	return merged;
+}
+
+/*
+=================
+COM_UnindexName_r
+=================
+*/
+static void COM_UnindexName_r(namenode_t *node, const char *name, unsigned len, unsigned kind)
+{
+	namenode_t *child, **link;
+
+	for (link = &node->child; (child = *link) != 0; link = &child->sibling) {
+		if (child->label[0] == name[0])
+			break;
+	}
+	if (!child || child->length > len || Q_strncmp(child->label, name, child->length))
+		return;             // not indexed
+
+	if (child->length == len) child->kinds &= ~kind;
+	else                      COM_UnindexName_r(child, name + child->length, len - child->length, kind);
+
+	*link = COM_CompactNameNode(child);
+}
+
+/*
+=================
+COM_UnindexName
+=================
+*/
+void COM_UnindexName(const char *name, unsigned kind)
+{
+	unsigned len;
+
+#ifdef PARANOID
+	if (!name || !name[0] || !kind)
+		Sys_Error("COM_UnindexName: bad params");
+#endif
+
+	len = Q_strlen(name);
+	if (len >= MAXINDEXNAME)
+		len = MAXINDEXNAME - 1;
+
+	EnterCriticalCode(&namescriticalcode);
+	COM_UnindexName_r(&names_root, name, len, kind);
+	LeaveCriticalCode(&namescriticalcode);
+}
+
+/*
+=================
+COM_GlobMatch
+
+'*' matches any run of chars, '?' matches a single one
+=================
+*/
+static qboolean_t COM_GlobMatch(const char *pattern, const char *string)
+{
+	const char *star = 0, *resume = 0;
+
+	while (*string) {
+		if (*pattern == '*') {
+			star = pattern++;
+			resume = string;
+		} else if (*pattern == '?' || *pattern == *string) {
+			pattern++;
+			string++;
+		} else if (star) {
+			pattern = star + 1;
+			string = ++resume;
+		} else {
+			return false;
+		}
+	}
+	while (*pattern == '*')
+		pattern++;
+
+	return !*pattern;
+}
+
+/*
+=================
+COM_MatchNames_r
+
+Walks the subtree, name holds the path chars up to the node label
+=================
+*/
+static unsigned COM_MatchNames_r(namenode_t *node, char *name, unsigned len, const char *pattern, unsigned kinds, namefunc_t func, void *param)
+{
+	unsigned count = 0;
+
+	Q_memcpy(name + len, node->label, node->length + 1);
+	len += node->length;
+
+	if ((node->kinds & kinds) && (!pattern || COM_GlobMatch(pattern, name))) {
+		func(name, node->kinds & kinds, param);
+		count++;
+	}
+
+	for (node = node->child; node; node = node->sibling)
+		count += COM_MatchNames_r(node, name, len, pattern, kinds, func, param);
+
+	return count;
+}
+
+/*
+=================
+COM_MatchNames
+
+Calls func in alphabetical order for the names of kinds matching the pattern,
+a pattern without '*' or '?' is taken as a prefix, returns the matches count.
+The literal part before the first wildcard narrows the walk down to its subtree.
+=================
+*/
+unsigned COM_MatchNames(const char *pattern, unsigned kinds, namefunc_t func, void *param)
+{
+	namenode_t *node, *child;
+	char name[MAXINDEXNAME];
+	unsigned len, prefix, pos, count;
+	qboolean_t glob;
+
+#ifdef PARANOID
+	if (!pattern || !kinds || !func)
+		Sys_Error("COM_MatchNames: bad params");
+#endif
+
+	for (prefix = 0; pattern[prefix] && pattern[prefix] != '*' && pattern[prefix] != '?'; prefix++)
+		;
+	glob = pattern[prefix] != 0;
+	if (prefix >= MAXINDEXNAME)
+		return 0;
+
+	EnterCriticalCode(&namescriticalcode);
+
+	//
+	// go down the literal prefix, it might end in the middle of a label
+	//
+	node = &names_root;
+	len = 0;
+	name[0] = 0;
+	while (len < prefix) {
+		for (child = node->child; child; child = child->sibling) {
+			if (child->label[0] == pattern[len])
+				break;
+		}
+		if (!child) {
+			LeaveCriticalCode(&namescriticalcode);
+			return 0;
+		}
+
+		for (pos = 1; pos < child->length && len + pos < prefix; pos++) {
+			if (child->label[pos] != pattern[len + pos]) {
+				LeaveCriticalCode(&namescriticalcode);
+				return 0;
+			}
+		}
+
+		if (len + child->length > prefix)
+			break;              // the rest of the label is past the prefix
+
+		node = child;
+		Q_memcpy(name + len, child->label, child->length);
+		len += child->length;
+		name[len] = 0;
+	}
+
+	count = 0;
+	if (len < prefix) {
+		count = COM_MatchNames_r(child, name, len, glob ? pattern : 0, kinds, func, param);
+	} else {
+		if ((node->kinds & kinds) && (!glob || COM_GlobMatch(pattern, name))) {
+			func(name, node->kinds & kinds, param);
+			count++;
+		}
+		for (child = node->child; child; child = child->sibling)
+			count += COM_MatchNames_r(child, name, len, glob ? pattern : 0, kinds, func, param);
+	}
+
+	LeaveCriticalCode(&namescriticalcode);
+	return count;
+}
+
+/*
+======================================================================================================
+
+NUMBER CONVERSIONS
+
+In-house replacements for atoi/atof/sprintf on the config paths, no locale and no format parsing.
+Floats get printed as the shortest digits that read back as the same float, found the Ryu way:
+the interval of decimals rounding to the float gets scaled by a power of ten with 64-bit
+fixed point multiplications, then digits are removed while the interval still holds a number.
+
+======================================================================================================
+*/
+static const char q_digitpairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+#define FLOATMANTISSABITS   23
+#define FLOATEXPONENTBITS   8
+#define FLOATBIAS           127
+#define FLOATPOW5INVBITS    59
+#define FLOATPOW5BITS       61
+static const qw_t q_pow5invsplit[31] = {    // 2^(ceil(log2(5^i)) - 1 + FLOATPOW5INVBITS) / 5^i, rounded up
+	0x0800000000000001ull, 0x0666666666666667ull, 0x051eb851eb851eb9ull,
+	0x04189374bc6a7efaull, 0x068db8bac710cb2aull, 0x053e2d6238da3c22ull,
+	0x0431bde82d7b634eull, 0x06b5fca6af2bd216ull, 0x055e63b88c230e78ull,
+	0x044b82fa09b5a52dull, 0x06df37f675ef6eaeull, 0x057f5ff85e592558ull,
+	0x0465e6604b7a8447ull, 0x0709709a125da071ull, 0x05a126e1a84ae6c1ull,
+	0x0480ebe7b9d58567ull, 0x0734aca5f6226f0bull, 0x05c3bd5191b525a3ull,
+	0x049c97747490eae9ull, 0x0760f253edb4ab0eull, 0x05e72843249088d8ull,
+	0x04b8ed0283a6d3e0ull, 0x078e480405d7b966ull, 0x060b6cd004ac9452ull,
+	0x04d5f0a66a23a9dbull, 0x07bcb43d769f762bull, 0x063090312bb2c4efull,
+	0x04f3a68dbc8f03f3ull, 0x07ec3daf94180651ull, 0x065697bfa9acd1daull,
+	0x051212ffbaf0a7e2ull
+};
+static const qw_t q_pow5split[47] = {       // 5^i reduced to FLOATPOW5BITS bits
+	0x1000000000000000ull, 0x1400000000000000ull, 0x1900000000000000ull,
+	0x1f40000000000000ull, 0x1388000000000000ull, 0x186a000000000000ull,
+	0x1e84800000000000ull, 0x1312d00000000000ull, 0x17d7840000000000ull,
+	0x1dcd650000000000ull, 0x12a05f2000000000ull, 0x174876e800000000ull,
+	0x1d1a94a200000000ull, 0x12309ce540000000ull, 0x16bcc41e90000000ull,
+	0x1c6bf52634000000ull, 0x11c37937e0800000ull, 0x16345785d8a00000ull,
+	0x1bc16d674ec80000ull, 0x1158e460913d0000ull, 0x15af1d78b58c4000ull,
+	0x1b1ae4d6e2ef5000ull, 0x10f0cf064dd59200ull, 0x152d02c7e14af680ull,
+	0x1a784379d99db420ull, 0x108b2a2c28029094ull, 0x14adf4b7320334b9ull,
+	0x19d971e4fe8401e7ull, 0x1027e72f1f128130ull, 0x1431e0fae6d7217cull,
+	0x193e5939a08ce9dbull, 0x1f8def8808b02452ull, 0x13b8b5b5056e16b3ull,
+	0x18a6e32246c99c60ull, 0x1ed09bead87c0378ull, 0x13426172c74d822bull,
+	0x1812f9cf7920e2b6ull, 0x1e17b84357691b64ull, 0x12ced32a16a1b11eull,
+	0x178287f49c4a1d66ull, 0x1d6329f1c35ca4bfull, 0x125dfa371a19e6f7ull,
+	0x16f578c4e0a060b5ull, 0x1cb2d6f618c878e3ull, 0x11efc659cf7d4b8dull,
+	0x166bb7f0435c9e71ull, 0x1c06a5ec5433c60dull
+};
+static const double q_pow10[23] = {        // exactly representable
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+=================
+Q_itoa
+
+Two digits per division, out must hold MAXNUMBERSTRING chars
+=================
+*/
+unsigned Q_itoa(int value, char *out)
+{
+	char buf[MAXNUMBERSTRING], *p;
+	unsigned u, length;
+
+	p = buf + sizeof(buf);
+	u = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+	while (u >= 100) {
+		p -= 2;
+		Q_memcpy(p, q_digitpairs + (u % 100) * 2, 2);
+		u /= 100;
+	}
+	if (u >= 10) {
+		p -= 2;
+		Q_memcpy(p, q_digitpairs + u * 2, 2);
+	} else {
+		*--p = (char)('0' + u);
+	}
+	if (value < 0)
+		*--p = '-';
+
+	length = (unsigned)(buf + sizeof(buf) - p);
+	Q_memcpy(out, p, length);
+	out[length] = 0;
+	return length;
+}
+
+/*
+=================
+Q_Pow5Factor
+=================
+*/
+static unsigned Q_Pow5Factor(unsigned value)
+{
+	unsigned count = 0;
+
+	while (value % 5 == 0) {
+		value /= 5;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+=================
+Q_MulShift
+
+(m * factor) >> shift, shift must be over 32
+=================
+*/
+static unsigned Q_MulShift(unsigned m, qw_t factor, int shift)
+{
+	qw_t low, high;
+
+	low = (qw_t)m * (unsigned)factor;
+	high = (qw_t)m * (unsigned)(factor >> 32);
+
+	return (unsigned)(((low >> 32) + high) >> (shift - 32));
+}
+
+#define Q_POW5BITS(e)  ((int)(((unsigned)(e) * 1217359) >> 19) + 1)     // ceil(log2(5^e)), 1 for 0
+#define Q_LOG10POW2(e) ((int)(((unsigned)(e) * 78913) >> 18))          // floor(log10(2^e))
+#define Q_LOG10POW5(e) ((int)(((unsigned)(e) * 732923) >> 20))         // floor(log10(5^e))
+
+/*
+=================
+Q_ShortestDigits
+
+Returns the shortest digits of a finite non-zero float, the closest ones if there's a choice,
+the float is digits * 10^exponent
+=================
+*/
+static unsigned Q_ShortestDigits(unsigned ieeemantissa, unsigned ieeeexponent, int *o_exponent)
+{
+	unsigned m2, mv, mp, mm, vr, vp, vm, mmshift, lastremoved, output;
+	qboolean_t acceptbounds, vmtrailingzeros, vrtrailingzeros;
+	int e2, e10, q, i, k, j, removed;
+
+	if (ieeeexponent == 0) {
+		e2 = 1 - FLOATBIAS - FLOATMANTISSABITS - 2;
+		m2 = ieeemantissa;
+	} else {
+		e2 = (int)ieeeexponent - FLOATBIAS - FLOATMANTISSABITS - 2;
+		m2 = (1u << FLOATMANTISSABITS) | ieeemantissa;
+	}
+	acceptbounds = (m2 & 1) == 0;          // ties to even on reading back
+
+	//
+	// the interval in 4x units, the lower bound is closer at the powers of two
+	//
+	mv = 4 * m2;
+	mp = 4 * m2 + 2;
+	mmshift = ieeemantissa != 0 || ieeeexponent <= 1;
+	mm = 4 * m2 - 1 - mmshift;
+
+	//
+	// scale it to decimal
+	//
+	vmtrailingzeros = vrtrailingzeros = false;
+	lastremoved = 0;
+	if (e2 >= 0) {
+		q = Q_LOG10POW2(e2);
+		e10 = q;
+		k = FLOATPOW5INVBITS + Q_POW5BITS(q) - 1;
+		i = -e2 + q + k;
+		vr = Q_MulShift(mv, q_pow5invsplit[q], i);
+		vp = Q_MulShift(mp, q_pow5invsplit[q], i);
+		vm = Q_MulShift(mm, q_pow5invsplit[q], i);
+		if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+			k = FLOATPOW5INVBITS + Q_POW5BITS(q - 1) - 1;
+			lastremoved = Q_MulShift(mv, q_pow5invsplit[q - 1], -e2 + q - 1 + k) % 10;
+		}
+		if (q <= 9) {
+			if (mv % 5 == 0)        vrtrailingzeros = Q_Pow5Factor(mv) >= (unsigned)q;
+			else if (acceptbounds)  vmtrailingzeros = Q_Pow5Factor(mm) >= (unsigned)q;
+			else                    vp -= Q_Pow5Factor(mp) >= (unsigned)q;
+		}
+	} else {
+		q = Q_LOG10POW5(-e2);
+		e10 = q + e2;
+		i = -e2 - q;
+		k = Q_POW5BITS(i) - FLOATPOW5BITS;
+		j = q - k;
+		vr = Q_MulShift(mv, q_pow5split[i], j);
+		vp = Q_MulShift(mp, q_pow5split[i], j);
+		vm = Q_MulShift(mm, q_pow5split[i], j);
+		if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+			j = q - 1 - (Q_POW5BITS(i + 1) - FLOATPOW5BITS);
+			lastremoved = Q_MulShift(mv, q_pow5split[i + 1], j) % 10;
+		}
+		if (q <= 1) {
+			vrtrailingzeros = true;
+			if (acceptbounds) vmtrailingzeros = mmshift == 1;
+			else              vp--;
+		} else if (q < 31) {
+			vrtrailingzeros = (mv & ((1u << (q - 1)) - 1)) == 0;
+		}
+	}
+
+	//
+	// drop the digits while the interval still holds a number
+	//
+	removed = 0;
+	if (vmtrailingzeros || vrtrailingzeros) {
+		while (vp / 10 > vm / 10) {
+			vmtrailingzeros &= vm % 10 == 0;
+			vrtrailingzeros &= lastremoved == 0;
+			lastremoved = vr % 10;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+		if (vmtrailingzeros) {
+			while (vm % 10 == 0) {
+				vrtrailingzeros &= lastremoved == 0;
+				lastremoved = vr % 10;
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+				removed++;
+			}
+		}
+		if (vrtrailingzeros && lastremoved == 5 && vr % 2 == 0)
+			lastremoved = 4;               // exactly halfway, round to even
+		output = vr + ((vr == vm && (!acceptbounds || !vmtrailingzeros)) || lastremoved >= 5);
+	} else {
+		while (vp / 10 > vm / 10) {
+			lastremoved = vr % 10;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+		output = vr + (vr == vm || lastremoved >= 5);
+	}
+
+	*o_exponent = e10 + removed;
+	return output;
+}
+
+/*
+=================
+Q_ftoa
+
+Prints the shortest string reading back as the same float, plain for the usual magnitudes
+and as "1.5e-7" otherwise; out must hold MAXNUMBERSTRING chars, returns the length
+=================
+*/
+unsigned Q_ftoa(float value, char *out)
+{
+	union {
+		float    f;
+		unsigned u;
+	} bits;
+	char digits[MAXNUMBERSTRING], *p;
+	unsigned ieeemantissa, ieeeexponent, output, numdigits, i;
+	int exponent, point;
+
+	bits.f = value;
+	ieeemantissa = bits.u & ((1u << FLOATMANTISSABITS) - 1);
+	ieeeexponent = (bits.u >> FLOATMANTISSABITS) & ((1u << FLOATEXPONENTBITS) - 1);
+
+	p = out;
+	if (ieeeexponent == (1u << FLOATEXPONENTBITS) - 1 && ieeemantissa) {
+		Q_strcpy(out, "nan");
+		return 3;
+	}
+	if (bits.u >> 31)
+		*p++ = '-';
+	if (ieeeexponent == (1u << FLOATEXPONENTBITS) - 1) {
+		Q_strcpy(p, "inf");
+		return (unsigned)(p - out) + 3;
+	}
+	if (!ieeeexponent && !ieeemantissa) {
+		Q_strcpy(p, "0");
+		return (unsigned)(p - out) + 1;
+	}
+
+	output = Q_ShortestDigits(ieeemantissa, ieeeexponent, &exponent);
+	numdigits = Q_itoa((int)output, digits);     // 9 digits at most
+	point = (int)numdigits + exponent;           // where the decimal point goes among the digits
+
+	if (point > 9 || point < -5) {
+		*p++ = digits[0];
+		if (numdigits > 1) {
+			*p++ = '.';
+			Q_memcpy(p, digits + 1, numdigits - 1);
+			p += numdigits - 1;
+		}
+		*p++ = 'e';
+		p += Q_itoa(point - 1, p);
+		return (unsigned)(p - out);
+	}
+
+	if (point <= 0) {
+		*p++ = '0';
+		*p++ = '.';
+		for (i = 0; i < (unsigned)-point; i++)
+			*p++ = '0';
+		Q_memcpy(p, digits, numdigits);
+		p += numdigits;
+	} else if ((unsigned)point >= numdigits) {
+		Q_memcpy(p, digits, numdigits);
+		p += numdigits;
+		for (i = numdigits; i < (unsigned)point; i++)
+			*p++ = '0';
+	} else {
+		Q_memcpy(p, digits, point);
+		p += point;
+		*p++ = '.';
+		Q_memcpy(p, digits + point, numdigits - point);
+		p += numdigits - point;
+	}
+	*p = 0;
+	return (unsigned)(p - out);
+}
+
+/*
+=================
+Q_atoi
+
+Same as atoi, but wraps around on overflow
+=================
+*/
+int Q_atoi(const char *string)
+{
+	unsigned value = 0;
+	qboolean_t negative = false;
+
+	while (*string == ' ' || (*string >= '\t' && *string <= '\r'))
+		string++;
+	if (*string == '-' || *string == '+')
+		negative = *string++ == '-';
+
+	while (*string >= '0' && *string <= '9')
+		value = value * 10 + (*string++ - '0');
+
+	return negative ? (int)(0u - value) : (int)value;
+}
+
+/*
+=================
+Q_atof
+
+Decimals with up to 19 significant digits and a small exponent, which the usual
+config values are, get computed exactly in a single double operation.
+The rest goes to the CRT, so the result is always correctly rounded
+=================
+*/
+double Q_atof(const char *string)
+{
+	const char *p;
+	qw_t mantissa = 0;
+	int exponent = 0, explicitexponent = 0, significant = 0, numdigits = 0;
+	qboolean_t negative = false, exponentnegative = false, truncated = false;
+	double value;
+
+	p = string;
+	while (*p == ' ' || (*p >= '\t' && *p <= '\r'))
+		p++;
+	if (*p == '-' || *p == '+')
+		negative = *p++ == '-';
+
+	for (; *p >= '0' && *p <= '9'; p++, numdigits++) {
+		if (significant < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			significant += mantissa != 0;
+		} else {
+			exponent++;
+			truncated |= *p != '0';
+		}
+	}
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++, numdigits++) {
+			if (significant < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				significant += mantissa != 0;
+				exponent--;
+			} else {
+				truncated |= *p != '0';
+			}
+		}
+	}
+	if (!numdigits || ((*p == 'x' || *p == 'X') && numdigits == 1))
+		return atof(string);               // inf, nan or hex
+
+	if ((*p == 'e' || *p == 'E') && ((p[1] >= '0' && p[1] <= '9') ||
+		((p[1] == '-' || p[1] == '+') && p[2] >= '0' && p[2] <= '9'))) {
+		p++;
+		if (*p == '-' || *p == '+')
+			exponentnegative = *p++ == '-';
+		for (; *p >= '0' && *p <= '9'; p++) {
+			if (explicitexponent < 100000)
+				explicitexponent = explicitexponent * 10 + (*p - '0');
+		}
+		exponent += exponentnegative ? -explicitexponent : explicitexponent;
+	}
+
+	if (truncated || mantissa > ((qw_t)1 << 53) || exponent < -22 || exponent > 22) {
+		if (!mantissa && !truncated)
+			return negative ? -0.0 : 0.0;
+		return atof(string);
+	}
+
+	value = (double)(qwsigned_t)mantissa;
+	if (exponent >= 0) value *= q_pow10[exponent];
+	else               value /= q_pow10[-exponent];
+
+	return negative ? -value : value;
+}
@@ -70,6 +70,12 @@ typedef signed long long qwsigned_t;
 #endif
 typedef enum {false = 0, true} qboolean_t;
 
+#if defined(_MSC_VER)
+#define THREADLOCAL __declspec(thread)                   // a separate copy of a static variable per thread
+#else
+#define THREADLOCAL __thread
+#endif
+
 #define BADRETURN ((int)-1)                              // errcode for funcs returning signed int
 #define BADPARAM BADRETURN
 #define BADHANDLE BADRETURN
@@ -98,7 +104,9 @@ be implemented in a future.
 ============================================================================================
 */
 #define Q_memcpy memcpy
+#define Q_memmove memmove
 #define Q_memset memset
+#define Q_qsort qsort
 
 #define Q_toupper toupper
 #define Q_tolower tolower
@@ -126,8 +134,11 @@ be implemented in a future.
 #define Q_strtoul strtoul
 #define Q_strtoull strtoull
 #define Q_strtof Q_atof
-#define Q_atoi atoi
-#define Q_atof atof
+int      Q_atoi(const char *string);
+double   Q_atof(const char *string);
+#define MAXNUMBERSTRING 24                                                    // room for Q_itoa and Q_ftoa
+unsigned Q_itoa(int value, char *out);                                        // returns the length
+unsigned Q_ftoa(float value, char *out);                                      // shortest digits reading back as the same float, returns the length
 #define Q_sprintf sprintf
 #define Q_snprintf snprintf
 #define Q_vsprintf vsprintf
@@ -170,9 +181,15 @@ extern qboolean_t com_silent;                                                //
 extern qboolean_t com_error;                                                 // true if an error reporter being called
 extern qboolean_t com_error_recursive;                                       // true with com_error if an error is recursive
 
-char **  COM_Parse(const char *string, const char *delims, unsigned *o_count);
+// tokenizer, splits at blanks, keeps quoted strings whole and stops at "//"
+#define MAXTOKENS 64
+typedef struct {
+	const char *start;                                                       // not null terminated
+	unsigned    length;
+} tokenview_t;
+unsigned COM_Tokenize(const char *string, char *buf, unsigned bufsize, char **tokens, unsigned maxtokens);  // copies into buf, returns count
+unsigned COM_TokenizeViews(const char *string, tokenview_t *views, unsigned maxtokens);                     // returns count
 unsigned COM_ParseLine(const char *string, unsigned *pos, char *out, unsigned size);
-void     COM_FreeParse(char **tokens, unsigned count);                       // frees tokens got by COM_Parse
 
 // file utils
 qboolean_t COM_FileExists(const char *filename);
@@ -191,9 +208,19 @@ void COM_WipeFileExtension(char *filename);
 qboolean_t COM_FSize(filehandle_t id, unsigend *o_size);
 unsigned   COM_FReadLine(filehandle_t id, char *out, unsigned count);
 unsigned   COM_FPrintf(filehandle_t id, const char *fmt, ...);
+qboolean_t COM_ReplaceFile(const char *filename, const void *data, unsigned size);  // goes through a temporary file, so the file is never seen half-written
 
 unsigned COM_ComputeCRC(void *data, size_t size);
 unsigned COM_ComputeMD4(void *data, size_t size);
+unsigned COM_HashString(const char *string);                                 // fast non-zero hash for lookup tables
+
+// names index shared by commands and cvars, for completion and filtered listings
+#define NAMEKIND_COMMAND  (1 << 0)
+#define NAMEKIND_VARIABLE (1 << 1)
+typedef void (*namefunc_t)(const char *name, unsigned kinds, void *param);
+void     COM_IndexName(const char *name, unsigned kind);
+void     COM_UnindexName(const char *name, unsigned kind);
+unsigned COM_MatchNames(const char *pattern, unsigned kinds, namefunc_t func, void *param);   // pattern is a prefix or a glob with '*' and '?', func must not touch the index
 
 /*
 ============================================================================================
@@ -7,20 +7,57 @@
 
 #define CVARCHECKPOW 16
 
-#define MAXCVARNAME 64
-#define MAXCVARVALUE 128
-typedef struct cvar_s {
-	unsigned namecrc;
-	char     name[MAXCVARNAME];
-	
-	char value[MAXCVARSVALUE];
-	unsigned flags;
-
-	struct cvar_s *next;
-	struct cvar_s *prev;
-} cvar_t;
-static cvar_t *cvar_defined, *cvar_back;
-static cvar_t *cvar_latched;
+//
+// the cvars are kept as arrays indexed by the handles, names and values are strings
+// of any length in a single arena; a free slot has a zero hash
+//
+#define MINCVARTABLE 64                    // power of two
+#define MINCVARARENA 4096
+
+#define CVARLATCHED   (1u << 28)           // holds a value for Cvar_Frame to apply
+#define CVARUNDEFINED (1u << 29)           // set before being defined, keeps the value till then
+#define CVARWATCHED   (1u << 30)           // has a change callback
+#define CVARPENDING   (1u << 31)           // waits in the pending queue for Cvar_Frame
+
+typedef struct cvararena_s {
+	struct cvararena_s *next;              // in the retired list
+	unsigned size;
+	unsigned used;
+	unsigned garbage;                      // bytes of the strings replaced or forgotten since the last compaction
+	char     data[1];
+} cvararena_t;
+static cvararena_t * volatile cvar_arena;  // replaced as a whole when it gets compacted
+static cvararena_t *cvar_retiredarenas;    // replaced ones, lockless readers might still copy from them
+static volatile int cvar_arenareaders;     // Cvar_HandleString calls in progress
+
+cvarvalue_t *cvar_valuepages[MAXCVARPAGES];
+static unsigned cvar_numpages;
+static unsigned *cvar_hashes;              // COM_HashString of the names, 0 for free slots
+static unsigned *cvar_flags;
+static unsigned *cvar_names;               // arena offsets
+static unsigned cvar_count;                // occupied slots
+static cvarhandle_t cvar_nexthandle;       // where to look for a free slot first
+static unsigned *cvar_latches;             // arena offsets of the latched values
+#define CVARNAME(id)   (cvar_arena->data + cvar_names[id])
+#define CVARSTRING(id) (cvar_arena->data + CVARVALUE(id)->string)
+#define CVARLATCH(id)  (cvar_arena->data + cvar_latches[id])
+
+static cvarhandle_t *cvar_table;           // open addressing index over the slots, BADCVAR entries are empty
+static unsigned cvar_tablesize, cvar_tablecount;
+
+typedef struct {
+	cvarhandle_t   id;
+	cvarcallback_t callback;
+	void *         param;
+} cvarwatch_t;
+static cvarwatch_t *cvar_watches;          // few cvars have callbacks, so they are kept aside
+static unsigned cvar_numwatches, cvar_maxwatches;
+static cvarhandle_t *cvar_pending;         // changed watched cvars, in the order of change
+static unsigned cvar_pendinghead, cvar_pendingtail, cvar_pendingsize;
+static cvarhandle_t *cvar_latched;         // the batch for the next Cvar_Frame, in the order of set
+static unsigned cvar_numlatched, cvar_maxlatched;
+
+volatile unsigned cvar_epoch;
 static unsigned cvar_counter;
 static qboolean_t cvar_initialized;
 static criticalcode_t cvarcriticalcode;
@@ -36,277 +73,1397 @@ static void Cvar_Set_f(cmdcontext_t *ctx)
 		ctx->printf("missing parameters\n");
 		return;
 	}
-	
+
 	Cvar_SetVariableString(ctx->argv[0], ctx->argv[1]);
 }
 
 /*
 =================
-Cvar_LsVars_f
+Cvar_PrintName
+=================
+*/
+static void Cvar_PrintName(const char *name, unsigned kinds, void *param)
+{
+	((cmdcontext_t *)param)->printf("%s\n", name);
+}
+
+/*
+=================
+Cvar_LsVars_f
+
+lsvars [prefix | pattern]
+=================
+*/
+static void Cvar_LsVars_f(cmdcontext_t *ctx)
+{
+	unsigned count;
+
+	count = COM_MatchNames(ctx->argc ? ctx->argv[0] : "", NAMEKIND_VARIABLE, Cvar_PrintName, ctx);
+	ctx->printf("%u cvars\n", count);
+}
+
+/*
+=================
+Cvar_Init
+=================
+*/
+static const cmddef_t cvar_cmddefs[] = {
+	{"set",    Cvar_Set_f},
+	{"lsvars", Cvar_LsVars_f}
+};
+
+void Cvar_Init(void)
+{
+	Cmd_NewCommands(cvar_cmddefs, sizeof(cvar_cmddefs) / sizeof(cvar_cmddefs[0]));
+
+	cvar_initialized = true;
+	COM_Printf("Cvars cache initialized\n");
+}
+
+/*
+=================
+Cvar_FreeArenas
+=================
+*/
+static void Cvar_FreeArenas(cvararena_t *arena)
+{
+	cvararena_t *next;
+
+	for (; arena; arena = next) {
+		next = arena->next;
+		Zone_Free(arena);
+	}
+}
+
+/*
+=================
+Cvar_Shutdown
+=================
+*/
+void Cvar_Shutdown(void)
+{
+	Cvar_ForgetAllVariables();
+
+	while (cvar_numpages) {
+		cvar_numpages--;
+		Zone_Free(cvar_valuepages[cvar_numpages]);
+		cvar_valuepages[cvar_numpages] = 0;
+	}
+	if (cvar_hashes) {
+		Zone_Free(cvar_hashes);
+		Zone_Free(cvar_flags);
+		Zone_Free(cvar_names);
+		Zone_Free(cvar_latches);
+	}
+	cvar_hashes = cvar_flags = cvar_names = cvar_latches = 0;
+	cvar_nexthandle = 0;
+
+	if (cvar_arena)
+		Zone_Free(cvar_arena);
+	cvar_arena = 0;
+	Cvar_FreeArenas(cvar_retiredarenas);
+	cvar_retiredarenas = 0;
+	if (cvar_watches)
+		Zone_Free(cvar_watches);
+	cvar_watches = 0;
+	cvar_numwatches = cvar_maxwatches = 0;
+	if (cvar_pending)
+		Zone_Free(cvar_pending);
+	cvar_pending = 0;
+	cvar_pendinghead = cvar_pendingtail = cvar_pendingsize = 0;
+	if (cvar_latched)
+		Zone_Free(cvar_latched);
+	cvar_latched = 0;
+	cvar_numlatched = cvar_maxlatched = 0;
+}
+
+/*
+=================
+Cvar_FindVariable
+
+Finds defined and undefined cvars alike, returns BADCVAR if missing,
+the cvars are expected to be locked
+=================
+*/
+static cvarhandle_t Cvar_FindVariable(const char *name)
+{
+	cvarhandle_t id;
+	unsigned hash, i;
+
+	if (!cvar_tablecount)
+		return BADCVAR;
+
+	hash = COM_HashString(name);
+	for (i = hash & (cvar_tablesize - 1); (id = cvar_table[i]) != BADCVAR; i = (i + 1) & (cvar_tablesize - 1)) {
+		if (cvar_hashes[id] == hash && Q_strcmp(CVARNAME(id), name) == 0)
+			return id;
+	}
+
+	return BADCVAR;
+}
+
+/*
+=================
+Cvar_Check
+=================
+*/
+void Cvar_Check(void)
+{
+	cvarhandle_t id;
+	cvarvalue_t *v;
+	unsigned count = 0, pending = 0, watched = 0, latched = 0, live = 0, i;
+
+	EnterCriticalCode(&cvarcriticalcode);
+
+	for (id = 0; id < (cvarhandle_t)(cvar_numpages * CVARPAGESIZE); id++) {
+		if (!cvar_hashes[id])
+			continue;
+		v = CVARVALUE(id);
+
+		if (cvar_names[id] >= cvar_arena->used || v->string >= cvar_arena->used || v->length >= cvar_arena->used - v->string)
+			Sys_Error("Cvar_Check: strings of cvar %d are out of the arena", id);
+		if (!CVARNAME(id)[0] || CVARSTRING(id)[v->length] != 0)
+			Sys_Error("Cvar_Check: strings of cvar %d are corrupted", id);
+		if (cvar_hashes[id] != COM_HashString(CVARNAME(id)))
+			Sys_Error("Cvar_Check: bad hash on \"%s\"", CVARNAME(id));
+		if (Cvar_FindVariable(CVARNAME(id)) != id)
+			Sys_Error("Cvar_Check: \"%s\" is missing in the index", CVARNAME(id));
+		if (v->sequence & 1)
+			Sys_Error("Cvar_Check: \"%s\" is left being written", CVARNAME(id));
+
+		if (cvar_flags[id] & CVARPENDING)
+			pending++;
+		if (cvar_flags[id] & CVARWATCHED)
+			watched++;
+		if (cvar_flags[id] & CVARLATCHED) {
+			if (cvar_latches[id] >= cvar_arena->used)
+				Sys_Error("Cvar_Check: latched value of \"%s\" is out of the arena", CVARNAME(id));
+			live += Q_strlen(CVARLATCH(id)) + 1;
+			latched++;
+		}
+		live += Q_strlen(CVARNAME(id)) + 1 + v->length + 1;
+		count++;
+	}
+	if (count != cvar_count || count != cvar_tablecount)
+		Sys_Error("Cvar_Check: %d cvars, %d counted, %d indexed", count, cvar_count, cvar_tablecount);
+	if (cvar_arena && live + cvar_arena->garbage != cvar_arena->used)
+		Sys_Error("Cvar_Check: arena has %d bytes used, %d live, %d garbage", cvar_arena->used, live, cvar_arena->garbage);
+
+	if (watched != cvar_numwatches)
+		Sys_Error("Cvar_Check: %d cvars watched instead of %d", cvar_numwatches, watched);
+	for (i = 0; i < cvar_numwatches; i++) {
+		if (!cvar_hashes[cvar_watches[i].id] || !(cvar_flags[cvar_watches[i].id] & CVARWATCHED))
+			Sys_Error("Cvar_Check: watch %d is stale", i);
+	}
+	if (pending > cvar_pendingtail - cvar_pendinghead)
+		Sys_Error("Cvar_Check: %d cvars pending, %d queued", pending, cvar_pendingtail - cvar_pendinghead);
+	if (latched > cvar_numlatched)
+		Sys_Error("Cvar_Check: %d cvars latched, %d in the batch", latched, cvar_numlatched);
+
+	LeaveCriticalCode(&cvarcriticalcode);
+}
+
+/*
+=================
+Cvar_IndexVariable
+=================
+*/
+static void Cvar_IndexVariable(cvarhandle_t id)
+{
+	cvarhandle_t *old;
+	unsigned oldsize, i;
+
+	//
+	// keep the load under 3/4 so probe chains stay short
+	//
+	if ((cvar_tablecount + 1) * 4 > cvar_tablesize * 3) {
+		old = cvar_table;
+		oldsize = cvar_tablesize;
+
+		cvar_tablesize = oldsize ? oldsize * 2 : MINCVARTABLE;
+		cvar_table = Zone_Alloc(cvar_tablesize * sizeof(cvarhandle_t));
+		if (!cvar_table)
+			Sys_Error("Cvar_IndexVariable: out of memory");
+		Q_memset(cvar_table, 0xff, cvar_tablesize * sizeof(cvarhandle_t));    // all BADCVAR
+		cvar_tablecount = 0;
+
+		if (old) {
+			for (i = 0; i < oldsize; i++) {
+				if (old[i] != BADCVAR)
+					Cvar_IndexVariable(old[i]);
+			}
+			Zone_Free(old);
+		}
+	}
+
+	for (i = cvar_hashes[id] & (cvar_tablesize - 1); cvar_table[i] != BADCVAR; i = (i + 1) & (cvar_tablesize - 1))
+		;
+	cvar_table[i] = id;
+	cvar_tablecount++;
+}
+
+/*
+=================
+Cvar_UnindexVariable
+
+Shifts the following entries of the probe chain back,
+so no tombstones are needed
+=================
+*/
+static void Cvar_UnindexVariable(cvarhandle_t id)
+{
+	unsigned i, j, home, mask;
+
+	mask = cvar_tablesize - 1;
+	for (i = cvar_hashes[id] & mask; cvar_table[i] != id; i = (i + 1) & mask) {
+		if (cvar_table[i] == BADCVAR)
+			Sys_Error("Cvar_UnindexVariable: \"%s\" isn't indexed", CVARNAME(id));
+	}
+
+	for (j = (i + 1) & mask; cvar_table[j] != BADCVAR; j = (j + 1) & mask) {
+		home = cvar_hashes[cvar_table[j]] & mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;                      // entry is still reachable from its home slot
+
+		cvar_table[i] = cvar_table[j];
+		i = j;
+	}
+	cvar_table[i] = BADCVAR;
+	cvar_tablecount--;
+}
+
+/*
+=================
+Cvar_CompactArena
+
+Moves the live strings to a new arena big enough for need more bytes.
+The lockless readers see every sequence odd meanwhile and retry. The old arena
+is retired and freed by Cvar_Frame once no reader is in progress, so a reader
+still copying out of it gets stale bytes at worst and throws them away on the sequence check.
+The cvars are expected to be locked
+=================
+*/
+static void Cvar_CompactArena(unsigned need)
+{
+	cvararena_t *old, *new;
+	cvarhandle_t id, count;
+	cvarvalue_t *v;
+	unsigned size, length;
+
+	old = cvar_arena;
+	size = old ? old->size : MINCVARARENA;
+	while (size < ((old ? old->used - old->garbage : 0) + need) * 2)
+		size *= 2;                         // leaves room for garbage, so compactions stay rare
+
+	new = Zone_Alloc(sizeof(cvararena_t) + size);
+	if (!new)
+		Sys_Error("Cvar_CompactArena: out of memory");
+	new->next = 0;
+	new->size = size;
+	new->used = 0;
+	new->garbage = 0;
+
+	count = cvar_numpages * CVARPAGESIZE;
+	for (id = 0; id < count; id++) {
+		if (cvar_hashes[id])
+			CVARVALUE(id)->sequence++;
+	}
+	MemoryBarrier();
+
+	for (id = 0; id < count; id++) {
+		if (!cvar_hashes[id])
+			continue;
+		v = CVARVALUE(id);
+
+		length = Q_strlen(old->data + cvar_names[id]) + 1;
+		Q_memcpy(new->data + new->used, old->data + cvar_names[id], length);
+		cvar_names[id] = new->used;
+		new->used += length;
+
+		Q_memcpy(new->data + new->used, old->data + v->string, v->length + 1);
+		v->string = new->used;
+		new->used += v->length + 1;
+
+		if (cvar_flags[id] & CVARLATCHED) {
+			length = Q_strlen(old->data + cvar_latches[id]) + 1;
+			Q_memcpy(new->data + new->used, old->data + cvar_latches[id], length);
+			cvar_latches[id] = new->used;
+			new->used += length;
+		}
+	}
+	cvar_arena = new;
+
+	MemoryBarrier();
+	for (id = 0; id < count; id++) {
+		if (cvar_hashes[id])
+			CVARVALUE(id)->sequence++;
+	}
+
+	if (old) {
+		old->next = cvar_retiredarenas;
+		cvar_retiredarenas = old;
+	}
+}
+
+/*
+=================
+Cvar_ArenaReserve
+
+Compacts the arena unless it has room for need more bytes already,
+the cvars are expected to be locked
+=================
+*/
+static void Cvar_ArenaReserve(unsigned need)
+{
+	if (!cvar_arena || need > cvar_arena->size - cvar_arena->used)
+		Cvar_CompactArena(need);
+}
+
+/*
+=================
+Cvar_ArenaString
+
+Returns the offset of a copy, the room must be reserved beforehand,
+so the offsets got before stay valid
+=================
+*/
+static unsigned Cvar_ArenaString(const char *string, unsigned length)
+{
+	unsigned offset;
+
+#ifdef PARANOID
+	if (length + 1 > cvar_arena->size - cvar_arena->used)
+		Sys_Error("Cvar_ArenaString: no room reserved");
+#endif
+
+	offset = cvar_arena->used;
+	Q_memcpy(cvar_arena->data + offset, string, length);
+	cvar_arena->data[offset + length] = 0;
+	cvar_arena->used += length + 1;
+
+	return offset;
+}
+
+/*
+=================
+Cvar_PublishValue
+
+Stores the string along with the typed values parsed from it,
+the lockless readers retry if they see the sequence odd or changed.
+The cvars are expected to be locked, so there's a single writer only
+=================
+*/
+static void Cvar_PublishValue(cvarhandle_t id, const char *value)
+{
+	cvarvalue_t *v = CVARVALUE(id);
+	unsigned length, offset;
+
+	length = Q_strlen(value);
+	Cvar_ArenaReserve(length + 1);                // might move the old string as well
+	offset = Cvar_ArenaString(value, length);
+
+	v->sequence++;
+	MemoryBarrier();
+
+	cvar_arena->garbage += v->length + 1;         // the old string, readers may still copy it till the sequence check
+	v->string = offset;
+	v->length = length;
+	v->i = Q_atoi(value);
+	v->f = (float)Q_atof(value);
+	v->b = !(!value[0] || Q_stricmp(value, "0") == 0 || Q_stricmp(value, "false") == 0);
+	v->version++;
+
+	MemoryBarrier();
+	v->sequence++;
+}
+
+/*
+=================
+Cvar_FindWatch
+
+Returns the callback slot of a watched cvar
+=================
+*/
+static cvarwatch_t * Cvar_FindWatch(cvarhandle_t id)
+{
+	unsigned i;
+
+	for (i = 0; i < cvar_numwatches; i++) {
+		if (cvar_watches[i].id == id)
+			return &cvar_watches[i];
+	}
+
+	Sys_Error("Cvar_FindWatch: \"%s\" isn't watched", CVARNAME(id));
+	return 0; // unreachable...
+}
+
+/*
+=================
+Cvar_Unwatch
+=================
+*/
+static void Cvar_Unwatch(cvarhandle_t id)
+{
+	cvarwatch_t *watch;
+
+	watch = Cvar_FindWatch(id);
+	*watch = cvar_watches[--cvar_numwatches];
+	cvar_flags[id] &= ~(CVARWATCHED | CVARPENDING);      // a stale queue entry gets skipped
+}
+
+/*
+=================
+Cvar_QueueVariable
+
+Puts a cvar to the end of the pending queue,
+the cvars are expected to be locked
+=================
+*/
+static void Cvar_QueueVariable(cvarhandle_t id)
+{
+	cvarhandle_t *old;
+
+	if (cvar_pendingtail == cvar_pendingsize) {
+		if (cvar_pendinghead > cvar_pendingsize / 2) {
+			Q_memmove(cvar_pending, cvar_pending + cvar_pendinghead, (cvar_pendingtail - cvar_pendinghead) * sizeof(cvarhandle_t));
+		} else {
+			old = cvar_pending;
+			cvar_pendingsize = cvar_pendingsize ? cvar_pendingsize * 2 : 16;
+			cvar_pending = Zone_Alloc(cvar_pendingsize * sizeof(cvarhandle_t));
+			if (!cvar_pending)
+				Sys_Error("Cvar_QueueVariable: out of memory");
+			if (old) {
+				Q_memcpy(cvar_pending, old + cvar_pendinghead, (cvar_pendingtail - cvar_pendinghead) * sizeof(cvarhandle_t));
+				Zone_Free(old);
+			}
+		}
+		cvar_pendingtail -= cvar_pendinghead;
+		cvar_pendinghead = 0;
+	}
+
+	cvar_pending[cvar_pendingtail++] = id;
+	cvar_flags[id] |= CVARPENDING;
+}
+
+/*
+=================
+Cvar_ChangeValue
+
+Does nothing if the value is the same, otherwise bumps the versions
+and queues the callback, the cvars are expected to be locked
+=================
+*/
+static void Cvar_ChangeValue(cvarhandle_t id, const char *value)
+{
+	if (Q_strcmp(CVARSTRING(id), value) == 0)
+		return;
+
+	Cvar_PublishValue(id, value);
+	cvar_epoch++;
+	if ((cvar_flags[id] & (CVARWATCHED | CVARPENDING)) == CVARWATCHED)
+		Cvar_QueueVariable(id);
+}
+
+/*
+=================
+Cvar_DropLatch
+
+Throws away the latched value if any, a stale batch entry gets skipped
+=================
+*/
+static void Cvar_DropLatch(cvarhandle_t id)
+{
+	if (!(cvar_flags[id] & CVARLATCHED))
+		return;
+
+	cvar_arena->garbage += Q_strlen(CVARLATCH(id)) + 1;
+	cvar_flags[id] &= ~CVARLATCHED;
+}
+
+/*
+=================
+Cvar_LatchValue
+
+Keeps the value till Cvar_Frame applies the whole batch,
+the cvars are expected to be locked
+=================
+*/
+static void Cvar_LatchValue(cvarhandle_t id, const char *value)
+{
+	cvarhandle_t *old;
+	unsigned length;
+
+	if (Q_strcmp(CVARSTRING(id), value) == 0) {
+		Cvar_DropLatch(id);                // set back before being applied
+		return;
+	}
+	if ((cvar_flags[id] & CVARLATCHED) && Q_strcmp(CVARLATCH(id), value) == 0)
+		return;
+
+	length = Q_strlen(value);
+	Cvar_ArenaReserve(length + 1);         // might move the old latched value as well
+	if (cvar_flags[id] & CVARLATCHED) {
+		cvar_arena->garbage += Q_strlen(CVARLATCH(id)) + 1;
+		cvar_latches[id] = Cvar_ArenaString(value, length);
+		return;                            // already in the batch
+	}
+	cvar_latches[id] = Cvar_ArenaString(value, length);
+	cvar_flags[id] |= CVARLATCHED;
+
+	if (cvar_numlatched == cvar_maxlatched) {
+		old = cvar_latched;
+		cvar_maxlatched = cvar_maxlatched ? cvar_maxlatched * 2 : 16;
+		cvar_latched = Zone_Alloc(cvar_maxlatched * sizeof(cvarhandle_t));
+		if (!cvar_latched)
+			Sys_Error("Cvar_LatchValue: out of memory");
+		if (old) {
+			Q_memcpy(cvar_latched, old, cvar_numlatched * sizeof(cvarhandle_t));
+			Zone_Free(old);
+		}
+	}
+	cvar_latched[cvar_numlatched++] = id;
+}
+
+/*
+=================
+Cvar_ApplyLatched
+
+Sets all the latched values at once. A callback shared by several cvars of the batch,
+with the same param, gets queued for the first of them only, so a subsystem
+restarts once per batch. The cvars are expected to be locked
+=================
+*/
+static void Cvar_ApplyLatched(void)
+{
+	cvarwatch_t *watch, *other;
+	cvarhandle_t id;
+	unsigned length, i, j;
+
+	for (i = 0; i < cvar_numlatched; i++) {
+		id = cvar_latched[i];
+		if (!(cvar_flags[id] & CVARLATCHED))
+			continue;                      // dropped or forgotten meanwhile
+
+		length = Q_strlen(CVARLATCH(id));
+		Cvar_ArenaReserve(length + 1);     // so the latched value stays put while being published
+		cvar_flags[id] &= ~CVARLATCHED;
+		cvar_arena->garbage += length + 1;
+		Cvar_ChangeValue(id, CVARLATCH(id));
+
+		if (!(cvar_flags[id] & CVARPENDING))
+			continue;
+		watch = Cvar_FindWatch(id);
+		for (j = 0; j < i; j++) {
+			if (cvar_latched[j] == id || !(cvar_flags[cvar_latched[j]] & CVARPENDING))
+				continue;
+			other = Cvar_FindWatch(cvar_latched[j]);
+			if (other->callback == watch->callback && other->param == watch->param) {
+				cvar_flags[id] &= ~CVARPENDING;    // the queue entry gets skipped
+				break;
+			}
+		}
+	}
+
+	cvar_numlatched = 0;
+}
+
+/*
+=================
+Cvar_Reserve
+
+Makes room for count more cvars, the value pages never move once added,
+the other arrays get copied over. The cvars are expected to be locked.
+Never returns if error, but calls Sys_Error instead
+=================
+*/
+static void Cvar_Reserve(unsigned count)
+{
+	unsigned *hashes, *flags, *names, *latches;
+	unsigned oldcapacity, capacity;
+
+	oldcapacity = cvar_numpages * CVARPAGESIZE;
+	if (cvar_count + count <= oldcapacity)
+		return;
+
+	for (capacity = oldcapacity; cvar_count + count > capacity; capacity += CVARPAGESIZE) {
+		if (cvar_numpages == MAXCVARPAGES)
+			Sys_Error("Cvar_Reserve: no free handles left");
+		cvar_valuepages[cvar_numpages] = Zone_Alloc(CVARPAGESIZE * sizeof(cvarvalue_t));
+		if (!cvar_valuepages[cvar_numpages])
+			Sys_Error("Cvar_Reserve: out of memory");
+		Q_memset(cvar_valuepages[cvar_numpages], 0, CVARPAGESIZE * sizeof(cvarvalue_t));
+		cvar_numpages++;
+	}
+
+	hashes = Zone_Alloc(capacity * sizeof(unsigned));
+	flags = Zone_Alloc(capacity * sizeof(unsigned));
+	names = Zone_Alloc(capacity * sizeof(unsigned));
+	latches = Zone_Alloc(capacity * sizeof(unsigned));
+	if (!hashes || !flags || !names || !latches)
+		Sys_Error("Cvar_Reserve: out of memory");
+	Q_memset(hashes + oldcapacity, 0, (capacity - oldcapacity) * sizeof(unsigned));
+	if (cvar_hashes) {
+		Q_memcpy(hashes, cvar_hashes, oldcapacity * sizeof(unsigned));
+		Q_memcpy(flags, cvar_flags, oldcapacity * sizeof(unsigned));
+		Q_memcpy(names, cvar_names, oldcapacity * sizeof(unsigned));
+		Q_memcpy(latches, cvar_latches, oldcapacity * sizeof(unsigned));
+		Zone_Free(cvar_hashes);
+		Zone_Free(cvar_flags);
+		Zone_Free(cvar_names);
+		Zone_Free(cvar_latches);
+	}
+	cvar_hashes = hashes;
+	cvar_flags = flags;
+	cvar_names = names;
+	cvar_latches = latches;
+}
+
+/*
+=================
+Cvar_LinkVariable
+
+Puts a new undefined cvar to a free slot and to the index,
+the cvars are expected to be locked
+=================
+*/
+static cvarhandle_t Cvar_LinkVariable(const char *name)
+{
+	cvarhandle_t id, capacity;
+	cvarvalue_t *v;
+	unsigned length;
+	int i;
+
+	Cvar_Reserve(1);
+	length = Q_strlen(name);
+	Cvar_ArenaReserve(length + 2);         // the name and an empty value, nothing moves till the slot is taken
+
+	capacity = cvar_numpages * CVARPAGESIZE;
+	for (i = 0; i < capacity; i++) {
+		id = (cvar_nexthandle + i) % capacity;
+		if (!cvar_hashes[id])
+			break;
+	}
+	cvar_nexthandle = id + 1;
+
+	cvar_names[id] = Cvar_ArenaString(name, length);
+
+	v = CVARVALUE(id);
+	v->sequence++;
+	MemoryBarrier();
+	v->string = Cvar_ArenaString("", 0);
+	v->length = 0;
+	v->i = 0;
+	v->f = 0.0f;
+	v->b = false;
+	v->version++;                          // keeps counting on slot reuse, so cached versions never match by chance
+	MemoryBarrier();
+	v->sequence++;
+
+	cvar_hashes[id] = COM_HashString(name);
+	cvar_flags[id] = CVARUNDEFINED;
+	cvar_count++;
+
+	Cvar_IndexVariable(id);
+	return id;
+}
+
+/*
+=================
+Cvar_ObtainVariable
+
+Finds the cvar or adds an undefined one,
+the cvars are expected to be locked
+=================
+*/
+static cvarhandle_t Cvar_ObtainVariable(const char *name)
+{
+	cvarhandle_t id;
+
+	id = Cvar_FindVariable(name);
+	if (id == BADCVAR)
+		id = Cvar_LinkVariable(name);
+
+	return id;
+}
+
+/*
+=================
+Cvar_UnlinkVariable
+=================
+*/
+static void Cvar_UnlinkVariable(cvarhandle_t id)
+{
+	Cvar_UnindexVariable(id);
+	if (!(cvar_flags[id] & CVARUNDEFINED)) {
+		COM_UnindexName(CVARNAME(id), NAMEKIND_VARIABLE);
+		cvar_epoch++;                      // it's gone from the saved configs
+	}
+	if (cvar_flags[id] & CVARWATCHED)
+		Cvar_Unwatch(id);
+	Cvar_DropLatch(id);
+
+	cvar_arena->garbage += Q_strlen(CVARNAME(id)) + 1 + CVARVALUE(id)->length + 1;
+	cvar_hashes[id] = 0;
+	cvar_flags[id] = 0;
+	cvar_count--;
+}
+
+/*
+=================
+Cvar_SetDefined
+
+An undefined cvar keeps the value it has been set to instead of the default one,
+the cvars are expected to be locked
+=================
+*/
+static void Cvar_SetDefined(cvarhandle_t id, const char *value, unsigned flags)
+{
+	if (!(cvar_flags[id] & CVARUNDEFINED)) {
+		COM_DevPrintf("Cvar_DefineVariable: \"%s\" already defined\n", CVARNAME(id));
+		return;
+	}
+
+	if (!CVARVALUE(id)->length)
+		Cvar_ChangeValue(id, value);
+	cvar_flags[id] = (cvar_flags[id] & (CVARWATCHED | CVARPENDING)) | flags;
+
+	COM_IndexName(CVARNAME(id), NAMEKIND_VARIABLE);
+}
+
+/*
+=================
+Cvar_DefineVariable
+=================
+*/
+void Cvar_DefineVariable(const char *name, const char *value, unsigned flags)
+{
+#ifdef PARANOID
+	if (!name || !name[0])
+		Sys_Error("Cvar_DefineVariable: bad name");
+	if (!value)
+		Sys_Error("Cvar_DefineVariable: null value");
+
+	if (upow(cvar_counter, CVARCHECKPOW)) {
+		Cvar_Check();
+		cvar_counter = 0;
+	} else {
+		cvar_counter++;
+	}
+#endif
+
+	EnterCriticalCode(&cvarcriticalcode);
+	Cvar_SetDefined(Cvar_ObtainVariable(name), value, flags);
+	LeaveCriticalCode(&cvarcriticalcode);
+}
+
+/*
+=================
+Cvar_Register
+=================
+*/
+cvarhandle_t Cvar_Register(const char *name, const char *value, unsigned flags)
+{
+	cvarhandle_t id;
+
+#ifdef PARANOID
+	if (!name || !name[0] || !value)
+		Sys_Error("Cvar_Register: bad params");
+#endif
+
+	EnterCriticalCode(&cvarcriticalcode);
+
+	id = Cvar_ObtainVariable(name);
+	if (cvar_flags[id] & CVARUNDEFINED)
+		Cvar_SetDefined(id, value, flags);
+
+	LeaveCriticalCode(&cvarcriticalcode);
+
+	return id;
+}
+
+/*
+=================
+Cvar_HandleString
+
+Reads under the sequence lock, so it never blocks the writers
+nor touches anything but the slot and the arena; counts itself
+in cvar_arenareaders, so the arena it copies from is never freed meanwhile
+=================
+*/
+void Cvar_HandleString(cvarhandle_t id, char *out, unsigned outsize)
+{
+	cvararena_t *arena;
+	cvarvalue_t *v;
+	unsigned sequence, offset, size;
+
+#ifdef PARANOID
+	if (id < 0 || id >= (cvarhandle_t)(cvar_numpages * CVARPAGESIZE) || !out || outsize == 0)
+		Sys_Error("Cvar_HandleString: bad params");
+#endif
+
+	AtomicIncrement32(&cvar_arenareaders);       // a full barrier, cvar_arena is loaded after it
+
+	v = CVARVALUE(id);
+	do {
+		while ((sequence = v->sequence) & 1)
+			YieldProcessor();
+		MemoryBarrier();
+
+		arena = cvar_arena;
+		offset = v->string;
+		size = v->length < outsize - 1 ? v->length : outsize - 1;
+		if (offset > arena->size || size > arena->size - offset)
+			size = 0;                      // torn, can't happen with the sequence unchanged
+		Q_memcpy(out, arena->data + offset, size);
+
+		MemoryBarrier();
+	} while (v->sequence != sequence);
+	out[size] = 0;
+
+	AtomicDecrement32(&cvar_arenareaders);
+}
+
+/*
+=================
+Cvar_SetCallback
+=================
+*/
+void Cvar_SetCallback(cvarhandle_t id, cvarcallback_t callback, void *param)
+{
+	cvarwatch_t *watch, *old;
+
+	EnterCriticalCode(&cvarcriticalcode);
+
+#ifdef PARANOID
+	if (id < 0 || id >= (cvarhandle_t)(cvar_numpages * CVARPAGESIZE) || !cvar_hashes[id])
+		Sys_Error("Cvar_SetCallback: bad handle");
+#endif
+
+	if (!callback) {
+		if (cvar_flags[id] & CVARWATCHED)
+			Cvar_Unwatch(id);
+		LeaveCriticalCode(&cvarcriticalcode);
+		return;
+	}
+
+	if (cvar_flags[id] & CVARWATCHED) {
+		watch = Cvar_FindWatch(id);
+	} else {
+		if (cvar_numwatches == cvar_maxwatches) {
+			old = cvar_watches;
+			cvar_maxwatches = cvar_maxwatches ? cvar_maxwatches * 2 : 16;
+			cvar_watches = Zone_Alloc(cvar_maxwatches * sizeof(cvarwatch_t));
+			if (!cvar_watches)
+				Sys_Error("Cvar_SetCallback: out of memory");
+			if (old) {
+				Q_memcpy(cvar_watches, old, cvar_numwatches * sizeof(cvarwatch_t));
+				Zone_Free(old);
+			}
+		}
+		watch = &cvar_watches[cvar_numwatches++];
+		watch->id = id;
+		cvar_flags[id] |= CVARWATCHED;
+	}
+	watch->callback = callback;
+	watch->param = param;
+
+	LeaveCriticalCode(&cvarcriticalcode);
+}
+
+/*
+=================
+Cvar_Frame
+
+Frees the retired arenas unless a reader is in progress,
+applies the latched values, then runs the callbacks;
+only the cvars pending at that point get handled,
+the ones changed by the callbacks wait for the next call
+=================
+*/
+void Cvar_Frame(void)
+{
+	cvarwatch_t *watch;
+	cvarcallback_t callback;
+	void *param;
+	cvarhandle_t id;
+	unsigned count;
+
+	EnterCriticalCode(&cvarcriticalcode);
+	if (cvar_retiredarenas) {
+		MemoryBarrier();
+		if (!cvar_arenareaders) {          // a reader starting now sees the current arena only
+			Cvar_FreeArenas(cvar_retiredarenas);
+			cvar_retiredarenas = 0;
+		}
+	}
+	Cvar_ApplyLatched();
+	count = cvar_pendingtail - cvar_pendinghead;
+	LeaveCriticalCode(&cvarcriticalcode);
+
+	while (count--) {
+		EnterCriticalCode(&cvarcriticalcode);
+		if (cvar_pendinghead == cvar_pendingtail) {
+			LeaveCriticalCode(&cvarcriticalcode);
+			break;
+		}
+		id = cvar_pending[cvar_pendinghead++];
+		if (cvar_pendinghead == cvar_pendingtail)
+			cvar_pendinghead = cvar_pendingtail = 0;
+		if (!(cvar_flags[id] & CVARPENDING)) {
+			LeaveCriticalCode(&cvarcriticalcode);
+			continue;                      // forgotten or unwatched meanwhile
+		}
+		cvar_flags[id] &= ~CVARPENDING;
+		watch = Cvar_FindWatch(id);
+		callback = watch->callback;
+		param = watch->param;
+		LeaveCriticalCode(&cvarcriticalcode);
+
+		callback(id, param);
+	}
+}
+
+/*
+=================
+Cvar_DefineVariables
+
+Defines a static table in one go, the room for it is made at once
+and the lists get validated once for the whole table
 =================
 */
-static void Cvar_LsVars_f(cmdcontext_t *ctx)
+void Cvar_DefineVariables(const cvardef_t *defs, unsigned count)
 {
-	cvar_t *p;
+	cvarhandle_t id;
+	unsigned i;
+
+#ifdef PARANOID
+	if (!defs || count == 0)
+		Sys_Error("Cvar_DefineVariables: bad params");
+
+	Cvar_Check();
+#endif
 
 	EnterCriticalCode(&cvarcriticalcode);
 
-	for (p = cvar_back; p; p = p->prev)
-		ctx->printf("%s\n", p->name);
+	Cvar_Reserve(count);
+	for (i = 0; i < count; i++) {
+#ifdef PARANOID
+		if (!defs[i].name || !defs[i].name[0] || !defs[i].value)
+			Sys_Error("Cvar_DefineVariables: bad def %d", i);
+#endif
+
+		id = Cvar_ObtainVariable(defs[i].name);
+		Cvar_SetDefined(id, defs[i].value, defs[i].flags);
+		if (defs[i].handle)
+			*defs[i].handle = id;
+	}
 
 	LeaveCriticalCode(&cvarcriticalcode);
 }
 
 /*
 =================
-Cvar_Init
+Cvar_ForgetVariable
 =================
 */
-void Cvar_Init(void)
+void Cvar_ForgetVariable(const char *name)
 {
-	Cmd_NewCommand("set", Cvar_Set_f);
-	Cmd_NewCommand("lsvars", Cvar_LsVars_f);
+	cvarhandle_t id;
 
-	cvar_initialized = true;
-	COM_Printf("Cvars cache initialized\n");
+#ifdef PARANOID
+	if (!name || !name[0])
+		Sys_Error("Cvar_ForgetVariable: bad name");
+#endif
+
+	EnterCriticalCode(&cvarcriticalcode);
+
+	id = Cvar_FindVariable(name);
+	if (id != BADCVAR)
+		Cvar_UnlinkVariable(id);
+
+	LeaveCriticalCode(&cvarcriticalcode);
 }
 
 /*
 =================
-Cvar_Shutdown
+Cvar_ForgetAllVariables
 =================
 */
-void Cvar_Shutdown(void)
+void Cvar_ForgetAllVariables(void)
 {
-	Cvar_ForgetAllVariables();
+	cvarhandle_t id;
+
+	EnterCriticalCode(&cvarcriticalcode);
+
+	for (id = 0; cvar_count; id++) {
+		if (cvar_hashes[id])
+			Cvar_UnlinkVariable(id);
+	}
+
+	if (cvar_table)
+		Zone_Free(cvar_table);
+	cvar_table = 0;
+	cvar_tablesize = cvar_tablecount = 0;
+	cvar_pendinghead = cvar_pendingtail = 0;
+	cvar_numlatched = 0;
+
+	LeaveCriticalCode(&cvarcriticalcode);
 }
 
 /*
 =================
-Cvar_Check
+Cvar_PrintVariable
 =================
 */
-void Cvar_Check(void)
+void Cvar_PrintVariable(printf_t printcall, const char *name)
 {
-	cvar_t *p;
-
-	for (p = cvar_variables; p; p = p->next) {
-		if (!p->name[0])
-			Sys_Error("Cvar_Check: bad name");
-		
-		if (p->next || p->prev) {
-			if (p->next && p->next->prev != p)
-				Sys_Error("Cvar_Check: linkage currupted");
-			if (p->prev && p->next->next != p)
-				Sys_Error("Cvar_Check: linkage currupted");
-		}
+	cvarhandle_t id;
+	char *value = 0;
+
+#ifdef PARANOID
+	if (!printcall || !name || !name[0])
+		Sys_Error("Cvar_PrintVariable: bad name");
+#endif
+
+	if (!cvar_initialized)        // might be called by cmd before Cvar_Init
+		return;
+
+	EnterCriticalCode(&cvarcriticalcode);
+	id = Cvar_FindVariable(name);
+	if (id != BADCVAR) {
+		value = Zone_Alloc(CVARVALUE(id)->length + 1);
+		if (!value)
+			Sys_Error("Cvar_PrintVariable: out of memory");
+		Q_strcpy(value, CVARSTRING(id));
 	}
+	LeaveCriticalCode(&cvarcriticalcode);
+
+	if (!value)
+		return;
+
+	printcall("%s: %s\n", name, value);
+	Zone_Free(value);
 }
 
 /*
 =================
-Cvar_FindVariable
+Cvar_ComposeFile
+
+Builds the whole config in memory, so it can be written with a single call
 =================
 */
-inline cvar_t * Cvar_FindVariable(cvar_t *start, const char *name)
+unsigned Cvar_ComposeFile(char **out)
 {
-	cvar_t *p;
-	unsigned namecrc;
+	cvarhandle_t id, count;
+	char header[MAXBUF], *text;
+	const char *footer = "\n# eof";
+	unsigned size, offset, length;
+	short year, month, day;
+	short hour, minute;
+
+#ifdef PARANOID
+	if (!out)
+		Sys_Error("Cvar_ComposeFile: null out");
+
+	Cvar_Check();
+#endif
 
-	namecrc = COM_ComputeCRC(name, Q_strlen(name));
-	
-	for (p = start; p; p = p->next) {
-		if (p->namecrc == namecrc)
-			return p;
+	Sys_ObtainDate(&year, &month, &day, 0);
+	Sys_ObtainTime(&hour, &minute, 0);
+	Q_snprintf(header, sizeof(header), "# generated by " H_NAME " at %d/%d/%d, %d:%d\n# do not change manually!\n\n", year, month, day, hour, minute);
+
+	EnterCriticalCode(&cvarcriticalcode);
+
+	count = cvar_numpages * CVARPAGESIZE;
+	size = Q_strlen(header) + Q_strlen(footer);
+	for (id = 0; id < count; id++) {
+		if (cvar_hashes[id] && !(cvar_flags[id] & CVARUNDEFINED))
+			size += sizeof("set  \n") - 1 + Q_strlen(CVARNAME(id)) + CVARVALUE(id)->length;
+	}
+
+	text = Zone_Alloc(size + 1);
+	if (!text)
+		Sys_Error("Cvar_ComposeFile: out of memory");
+
+	Q_strcpy(text, header);
+	offset = Q_strlen(header);
+	for (id = 0; id < count; id++) {
+		if (!cvar_hashes[id] || (cvar_flags[id] & CVARUNDEFINED))
+			continue;
+
+		Q_memcpy(text + offset, "set ", 4);
+		offset += 4;
+		length = Q_strlen(CVARNAME(id));
+		Q_memcpy(text + offset, CVARNAME(id), length);
+		offset += length;
+		text[offset++] = ' ';
+		Q_memcpy(text + offset, CVARSTRING(id), CVARVALUE(id)->length);
+		offset += CVARVALUE(id)->length;
+		text[offset++] = '\n';
 	}
+	Q_strcpy(text + offset, footer);
+
+	LeaveCriticalCode(&cvarcriticalcode);
 
-	return 0;
+	*out = text;
+	return size;
 }
 
 /*
 =================
-Cvar_UnlinkVariable
+Cvar_WriteFile
 =================
 */
-inline void Cvar_UnlinkVariable(cvar_t *p, cvar_t **pstart, qboolean_t callfree)
+void Cvar_WriteFile(filehandle_t filehandle)
 {
-	if (p->prev) p->prev->next = p->next;
-	if (p->next) p->next->prev = p->prev;
-	if (!p->next && p->prev) *pstart = 0;
+	char *text;
+	unsigned size;
+
+#ifdef PARANOID
+	if (filehandle == BADFILE)
+		Sys_Error("Cvar_WriteFile: bad filehandle");
+#endif
+
+	COM_Printf("Cvars output...");
 
-	if (callfree) Zone_Free(p);
+	size = Cvar_ComposeFile(&text);
+	if (Sys_FWrite(filehandle, text, size) == size) COM_Printf(" succeeded\n");
+	else                                            COM_Printf(" failed\n");
+	Zone_Free(text);
 }
 
 /*
-=================
-Cvar_DefineVariable
-=================
-*/
-void Cvar_DefineVariable(const char *name, const char *value, unsigned flags)
-{
-	cvar_t *p = 0;
-	
-#ifdef PARANOID
-	if (!name || !name[0])
-		Sys_Error("Cvar_DefineVariable: bad name");
-	if (!value)
-		Sys_Error("Cvar_DefineVariable: null value");
+====================================================================================================
 
-	if (upow(cvar_counter, CVARCHECKPOW)) {
-		Cvar_Check();
-		cvar_counter = 0;
-	} else {
-		cvar_counter++;
-	}
-#endif
+SNAPSHOTS
 
-	EnterCriticalCode(&cvarcriticalcode);
+The defined cvars get dumped as a header, entries sorted by name and the strings the entries
+point to. A snapshot gets mapped and checked as a whole before anything of it is set.
 
-	p = Cvar_FindVariable(cvar_latched, name);
-	if (p) {
-		Cvar_UnlinkVariable(p, cvar_latched, false);
-	} else {
-		p = Zone_Alloc(sizeof(cvar_t));
-		if (!p) Sys_Error("Cvar_DefineVariable: out of memory");
-	}
-	
-	Q_strncpy(p->value, value, MAXCVARVALUE);
-	Q_strncpy(p->name, name, MAXCVARNAME);
-	p->namecrc = COM_ComputeCRC(p->name, Q_strlen(p->name));
-	p->flags = flags;
-	p->next = 0;
-	p->prev = cvar_defined;
-	if (cvar_defined)
-		cvar_defined->next = p;
-	cvar_defined = p;
-	if (!cvar_back)
-		cvar_back = p;
+====================================================================================================
+*/
+#define CVARSNAPSHOTIDENT   (('S' << 24) | ('V' << 16) | ('C' << 8) | 'Q')    // "QCVS"
+#define CVARSNAPSHOTVERSION 1
+typedef struct {
+	int      ident;
+	unsigned version;
+	unsigned count;                        // entries
+	unsigned size;                         // whole snapshot
+	unsigned crc;                          // of everything past the header
+} cvarsnapshotheader_t;
+typedef struct {
+	unsigned name;                         // string offsets
+	unsigned value;
+} cvarsnapshotentry_t;
 
-	LeaveCriticalCode(&cvarcriticalcode);
+/*
+=================
+Cvar_CompareNames
+=================
+*/
+static int Cvar_CompareNames(const void *a, const void *b)
+{
+	return Q_strcmp(CVARNAME(*(const cvarhandle_t *)a), CVARNAME(*(const cvarhandle_t *)b));
 }
 
 /*
 =================
-Cvar_ForgetVariable
+Cvar_SnapshotCRC
+
+An empty snapshot is just the header, with nothing to checksum
 =================
 */
-void Cvar_ForgetVariable(const char *name)
+static unsigned Cvar_SnapshotCRC(const cvarsnapshotheader_t *header, size_t size)
 {
-	cvar_t *p;
-	
-#ifndef PARANOID
-	if (!name || !name[0])
-		Sys_Error("Cvar_ForgetVariable: bad name");
-#endif
-	
-	EnterCriticalCode(&cvarcriticalcode);
-	
-	p = Cvar_FindVariable(name, cvar_defined);
-	if (p)
-		Cvar_UnlinkVariable(p, cvar_defined, true);
-	if (!cvar_defined)
-		cvar_back = 0;
-
-	LeaveCriticalCode(&cvarcriticalcode);
+	if (size <= sizeof(cvarsnapshotheader_t))
+		return 0;
+	return COM_ComputeCRC((void *)(header + 1), size - sizeof(cvarsnapshotheader_t));
 }
 
 /*
 =================
-Cvar_ForgetAllVariables
+Cvar_ComposeSnapshot
 =================
 */
-void Cvar_ForgetAllVariables(void)
+unsigned Cvar_ComposeSnapshot(void **out)
 {
-	cvar_t *p, *target;
-	
-	EnterCriticalCode(&cvarcriticalcode);
+	cvarsnapshotheader_t *header;
+	cvarsnapshotentry_t *entries;
+	cvarhandle_t id, *sorted;
+	char *strings;
+	unsigned count, size, offset, length, i;
+
+#ifdef PARANOID
+	if (!out)
+		Sys_Error("Cvar_ComposeSnapshot: null out");
+#endif
 
-	p = cvar_defined;
-	while (p) {
-		target = p;
-		p = p->next;
+	EnterCriticalCode(&cvarcriticalcode);
 
-		Cvar_UnlinkVariable(p, cvar_defined, true);
+	count = size = 0;
+	for (id = 0; id < (cvarhandle_t)(cvar_numpages * CVARPAGESIZE); id++) {
+		if (!cvar_hashes[id] || (cvar_flags[id] & CVARUNDEFINED))
+			continue;
+		count++;
+		size += Q_strlen(CVARNAME(id)) + CVARVALUE(id)->length + 2;
 	}
-	cvar_defined = 0;
-	cvar_back = 0;
-		
-	p = cvar_latched;
-	while (p) {
-		target = p;
-		p = p->next;
+	size += sizeof(cvarsnapshotheader_t) + count * sizeof(cvarsnapshotentry_t);
+
+	header = Zone_Alloc(size);
+	sorted = Zone_Alloc((count ? count : 1) * sizeof(cvarhandle_t));
+	if (!header || !sorted)
+		Sys_Error("Cvar_ComposeSnapshot: out of memory");
 
-		Cvar_UnlinkVariable(p, cvar_latched, true);
+	for (id = 0, i = 0; i < count; id++) {
+		if (cvar_hashes[id] && !(cvar_flags[id] & CVARUNDEFINED))
+			sorted[i++] = id;
+	}
+	Q_qsort(sorted, count, sizeof(cvarhandle_t), Cvar_CompareNames);
+
+	entries = (cvarsnapshotentry_t *)(header + 1);
+	strings = (char *)(entries + count);
+	offset = 0;
+	for (i = 0; i < count; i++) {
+		length = Q_strlen(CVARNAME(sorted[i])) + 1;
+		entries[i].name = offset;
+		Q_memcpy(strings + offset, CVARNAME(sorted[i]), length);
+		offset += length;
+
+		length = CVARVALUE(sorted[i])->length + 1;
+		entries[i].value = offset;
+		Q_memcpy(strings + offset, CVARSTRING(sorted[i]), length);
+		offset += length;
 	}
-	cvar_latched = 0;
 
 	LeaveCriticalCode(&cvarcriticalcode);
+
+	Zone_Free(sorted);
+
+	header->ident = CVARSNAPSHOTIDENT;
+	header->version = CVARSNAPSHOTVERSION;
+	header->count = count;
+	header->size = size;
+	header->crc = Cvar_SnapshotCRC(header, size);
+
+	*out = header;
+	return size;
 }
 
 /*
 =================
-Cvar_PrintVariable
+Cvar_WriteSnapshot
+
+Gets written to a temporary file first, so a crash never leaves a half of the snapshot
 =================
 */
-void Cvar_PrintVariable(printf_t printcall, const char *name)
+qboolean_t Cvar_WriteSnapshot(const char *filename)
 {
-	cvar_t *cvar;
-	
-#ifndef PARANOID
-	if (!printcall || !name || !name[0])
-		Sys_Error("Cvar_PrintVariable: bad name");
-#endif
-
-	if (!cvar_initialized)        // might be called by cmd before Cvar_Init
-		return;
+	void *data;
+	unsigned size;
+	qboolean_t succeeded;
 
-	EnterCriticalCode(&cvarcriticalcode);
+#ifdef PARANOID
+	if (!filename || !filename[0])
+		Sys_Error("Cvar_WriteSnapshot: bad filename");
+#endif
 
-	cvar = Cvar_FindVariable(name);
-	LeaveCriticalCode(&cvarcriticalcode);
-	
-	if (!cvar)
-		return;
+	size = Cvar_ComposeSnapshot(&data);
+	succeeded = COM_ReplaceFile(filename, data, size);
+	Zone_Free(data);
 
-	printcall("%s: %s\n", cvar->name, cvar->value);
+	return succeeded;
 }
 
 /*
 =================
-Cvar_WriteFile
+Cvar_LoadSnapshot
+
+Acts as "set" of every cvar in the snapshot, but with no parsing at all
 =================
 */
-void Cvar_WriteFile(filehandle_t filehandle)
+qboolean_t Cvar_LoadSnapshot(const char *filename)
 {
-	cvar_t *p;
-	short year, month, day;
-	short hour, minute;
-	
-#ifdef PARANOID
-	if (filehandle == BADFILE)
-		Sys_Error("Cvar_WriteFile: bad filehandle");
+	const cvarsnapshotheader_t *header;
+	const cvarsnapshotentry_t *entries;
+	const char *strings, *name, *prevname;
+	unsigned stringssize, i;
+	size_t size;
+	maphandle_t map;
 
-	Cvar_Check();
+#ifdef PARANOID
+	if (!filename || !filename[0])
+		Sys_Error("Cvar_LoadSnapshot: bad filename");
 #endif
 
-	COM_Printf("Cvars output to \"%s\"...", filename);
+	map = Sys_MapFileForReading(filename, (const void **)&header, &size);
+	if (map == BADMAPPING)
+		return false;
+
+	//
+	// check it all first
+	//
+	if (size < sizeof(cvarsnapshotheader_t) || header->ident != CVARSNAPSHOTIDENT || header->version != CVARSNAPSHOTVERSION ||
+		header->size != size || header->count > (size - sizeof(cvarsnapshotheader_t)) / sizeof(cvarsnapshotentry_t) ||
+		header->crc != Cvar_SnapshotCRC(header, size)) {
+		COM_Printf("Cvar_LoadSnapshot: \"%s\" is damaged or outdated\n", filename);
+		Sys_UnmapFile(map);
+		return false;
+	}
 
-	Sys_ObtainDate(&year, &month, &day, 0);
-	Sys_ObtainTime(&hour, &minute, 0);
+	entries = (const cvarsnapshotentry_t *)(header + 1);
+	strings = (const char *)(entries + header->count);
+	stringssize = (unsigned)(size - ((const char *)strings - (const char *)header));
+
+	prevname = 0;
+	for (i = 0; i < header->count; i++) {
+		if (strings[stringssize - 1] != 0 || entries[i].name >= stringssize || entries[i].value >= stringssize)
+			break;                         // all the strings end up terminated then
+		name = strings + entries[i].name;
+		if (!name[0] || (prevname && Q_strcmp(prevname, name) >= 0))
+			break;
+		prevname = name;
+	}
+	if (i < header->count) {
+		COM_Printf("Cvar_LoadSnapshot: \"%s\" has a bad entry %d\n", filename, i);
+		Sys_UnmapFile(map);
+		return false;
+	}
+
+	//
+	// set
+	//
+	EnterCriticalCode(&cvarcriticalcode);
+	Cvar_Reserve(header->count);
+	for (i = 0; i < header->count; i++)
+		Cvar_ChangeValue(Cvar_ObtainVariable(strings + entries[i].name), strings + entries[i].value);
+	LeaveCriticalCode(&cvarcriticalcode);
+
+	Sys_UnmapFile(map);
+	return true;
+}
+
+/*
+=================
+Cvar_VariableValue
 
-	COM_FPrintf(filehandle, "# generated by " H_NAME " at %d/%d/%d, %d:%d\n", year, month, day, hour, minute);
-	COM_FPrintf(filehandle, "# do not change manually!\n\n");
+Copies out the value, the cvars must not be locked
+=================
+*/
+static qboolean_t Cvar_VariableValue(const char *name, char *out, unsigned outsize)
+{
+	cvarhandle_t id;
 
 	EnterCriticalCode(&cvarcriticalcode);
-	
-	for (p = cvar_back; p; p = p->prev)
-		COM_FPrintf(filehandle, "set %s %s\n", p->name, p->value);
+
+	id = Cvar_FindVariable(name);
+	if (id != BADCVAR) {
+		Q_strncpy(out, CVARSTRING(id), outsize);
+		out[outsize - 1] = 0;
+	}
 
 	LeaveCriticalCode(&cvarcriticalcode);
-	
-	COM_FPrintf(filehandle, "\n# eof");
-	
-	COM_Printf(" succeeded\n");
+
+	return id != BADCVAR;
 }
 
 /*
@@ -316,26 +1473,37 @@ Cvar_VariableString
 */
 qboolean_t Cvar_VariableString(const char *name, char *out, unsigned outsize, const char *def)
 {
-	cvar_t *cvar;
-	
-#ifndef PARANOID
+#ifdef PARANOID
 	if (!name || !name[0] || !out || outsize == 0)
 		Sys_Error("Cvar_VariableString: bad params");
 #endif
 
-	EnterCriticalCode(&cvarcriticalcode);
+	if (Cvar_VariableValue(name, out, outsize))
+		return true;
 
-	cvar = Cvar_FindVariable(cvar_defined, name);
-	if (!cvar) cvar = Cvar_FindVariable(cvar_latched, name);
-	if (!cvar) Q_strcpy(out, def, outsize);
-	else       Q_strcpy(out, cvar->value, outsize);
+	Q_strncpy(out, def, outsize);
+	out[outsize - 1] = 0;
+	return false;
+}
+
+/*
+=================
+Cvar_VariableHandle
+
+Returns BADCVAR if missing, the cvars must not be locked
+=================
+*/
+static cvarhandle_t Cvar_VariableHandle(const char *name)
+{
+	cvarhandle_t id;
 
+	EnterCriticalCode(&cvarcriticalcode);
+	id = Cvar_FindVariable(name);
 	LeaveCriticalCode(&cvarcriticalcode);
 
-	if (cvar) return true;
-	else      return false;
+	return id;
 }
-	
+
 /*
 =================
 Cvar_VariableInt
@@ -343,24 +1511,21 @@ Cvar_VariableInt
 */
 qboolean_t Cvar_VariableInt(const char *name, int *out, int def)
 {
-	cvar_t *cvar;
-	
-#ifndef PARANOID
+	cvarhandle_t id;
+
+#ifdef PARANOID
 	if (!name || !name[0] || !out)
 		Sys_Error("Cvar_VariableInt: bad params");
 #endif
 
-	EnterCriticalCode(&cvarcriticalcode);
-
-	cvar = Cvar_FindVariable(cvar_defined, name);
-	if (!cvar) cvar = Cvar_FindVariable(cvar_latched, name);
-	if (!cvar) *out = def;
-	else       *out = Q_atoi(cvar->value);
-
-	LeaveCriticalCode(&cvarcriticalcode);
+	id = Cvar_VariableHandle(name);
+	if (id == BADCVAR) {
+		*out = def;
+		return false;
+	}
 
-	if (cvar) return true;
-	else      return false;
+	*out = Cvar_Int(id);
+	return true;
 }
 
 /*
@@ -370,24 +1535,21 @@ Cvar_VariableFloat
 */
 qboolean_t Cvar_VariableFloat(const char *name, float *out, float def)
 {
-	cvar_t *cvar;
-	
-ifndef PARANOID
+	cvarhandle_t id;
+
+#ifdef PARANOID
 	if (!name || !name[0] || !out)
 		Sys_Error("Cvar_VariableFloat: bad params");
 #endif
 
-	EnterCriticalCode(&cvarcriticalcode);
-
-	cvar = Cvar_FindVariable(cvar_defined, name);
-	if (!cvar) cvar = Cvar_FindVariable(cvar_latched, name);
-	if (!cvar) *out = def;
-	else       *out = Q_atof(cvar->value);
-
-	LeaveCriticalCode(&cvarcriticalcode);
+	id = Cvar_VariableHandle(name);
+	if (id == BADCVAR) {
+		*out = def;
+		return false;
+	}
 
-	if (cvar) return true;
-	else      return false;
+	*out = Cvar_Float(id);
+	return true;
 }
 
 /*
@@ -397,24 +1559,48 @@ Cvar_VariableBoolean
 */
 qboolean_t Cvar_VariableBoolean(const char *name, qboolean_t *out, qboolean_t def)
 {
-	cvar_t *cvar;
-	
-#ifndef PARANOID
+	cvarhandle_t id;
+
+#ifdef PARANOID
 	if (!name || !name[0] || !out)
 		Sys_Error("Cvar_VariableBoolean: bad params");
 #endif
 
+	id = Cvar_VariableHandle(name);
+	if (id == BADCVAR) {
+		*out = def;
+		return false;
+	}
+
+	*out = Cvar_Bool(id);
+	return true;
+}
+
+/*
+=================
+Cvar_SetVariableValue
+
+Setting a missing cvar keeps the value till it gets defined,
+returns false in that case; a latched cvar gets the value on the next Cvar_Frame
+=================
+*/
+static qboolean_t Cvar_SetVariableValue(const char *name, const char *value)
+{
+	cvarhandle_t id;
+	qboolean_t defined;
+
 	EnterCriticalCode(&cvarcriticalcode);
 
-	cvar = Cvar_FindVariable(cvar_defined, name);
-	if (!cvar) cvar = Cvar_FindVariable(cvar_latched, name);
-	if (!cvar) *out = def;
-	else       *out = !(Q_stricmp(cvar->value, "0") == 0 || Q_stricmp(cvar->value, "false"));
+	id = Cvar_ObtainVariable(name);
+	if (cvar_flags[id] & CVAR_LATCH)
+		Cvar_LatchValue(id, value);
+	else
+		Cvar_ChangeValue(id, value);
+	defined = !(cvar_flags[id] & CVARUNDEFINED);
 
 	LeaveCriticalCode(&cvarcriticalcode);
 
-	if (cvar) return true;
-	else      return false;
+	return defined;
 }
 
 /*
@@ -424,29 +1610,14 @@ Cvar_SetVariableString
 */
 qboolean_t Cvar_SetVariableString(const char *name, const char *value)
 {
-	cvar_t *cvar;
-	
-#ifndef PARANOID
-	if (!name || !name[0] || !value || !value[0])
+#ifdef PARANOID
+	if (!name || !name[0] || !value)
 		Sys_Error("Cvar_SetVariableString: bad params");
 #endif
 
-	EnterCriticalCode(&cvarcriticalcode);
-
-	cvar = Cvar_FindVariable(cvar_defined, name);
-	if (!cvar) cvar = Cvar_FindVariable(cvar_latched, name);
-	if (!cvar) {
-		COM_DevPrintf("Cvar_SetVariableString: cvar \"%s\" missing\n", name);
-	} else {
-		Q_strncpy(cvar->value, value, MAXCVARVALUE);
-	}
-
-	LeaveCriticalCode(&cvarcriticalcode);
-
-	if (cvar) return true;
-	else      return false;
+	return Cvar_SetVariableValue(name, value);
 }
-	
+
 /*
 =================
 Cvar_SetVariableInt
@@ -454,27 +1625,15 @@ Cvar_SetVariableInt
 */
 qboolean_t Cvar_SetVariableInt(const char *name, int value)
 {
-	cvar_t *cvar;
+	char buf[MAXNUMBERSTRING];
 
-#ifndef PARANOID
+#ifdef PARANOID
 	if (!name || !name[0])
 		Sys_Error("Cvar_SetVariableInt: bad params");
 #endif
 
-	EnterCriticalCode(&cvarcriticalcode);
-
-	cvar = Cvar_FindVariable(cvar_defined, name);
-	if (!cvar) cvar = Cvar_FindVariable(cvar_latched, name);
-	if (!cvar) {
-		COM_DevPrintf("Cvar_SetVariableInt: cvar \"%s\" missing\n", name);
-	} else {
-		Q_snprintf(cvar->value, "%d", value);
-	}
-
-	LeaveCriticalCode(&cvarcriticalcode);
-
-	if (cvar) return true;
-	else      return false;
+	Q_itoa(value, buf);
+	return Cvar_SetVariableValue(name, buf);
 }
 
 /*
@@ -484,29 +1643,17 @@ Cvar_SetVariableFloat
 */
 qboolean_t Cvar_SetVariableFloat(const char *name, float value)
 {
-	cvar_t *cvar;
+	char buf[MAXNUMBERSTRING];
 
-#ifndef PARANOID
+#ifdef PARANOID
 	if (!name || !name[0])
 		Sys_Error("Cvar_SetVariableFloat: bad params");
 #endif
 
-	EnterCriticalCode(&cvarcriticalcode);
-
-	cvar = Cvar_FindVariable(cvar_defined, name);
-	if (!cvar) cvar = Cvar_FindVariable(cvar_latched, name);
-	if (!cvar) {
-		COM_DevPrintf("Cvar_SetVariableFloat: cvar \"%s\" missing\n", name);
-	} else {
-		Q_snprintf(cvar->value, "%f", value);
-	}
-
-	LeaveCriticalCode(&cvarcriticalcode);
-
-	if (cvar) return true;
-	else      return false;
+	Q_ftoa(value, buf);                    // reads back as the same float, "%f" didn't
+	return Cvar_SetVariableValue(name, buf);
 }
-	
+
 /*
 =================
 Cvar_SetVariableBoolean
@@ -514,26 +1661,10 @@ Cvar_SetVariableBoolean
 */
 qboolean_t Cvar_SetVariableBoolean(const char *name, qboolean_t value)
 {
-	cvar_t *cvar;
-
-#ifndef PARANOID
+#ifdef PARANOID
 	if (!name || !name[0])
 		Sys_Error("Cvar_SetVariableBoolean: bad params");
 #endif
 
-	EnterCriticalCode(&cvarcriticalcode);
-
-	cvar = Cvar_FindVariable(cvar_defined, name);
-	if (!cvar) cvar = Cvar_FindVariable(cvar_latched, name);
-	if (!cvar) {
-		COM_DevPrintf("Cvar_SetVariableBoolean: cvar \"%s\" missing\n", name);
-	} else {
-		if (value == true) Q_strcpy(cvar->value, "true");
-		else               Q_strcpy(cvar->value, "false");
-	}
-
-	LeaveCriticalCode(&cvarcriticalcode);
-
-	if (cvar) return true;
-	else      return false;
+	return Cvar_SetVariableValue(name, value ? "true" : "false");
 }
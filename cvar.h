@@ -9,6 +9,46 @@
 // cvar flags
 //
 #define CVAR_READONLY (1 << 0)             // a variable that can only be read, write is forbidden
+#define CVAR_LATCH    (1 << 1)             // sets wait for Cvar_Frame, which applies them all at once
+
+// typed handles, the values get parsed once on set, so reading them is a plain load;
+// the values live in pages which never move, so a handle can be read without locking,
+// the whole value is published under a sequence lock for Cvar_HandleString
+#define BADCVAR BADHANDLE
+#define CVARPAGEBITS 8
+#define CVARPAGESIZE (1 << CVARPAGEBITS)
+#define MAXCVARPAGES 256
+typedef int cvarhandle_t;
+typedef struct {
+	volatile unsigned sequence;            // odd while a writer is in
+	int        i;
+	float      f;
+	qboolean_t b;                          // false for "", "0" and "false"
+	unsigned   version;                    // bumped on every change of the value
+	unsigned   string;                     // the value string in the cvars string arena
+	unsigned   length;
+} cvarvalue_t;
+extern cvarvalue_t *cvar_valuepages[MAXCVARPAGES];
+extern volatile unsigned cvar_epoch;       // bumped on a change of any cvar, or when a defined one is forgotten
+
+#define CVARVALUE(id) (&cvar_valuepages[(id) >> CVARPAGEBITS][(id) & (CVARPAGESIZE - 1)])
+inline int        Cvar_Int(cvarhandle_t id)   {return CVARVALUE(id)->i;}
+inline float      Cvar_Float(cvarhandle_t id) {return CVARVALUE(id)->f;}
+inline qboolean_t Cvar_Bool(cvarhandle_t id)  {return CVARVALUE(id)->b;}
+inline unsigned   Cvar_Version(cvarhandle_t id) {return CVARVALUE(id)->version;}
+inline unsigned   Cvar_Epoch(void)            {return cvar_epoch;}
+
+// change callbacks run from Cvar_Frame, once per changed cvar, with no cvars locked;
+// latched cvars changed in the same batch get a shared callback and param called once
+typedef void (*cvarcallback_t)(cvarhandle_t id, void *param);
+
+// static registration table entry
+typedef struct {
+	const char *  name;
+	const char *  value;                   // default one
+	unsigned      flags;
+	cvarhandle_t *handle;                  // filled in if not null
+} cvardef_t;
 
 //
 // cvar interface
@@ -19,19 +59,28 @@ void Cvar_Shutdown(void);
 void Cvar_Check(void);
 
 void Cvar_DefineVariable(const char *name, const char *value, unsigned flags);
+cvarhandle_t Cvar_Register(const char *name, const char *value, unsigned flags);      // defines if needed, the handle stays valid till the cvar is forgotten
+void Cvar_HandleString(cvarhandle_t id, char *out, unsigned outsize);           // never locks
+void Cvar_SetCallback(cvarhandle_t id, cvarcallback_t callback, void *param);     // null callback to remove
+void Cvar_Frame(void);                     // applies the latched values, runs the callbacks of the cvars changed since the last call
+void Cvar_DefineVariables(const cvardef_t *defs, unsigned count);      // defines a whole table at once
 void Cvar_ForgetVariable(const char *name);
 void Cvar_ForgetAllVariables(void);
 
 void Cvar_PrintVariable(printf_t printcall, const char *name);
 
 void Cvar_WriteFile(filehandle_t filehandle);
+unsigned Cvar_ComposeFile(char **out);                                         // Cvar_WriteFile contents, the zone block must be freed by the caller
+qboolean_t Cvar_WriteSnapshot(const char *filename);                          // binary dump of the defined cvars, replaces the file as a single step
+unsigned Cvar_ComposeSnapshot(void **out);                                     // Cvar_WriteSnapshot contents, the zone block must be freed by the caller
+qboolean_t Cvar_LoadSnapshot(const char *filename);                           // sets every cvar of the dump, false if missing or damaged
 
 qboolean_t Cvar_VariableString(const char *name, char *out, unsigned outsize, const char *def);
 qboolean_t Cvar_VariableInt(const char *name, int *out, int def);
 qboolean_t Cvar_VariableFloat(const char *name, float *out, float def);
 qboolean_t Cvar_VariableBoolean(const char *name, qboolean_t *out, qboolean_t def);
 
-qboolean_t Cvar_SetVariableString(const char *name, const char *value);
+qboolean_t Cvar_SetVariableString(const char *name, const char *value);        // setters keep the values of missing cvars till defined and return false
 qboolean_t Cvar_SetVariableInt(const char *name, int value);
 qboolean_t Cvar_SetVariableFloat(const char *name, float value);
 qboolean_t Cvar_SetVariableBoolean(const char *name, qboolean_t value);
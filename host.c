@@ -11,6 +11,7 @@
 #include "vid_windows.c"
 #endif
 #include "screen.c"
+#include "admin.c"
 
 qboolean_t host_dedicated;
 
@@ -20,42 +21,244 @@ qw_t       host_frameclocks = 0;
 float      host_framesecs = 0.0f;
 float      host_framerate = 0.0f;
 
+// configuration saving
+static cvarhandle_t host_autosave;               // secs between the background saves, 0 for none
+static unsigned host_savedepoch;                 // cvar epoch the saved configs match
+static struct {
+	threadhandle_t      thread;                  // BADTHREAD if no background save is going on
+	volatile qboolean_t done;
+	qboolean_t          succeeded;
+	unsigned            epoch;
+	char *              text;                    // user.cfg
+	unsigned            textsize;
+	void *              snapshot;
+	unsigned            snapshotsize;
+} host_save = {BADTHREAD};
+
+// configuration reloading
+#define HOSTRELOADDELAY 0.5                      // secs to let an editor finish writing
+static const char *host_configs[] = {"default.cfg", "user.cfg"};    // the saved one last
+#define NUMHOSTCONFIGS (sizeof(host_configs) / sizeof(host_configs[0]))
+static qw_t host_configtimes[NUMHOSTCONFIGS];    // as last executed or saved
+static watchhandle_t host_configwatch = BADWATCH;
+static qboolean_t host_configspinned;            // the script cache keeps the configs till shutdown
+static double host_reloadtime;                   // when to look at the changed files, 0 if nothing changed
+
 /*
 =================
 Host_LoadConfiguration
+
+user.cfg holds nothing but the cvars, so the snapshot saved along with it
+stands in for it unless user.cfg has been edited since
 =================
 */
 static void Host_LoadConfiguration(void)
 {
+	qw_t cfgtime, snapshottime;
+
 	COM_Printf("Loading configuration...\n");
 	
 	Cmd_ExecuteScript("default.cfg");
-	Cmd_ExecuteScript("user.cfg");
+
+	if (Sys_FileTime(H_SNAPSHOT, &snapshottime) &&
+		!(Sys_FileTime("user.cfg", &cfgtime) && cfgtime > snapshottime) &&
+		Cvar_LoadSnapshot(H_SNAPSHOT)) {
+		host_savedepoch = Cvar_Epoch();                  // the files match the cvars so far
+	} else {
+		Cmd_ExecuteScript("user.cfg");
+		host_savedepoch = Cvar_Epoch() - 1;              // get the snapshot rewritten on the next save
+	}
 
 	if (com_devmode) Cmd_ExecuteScript("devmode.cfg");
 	if (com_safe)    Cmd_ExecuteScript("safe.cfg");
 }
 
+/*
+=================
+Host_WatchConfiguration
+
+The configs get compiled even if not executed, so a change of them
+can be compared with the version the cvars have been loaded from
+=================
+*/
+static void Host_WatchConfiguration(void)
+{
+	unsigned i;
+
+	for (i = 0; i < NUMHOSTCONFIGS; i++) {
+		Cmd_PinScript(host_configs[i]);                  // the baselines Cmd_ExecuteScriptChanges diffs against
+		Sys_FileTime(host_configs[i], &host_configtimes[i]);
+	}
+	host_configspinned = true;
+
+	host_configwatch = Sys_WatchDirectory(".");          // configs are opened relative to the current dir
+	if (host_configwatch == BADWATCH)
+		COM_DevPrintf("Host_WatchConfiguration: configs won't get reloaded on change\n");
+}
+
+/*
+=================
+Host_ConfigurationSaved
+
+Keeps our own write of user.cfg from being reloaded, it may hold the values
+that have been changed since the composing
+=================
+*/
+static void Host_ConfigurationSaved(void)
+{
+	Cmd_CacheScript(host_configs[NUMHOSTCONFIGS - 1]);
+	Sys_FileTime(host_configs[NUMHOSTCONFIGS - 1], &host_configtimes[NUMHOSTCONFIGS - 1]);
+}
+
+/*
+=================
+Host_WriteConfiguration
+
+Runs on a thread of its own for the background saves
+=================
+*/
+static void Host_WriteConfiguration(void *param)
+{
+	host_save.succeeded = COM_ReplaceFile("user.cfg", host_save.text, host_save.textsize) &&
+		COM_ReplaceFile(H_SNAPSHOT, host_save.snapshot, host_save.snapshotsize);    // after user.cfg, so it's never older
+
+	Zone_Free(host_save.text);
+	Zone_Free(host_save.snapshot);
+
+	MemoryBarrier();
+	host_save.done = true;
+}
+
+/*
+=================
+Host_FinishSave
+
+Returns false if the background save is still being written and not waited for
+=================
+*/
+static qboolean_t Host_FinishSave(qboolean_t wait)
+{
+	if (host_save.thread == BADTHREAD)
+		return true;
+	if (!wait && !host_save.done)
+		return false;
+
+	Sys_WaitThread(host_save.thread);
+	host_save.thread = BADTHREAD;
+
+	if (host_save.succeeded) {
+		host_savedepoch = host_save.epoch;
+		Host_ConfigurationSaved();
+	} else {
+		COM_Printf("Host_FinishSave: configuration saving failed, file access error\n");
+	}
+
+	return true;
+}
+
 /*
 =================
 Host_SaveConfiguration
+
+Does nothing if no cvar has changed since the last save,
+the background save leaves the file writing to a thread
 =================
 */
-static void Host_SaveConfiguration(void)
+static void Host_SaveConfiguration(qboolean_t background)
 {
-	filehandle_t file;
-	
+	unsigned epoch;
+
+	if (!Host_FinishSave(!background))
+		return;                                      // the previous one is still going on
+
+	epoch = Cvar_Epoch();
+	if (epoch == host_savedepoch) {
+		if (!background)
+			COM_Printf("Configuration unchanged, not saved\n");
+		return;
+	}
+
+	host_save.epoch = epoch;
+	host_save.textsize = Cvar_ComposeFile(&host_save.text);
+	host_save.snapshotsize = Cvar_ComposeSnapshot(&host_save.snapshot);
+	host_save.done = false;
+
+	if (background) {
+		host_save.thread = Sys_NewThread(Host_WriteConfiguration, 0);
+		if (host_save.thread != BADTHREAD)
+			return;
+	}
+
 	COM_Printf("Saving configuration...");
-	file = Sys_FOpenForWriting("user.cfg", false);
-	if (file == BADFILE) {
+	Host_WriteConfiguration(0);
+	if (host_save.succeeded) {
+		host_savedepoch = epoch;
+		Host_ConfigurationSaved();
+		COM_Printf(" succeeded\n");
+	} else {
 		COM_Printf(" failed, file access error\n");
+	}
+}
+
+/*
+=================
+Host_Autosave
+
+The period counts from the first frame, or from the moment autosave got enabled
+=================
+*/
+static void Host_Autosave(void)
+{
+	static double lastsave = 0.0;
+	float period;
+	double now;
+
+	now = Sys_FloatTime();
+	period = Cvar_Float(host_autosave);
+	if (period <= 0.0f || lastsave == 0.0) {
+		lastsave = now;
 		return;
 	}
 
-	Cvar_WriteFile(file);
+	if (now - lastsave < period)
+		return;
+	lastsave = now;
 
-	Sys_FClose(file);
-	COM_Printf("\n");
+	Host_SaveConfiguration(true);
+}
+
+/*
+=================
+Host_ReloadConfiguration
+
+Runs the lines changed in the watched configs, a while after the last change
+was noticed; the cvars set get applied by Cvar_Frame right after
+=================
+*/
+static void Host_ReloadConfiguration(void)
+{
+	qw_t time;
+	unsigned i;
+
+	if (host_configwatch == BADWATCH)
+		return;
+
+	if (Sys_DirectoryChanged(host_configwatch))
+		host_reloadtime = Sys_FloatTime() + HOSTRELOADDELAY;
+	if (!host_reloadtime || Sys_FloatTime() < host_reloadtime)
+		return;
+	if (!Host_FinishSave(false))
+		return;                                          // might be our own write, wait for it
+	host_reloadtime = 0.0;
+
+	for (i = 0; i < NUMHOSTCONFIGS; i++) {
+		if (!Sys_FileTime(host_configs[i], &time) || time == host_configtimes[i])
+			continue;
+		host_configtimes[i] = time;
+
+		COM_Printf("Reloading changed %s\n", host_configs[i]);
+		Cmd_ExecuteScriptChanges(host_configs[i]);
+	}
 }
 
 /*
@@ -82,10 +285,14 @@ void Host_Init(hostparams_t *params)
 	//
 	COM_Init(params->rootpath, H_BASEDIR, H_USERDIR);    // common utilities init (memory, filesystem, etc)
 
+	host_autosave = Cvar_Register("host_autosave", "0", 0);
 	Host_LoadConfiguration();                            // configuration reading
+	Host_WatchConfiguration();
 
 	SCR_Init();                                          // gfx screen init
 
+	Admin_Init(H_USERDIR);                               // admin socket, if asked for
+
 	//
 	// finalize
 	//
@@ -103,10 +310,23 @@ Host_Shutdown
 */
 void Host_Shutdown(qboolean_t aftererror)
 {
+	unsigned i;
+
+	if (host_configwatch != BADWATCH)
+		Sys_UnwatchDirectory(host_configwatch);
+	host_configwatch = BADWATCH;
+	if (host_configspinned) {
+		for (i = 0; i < NUMHOSTCONFIGS; i++)
+			Cmd_UnpinScript(host_configs[i]);
+		host_configspinned = false;
+	}
+
+	Admin_Shutdown();
+
 	SCR_Shutdown();
 
-	if (!aftererror)
-		Host_SaveConfiguration();
+	if (!aftererror) Host_SaveConfiguration(false);
+	else             Host_FinishSave(true);
 	
 	COM_Shutdown();
 }
@@ -172,5 +392,13 @@ static void Host_FrameSynced(void)
 	//
 	// flush all commands
 	//
+	Admin_Frame();
 	Cbuf_Execute();
+
+	//
+	// let the subsystems catch up with changed cvars
+	//
+	Host_ReloadConfiguration();
+	Cvar_Frame();
+	Host_Autosave();
 }
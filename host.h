@@ -50,6 +50,9 @@ Returns QCODE_ERROR/QCODE_RECURISVE to the OS when encounters an unrecoverable c
 #define H_BASEDIR "q0"
 #define H_USERDIR "quantic"
 
+// H_SNAPSHOT is a binary snapshot of the cvars saved along with user.cfg, loaded instead of it when not older
+#define H_SNAPSHOT "user.cvars"
+
 // host program execution parameters, gets filled by sys layer and passed to Host_Init
 typedef struct {
 	void * membase;                            // base address of the memory chunk prepared for dynamic allocations
@@ -1,7 +1,9 @@
 // com_alloc.c -- systems to alloc and manage memory
 
 #include "common.h"
+#include "sys.h"
 #include "mathlib.h"
+#include "hunk.h"
 
 /*
 ============================================================================================================
@@ -25,8 +27,8 @@ static unsigned hunk_counter;
 static criticalcode_t hunkcriticalcode;
 
 void Hunk_CheckGeneral(void);
-void Cache_FreeLow(size_t mark);   // these are in cache code way down below
-void Cache_FreeHigh(size_t mark);
+qboolean_t Cache_FreeLow(size_t mark);   // these are in cache code way down below
+qboolean_t Cache_FreeHigh(size_t mark);
 
 /*
 =================
@@ -141,9 +143,11 @@ void * Hunk_LowAlloc(size_t size)
 /*
 =================
 Hunk_LowAllocNamed
+
+Returns 0 if a block being loaded by a cache request is in the way
 =================
 */
-void Cache_FreeLow(size_t mark);
+qboolean_t Cache_FreeLow(size_t mark);
 void * Hunk_LowAllocNamed(size_t size, const char *name)
 {
 	hunkheader_t *h;
@@ -170,7 +174,11 @@ void * Hunk_LowAllocNamed(size_t size, const char *name)
 
 	h = (hunkheader_t *)(hunk_base + hunk_used_low);
 	hunk_used_low += size;
-	Cache_FreeLow(hunk_used_low);
+	if (!Cache_FreeLow(hunk_used_low)) {
+		hunk_used_low -= size;
+		LeaveCriticalCode(&hunkcriticalcode);
+		return 0;
+	}
 	
 	Q_memset(h, 0, size);
 	h->sentinal = HUNKSENTINAL;
@@ -196,6 +204,8 @@ void * Hunk_HighAlloc(size_t size)
 /*
 =================
 Hunk_HighAllocNamed
+
+Returns 0 if a block being loaded by a cache request is in the way
 =================
 */
 void * Hunk_HighAllocNamed(size_t size, const char *name)
@@ -224,7 +234,11 @@ void * Hunk_HighAllocNamed(size_t size, const char *name)
 
 	h = (hunkheader_t *)(hunk_base + hunk_size - hunk_used_high);
 	hunk_used_high += size;
-	Cache_FreeHigh(hunk_used_high);
+	if (!Cache_FreeHigh(hunk_used_high)) {
+		hunk_used_high -= size;
+		LeaveCriticalCode(&hunkcriticalcode);
+		return 0;
+	}
 	
 	Q_memset(h, 0, size);
 	h->sentinal = HUNKSENTINAL;
@@ -392,6 +406,7 @@ static size_t zone_size, zone_mark;
 static size_t zone_minfrag;
 static zone_t *zone0;
 static unsigned zone_counter;
+static unsigned zone_allocs;                     // total count of allocations, see Zone_AllocCount
 static criticalcode_t zonecriticalcode;
 
 /*
@@ -477,6 +492,7 @@ void * Zone_Alloc(size_t size)
 	}
 
 	zone0->rover = base->next;       // next allocation will start looking here
+	zone_allocs++;
 
 	// marker for memory trash testing
 	*(int *)((byte_t *)base + base->size - sizeof(int)) = ZONESENTINAL;
@@ -488,6 +504,18 @@ void * Zone_Alloc(size_t size)
 	return out;
 }
 
+/*
+==================
+Zone_AllocCount
+
+Allocations made so far by all threads, for profiling
+==================
+*/
+unsigned Zone_AllocCount(void)
+{
+	return zone_allocs;
+}
+
 /*
 ==================
 Zone_Free
@@ -568,356 +596,1878 @@ void Zone_Print(void)
 
 Cache Manager
 
+Cache lives in the hunk space left between the low and the high marks. The space is split into shards,
+each having its own region, blocks chain, LRU list, gaps index and lock, so threads working with
+different shards never wait for each other. New blocks are routed to shards by their id address hash.
+A block larger than any shard gets the fewest neighbour shards merged for it.
+
 ============================================================================================================
 */
-#define MAXCACHENAME 32
+#define MAXCACHENAME   32
+#define CACHESHARDBITS 3
+#define CACHESHARDS    (1 << CACHESHARDBITS)
+#define CACHESHARDMIN  4                    // shards are split again once one gets this times smaller than an even share
+struct cacheshard_s;
 typedef struct cache_s {
 	int size;                                // including this header
-	cacheid_t id;
+	cacheid_t *id;
 	char name[MAXCACHENAME];
+	struct cacheshard_s *shard;
+	int pins;                                // pinned blocks are never moved or thrown out
 	struct cache_s *next, *prev;
 	struct cache_s *lru_next, *lru_prev;     // for LRU flushing
+
+	size_t gap;                              // free space up to the next block, valid when indexed
+	int gap_height;                          // AVL subtree height, 0 if not in the gaps index
+	struct cache_s *gap_left, *gap_right;    // gaps index links
 } cache_t;
-static cache_t cachechain;
-static criticalcode_t cachecriticalcode;
+typedef struct cacheshard_s {
+	cache_t chain;                           // blocks chain and LRU list head
+	cache_t *gaps;                           // root of the gaps index, sorted by gap size and address
+	byte_t *low, *high;                      // shard region, clipped by the hunk marks when used
+	criticalcode_t criticalcode;
+} cacheshard_t;
+static cacheshard_t cache_shards[CACHESHARDS];
+
+static void Cache_MakeLRU(cacheshard_t *shard, cache_t *cache);
+static void Cache_UnlinkLRU(cache_t *cache);
+
+/*
+============================================================================================================
+
+Cache Gaps Index
+
+Every free space between two neighbour blocks is kept in an AVL tree embedded into
+the block that precedes the space, so the best fitting space is found in logarithmic time.
+Spaces at the bottom and at the top of a shard depend on hunk marks and stay out of the index.
 
-void Cache_MakeLRU(cacheid_t *id);
-void Cache_UnlinkLRU(cacheid_t *id);
+============================================================================================================
+*/
+#define GAPHEIGHT(c) ((c) ? (c)->gap_height : 0)
 
 /*
 ==================
-Cache_Init
+Cache_GapCompare
 ==================
 */
-void Cache_Init(void)
+inline int Cache_GapCompare(cache_t *a, cache_t *b)
 {
-	Q_strcpy(chachechain.name, "dummy");
-	cachechain.next = cachechain.prev = &cachechain;
-	cachechain.lru_next = cachechain.lru_prev = &cachechain;
+	if (a->gap != b->gap)
+		return a->gap < b->gap ? -1 : 1;
+	if (a != b)
+		return a < b ? -1 : 1;
+	return 0;
 }
 
 /*
 ==================
-Cache_TryAlloc
+Cache_GapUpdate
+==================
+*/
+inline void Cache_GapUpdate(cache_t *c)
+{
+	c->gap_height = max(GAPHEIGHT(c->gap_left), GAPHEIGHT(c->gap_right)) + 1;
+}
 
-Looks for a free block of memory between the high and low hunk marks,
-size should already include the header and padding
+/*
+==================
+Cache_GapRotateLeft
+Cache_GapRotateRight
 ==================
 */
-static cache_t * Cache_TryAlloc(size_t size, qboolean_t nobottom)
+static cache_t * Cache_GapRotateLeft(cache_t *c)
 {
-	cache_t *cache, new;
+	cache_t *p = c->gap_right;
 
-#ifdef PARANOID	
-	if (size == 0)
-		Sys_Error("Cache_TryAlloc: bad size");
-#endif
+	c->gap_right = p->gap_left;
+	p->gap_left = c;
+	Cache_GapUpdate(c);
+	Cache_GapUpdate(p);
 
-	//
-	// is the cache completely empty?
-	//
-	if (!nobottom && cachechain.prev == &cachechain) {
-		if (hunk_size - hunk_used_low - hunk_used_high < size)
-			Sys_Error("Cache_TryAlloc: size %d is greater than free chunk", size);
+	return p;
+}
+static cache_t * Cache_GapRotateRight(cache_t *c)
+{
+	cache_t *p = c->gap_left;
 
-		new = (cache_t *)(hunk_base + hunk_used_low);
-		Q_memset(new, 0, sizeof(cache_t));
-		new->size = size;
+	c->gap_left = p->gap_right;
+	p->gap_right = c;
+	Cache_GapUpdate(c);
+	Cache_GapUpdate(p);
+
+	return p;
+}
+
+/*
+==================
+Cache_GapBalance
+==================
+*/
+static cache_t * Cache_GapBalance(cache_t *c)
+{
+	int lh, rh;
 
-		cachechain.prev = cachechain.next = neww;
-		new->prev = new->next = &cachechain;
+	lh = GAPHEIGHT(c->gap_left);
+	rh = GAPHEIGHT(c->gap_right);
 
-		Cache_MakeLRU(new);
-		return new;
+	if (lh > rh + 1) {
+		if (GAPHEIGHT(c->gap_left->gap_right) > GAPHEIGHT(c->gap_left->gap_left))
+			c->gap_left = Cache_GapRotateLeft(c->gap_left);
+		return Cache_GapRotateRight(c);
+	}
+	if (rh > lh + 1) {
+		if (GAPHEIGHT(c->gap_right->gap_left) > GAPHEIGHT(c->gap_right->gap_right))
+			c->gap_right = Cache_GapRotateRight(c->gap_right);
+		return Cache_GapRotateLeft(c);
 	}
 
-	//
-	// search from the bottom up for space
-	//
-	new = (cache_t *)(hunk_base + hunk_used_low);
-	cache = cachechain.next;
-	do {
-		if (!nobottom || cache != cachechain.next) {
-			if ((byte_t *)cache - (byte_t *)new >= size) {
-				//
-				// found space
-				//
-				Q_memset(new, 0, sizeof(cache_t));
-				new->size = size;
-
-				new->next = cache;
-				new->prev = cache->prev;
-				cache->prev->next = new;
-				cache->prev = new;
-
-				Cache_MakeLRU(new);
-				return new;
-			}
-		}
+	Cache_GapUpdate(c);
+	return c;
+}
 
-		//
-		// continue looking
-		//
-		new = (cache_t *)((byte_t *)cache + cache->size);
-		cache = cache->next;
-	} while (cache != &cachechain);
+/*
+==================
+Cache_GapInsert
+==================
+*/
+static cache_t * Cache_GapInsert(cache_t *root, cache_t *c)
+{
+	if (!root) {
+		c->gap_left = c->gap_right = 0;
+		c->gap_height = 1;
+		return c;
+	}
 
-	//
-	// try to allocate one at the very end
-	//
-	if (hunk_base + hunk_size - hunk_used_high - (byte_t *)new >= size) {
-		Q_memset(new, 0, sizeof(cache_t));
-		new->size = size;
+	if (Cache_GapCompare(c, root) < 0) root->gap_left = Cache_GapInsert(root->gap_left, c);
+	else                               root->gap_right = Cache_GapInsert(root->gap_right, c);
 
-		new->next = &cachechain;
-		new->prev = cachechain.prev;
-		cachechain.prev->next = new;
-		cachechain.prev = new;
+	return Cache_GapBalance(root);
+}
 
-		Cache_MakeLRU(new);
-		return new;
+/*
+==================
+Cache_GapRemoveMin
+==================
+*/
+static cache_t * Cache_GapRemoveMin(cache_t *root, cache_t **o_min)
+{
+	if (!root->gap_left) {
+		*o_min = root;
+		return root->gap_right;
 	}
 
-	return 0;            // couldn't allocate
+	root->gap_left = Cache_GapRemoveMin(root->gap_left, o_min);
+	return Cache_GapBalance(root);
 }
 
 /*
 ==================
-Cache_Move
+Cache_GapRemove
 ==================
 */
-static void Cache_Move(cache_t *cache)
+static cache_t * Cache_GapRemove(cache_t *root, cache_t *c)
 {
-	cache_t *new;
-	
-#ifdef PARANOID
-	if (!cache)
-		Sys_Error("Cache_Move: null cache");
-#endif
+	cache_t *min, *right;
+	int cmp;
 
-	//
-	// clear up space at the bottom, so only allocate it late
-	//
-	new = Cache_TryAlloc(cache->size, true);
-	if (new) {
-		Q_memcpy(new + 1, cache + 1, cache->size - sizeof(cache_t));
-		Q_strcpy(new->name, cache->name);
-		new->id = cache->id;
+	if (!root)
+		Sys_Error("Cache_GapRemove: gap is not indexed");
 
-		Cache_Free(cache->id);
-		*new->id = (void *)(new + 1);
+	cmp = Cache_GapCompare(c, root);
+	if (cmp < 0) {
+		root->gap_left = Cache_GapRemove(root->gap_left, c);
+	} else if (cmp > 0) {
+		root->gap_right = Cache_GapRemove(root->gap_right, c);
 	} else {
-		Cache_Free(cache->id);
+		if (!root->gap_right)
+			return root->gap_left;
+
+		right = Cache_GapRemoveMin(root->gap_right, &min);
+		min->gap_left = root->gap_left;
+		min->gap_right = right;
+		root = min;
 	}
+
+	return Cache_GapBalance(root);
 }
 
 /*
 ==================
-Cache_FreeLow
+Cache_GapCeil
 
-Throws things out until the hunk can be expanded to the given point
+Returns the smallest indexed gap that is ordered after (gap, after),
+null after means any gap of at least a given size
 ==================
 */
-static void Cache_FreeLow(size_t mark)
-{	
-	cache_t *cache;
+static cache_t * Cache_GapCeil(cacheshard_t *shard, size_t gap, cache_t *after)
+{
+	cache_t *c, *out = 0;
+	qboolean_t greater;
 
-	EnterCriticalCode(&cachecriticalcode);
+	for (c = shard->gaps; c;) {
+		if (c->gap != gap) greater = c->gap > gap;
+		else               greater = c > after;
 
-	while (true) {
-		cache = &cachechain.next;
-		if (cache == &cachechain)
-			break;                      // nothing in cache at all
-		if ((byte_t *)cache >= hunk_base + mark)
-			break;                      // there is space to grow the hunk
-		Cache_Move(cache);              // reclaim the space
+		if (greater) {
+			out = c;
+			c = c->gap_left;
+		} else {
+			c = c->gap_right;
+		}
 	}
 
-	LeaveCriticalCode(&cachecriticalcode);
+	return out;
 }
 
 /*
 ==================
-Cache_FreeHigh
-
-Throws things out until the hunk can be expanded to the given point
+Cache_GapCount
 ==================
 */
-static void Cache_FreeHigh(size_t mark)
+static unsigned Cache_GapCount(cache_t *root)
 {
-	cache_t *cache, *prev = 0;
+	if (!root)
+		return 0;
+	return Cache_GapCount(root->gap_left) + Cache_GapCount(root->gap_right) + 1;
+}
 
-	EnterCriticalCode(&cachecriticalcode);
-	
-	while (true) {
-		cache = cachechain.prev;
-		if (cache == &cache_stat)
-			break;                      // nothing in cache at all
-		if ((byte_t *)cache + cache->size <= hunk_base + hunk_size - mark)
-			break;                      // there is space to grow the hunk
-		if (cache == prev) {
-			Cache_Free(cache->id);      // didn't move out of the way
-		} else {
-			Cache_Move(cache->id);      // try to move it...
-			prev = cache;
-		}
+/*
+==================
+Cache_GapUnindex
+==================
+*/
+inline void Cache_GapUnindex(cacheshard_t *shard, cache_t *cache)
+{
+	if (cache->gap_height) {
+		shard->gaps = Cache_GapRemove(shard->gaps, cache);
+		cache->gap_height = 0;
 	}
-
-	LeaveCriticalCode(&cachecriticalcode);
 }
 
 /*
 ==================
-Cache_MakeLRU
+Cache_GapReindex
+
+Updates index entry of a space following a given block,
+must be called whenever the block or its next neighbour changes
 ==================
 */
-static void Cache_MakeLRU(cache_t *cache)
-{	
-#ifdef PARANOID
-	if (cache->lru_next || cache->lru_prev)
-		Sys_Error("Cache_MakeLRU: active cache links");
-#endif
+static void Cache_GapReindex(cacheshard_t *shard, cache_t *cache)
+{
+	if (cache == &shard->chain)
+		return;                         // bottom space isn't indexed
+
+	Cache_GapUnindex(shard, cache);
 
-	cachechain.lru_next->lru_prev = cache;
-	cache->lru_next = cachechain.lru_next;
-	cache->lru_prev = &cachechain;
-	cachechain.lru_next = cache;
+	if (!cache->next || cache->next == &shard->chain)
+		return;                         // unlinked block or top space, not indexed
+
+	cache->gap = (byte_t *)cache->next - ((byte_t *)cache + cache->size);
+	if (cache->gap)
+		shard->gaps = Cache_GapInsert(shard->gaps, cache);
 }
 
+/*
+============================================================================================================
+
+Cache Shards
+
+============================================================================================================
+*/
+
 /*
 ==================
-Cache_UnlinkLRU
+Cache_ShardLow
+Cache_ShardHigh
+
+Shard region bounds clipped by the hunk marks
 ==================
 */
-static void Cache_UnlinkLRU(cache_t *cache)
+inline byte_t * Cache_ShardLow(cacheshard_t *shard)
 {
-#ifdef PARANOID	
-	if (!cache)
-		Sys_Error("Cache_UnlinkLRU: null cache");
-	if (!cache->lru_next || !cache->lru_prev)
-		Sys_Error("Cache_UnlinkLRU: null cache links");
-#endif
+	byte_t *low = hunk_base + hunk_used_low;
 
-	cache->lru_next->lru_prev = cache->lru_prev;
-	cache->lru_prev->lru_next = cache->lru_next;
+	return shard->low > low ? shard->low : low;
+}
+inline byte_t * Cache_ShardHigh(cacheshard_t *shard)
+{
+	byte_t *high = hunk_base + hunk_size - hunk_used_high;
+
+	return shard->high < high ? shard->high : high;
 }
 
 /*
 ==================
-Cache_Alloc
+Cache_ShardSpan
 ==================
 */
-void * Cache_Alloc(cacheid_t *id, size_t size)
+inline size_t Cache_ShardSpan(cacheshard_t *shard)
 {
-	cache_t *cache;
+	byte_t *low = Cache_ShardLow(shard);
+	byte_t *high = Cache_ShardHigh(shard);
 
-	EnterCriticalCode(&cachecriticalcode);
+	return high > low ? high - low : 0;
+}
 
-#ifdef PARANOID
-	if (*id)
-		Sys_Error("Cache_Alloc: already allocated");
-	if (!id || size == 0)
-		Sys_Error("Cache_Alloc: bad params");
-#endif
+/*
+==================
+Cache_ShardForId
 
-	size = (size + sizeof(cache_t) + (HUNKALIGNMENT - 1)) & ~(HUNKALIGNMENT - 1);
+Routes a new block to a shard by hash of its id address,
+blocks too large for their shard go to the roomiest one
+==================
+*/
+static cacheshard_t * Cache_ShardForId(cacheid_t *id, size_t size)
+{
+	cacheshard_t *shard, *roomiest;
+	unsigned hash;
+	int i;
+
+	hash = (unsigned)((size_t)id >> 3) * 0x9e3779b9;
+	shard = &cache_shards[hash >> (32 - CACHESHARDBITS)];
+	if (Cache_ShardSpan(shard) >= size)
+		return shard;
+
+	roomiest = shard;
+	for (i = 0; i < CACHESHARDS; i++) {
+		if (Cache_ShardSpan(&cache_shards[i]) > Cache_ShardSpan(roomiest))
+			roomiest = &cache_shards[i];
+	}
 
-	//
-	// find memory for it
-	//
-	while (true) {
-		cache = Cache_TryAlloc(size, false);
-		if (cache) {
-			Q_strncpy(cache->name, name, MAXCACHENAME);
-			*id = (void *)(cache + 1);
-			*cache->id = *id;
-			break;
-		}
+	return roomiest;
+}
 
-		//
-		// find the least recently used cahedat
-		//
-		if (cachechain.lru_prev == &cachechain)
-			Sys_Error("Cache_Alloc: out of memory");
+/*
+==================
+Cache_ShardForAddress
 
-		Cache_Free(cachechain.lru_prev->id);
-	}
+Finds a shard by its region, so a block header that might be already
+thrown out is never read, returns 0 if not found
+==================
+*/
+static cacheshard_t * Cache_ShardForAddress(void *addr)
+{
+	int i;
 
-	//
-	// move the the head of LRU
-	//
-	Cache_UnlinkLRU(cache);
-	Cache_MakeLRU(cache);
+	for (i = 0; i < CACHESHARDS; i++) {
+		if ((byte_t *)addr >= cache_shards[i].low && (byte_t *)addr < cache_shards[i].high)
+			return &cache_shards[i];
+	}
 
-	LeaveCriticalCode(&cachecriticalcode);
-	return *id;
+	return 0;
 }
 
 /*
 ==================
-Cache_Free
+Cache_SplitRegions
+
+Splits the space between hunk marks into even shard regions,
+the border shards also own everything up to the hunk ends
 ==================
 */
-void Cache_Free(cacheid_t *id)
+static void Cache_SplitRegions(byte_t **lows, byte_t **highs)
 {
-	cache_t *cache;
+	byte_t *low, *high;
+	size_t share;
+	int i;
 
-	EnterCriticalCode(&cachecriticalcode);
+	low = (byte_t *)(((size_t)(hunk_base + hunk_used_low) + (HUNKALIGNMENT - 1)) & ~(HUNKALIGNMENT - 1));
+	high = hunk_base + hunk_size - hunk_used_high;
+	share = high > low ? ((size_t)(high - low) / CACHESHARDS) & ~(HUNKALIGNMENT - 1) : 0;
 
-#ifdef PARANOID
-	if (!id)
-		Sys_Error("Cache_Free: null id");
-#endif
+	for (i = 0; i < CACHESHARDS; i++) {
+		lows[i] = (i == 0) ? hunk_base : low + share * i;
+		highs[i] = (i == CACHESHARDS - 1) ? hunk_base + hunk_size : low + share * (i + 1);
+	}
+}
 
-	cache = ((cache_t *)*id) - 1;
-	cache->prev->next = cache->next;
-	cache->next->prev = cache->prev;
-	cache->next = cache->prev = 0;
+/*
+============================================================================================================
 
-	*id = 0;
-	Cache_UnlinkLRU(cache);
+Cache Blocks
 
-	LeaveCriticalCode(&cachecriticalcode);
-}
+All the functions below with a shard param expect the shard to be locked by the caller.
+
+============================================================================================================
+*/
+static void Cache_FreeBlock(cacheshard_t *shard, cache_t *cache);
+static void Cache_StartLoader(void);
+static void Cache_StopLoader(void);
+static void Cache_CloseStore(void);
 
 /*
-=================
-Cache_Flush
+==================
+Cache_Init
+==================
+*/
+void Cache_Init(void)
+{
+	cacheshard_t *shard;
+	byte_t *lows[CACHESHARDS], *highs[CACHESHARDS];
+	int i;
+
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+
+		Q_memset(shard, 0, sizeof(*shard));
+		Q_strcpy(shard->chain.name, "dummy");
+		shard->chain.shard = shard;
+		shard->chain.next = shard->chain.prev = &shard->chain;
+		shard->chain.lru_next = shard->chain.lru_prev = &shard->chain;
+		ZeroCriticalCode(&shard->criticalcode);
+	}
 
-Flush everything, so new data wil be demand cached
-=================
+	Cache_SplitRegions(lows, highs);
+	for (i = 0; i < CACHESHARDS; i++) {
+		cache_shards[i].low = lows[i];
+		cache_shards[i].high = highs[i];
+	}
+
+	Cache_StartLoader();
+}
+
+/*
+==================
+Cache_Shutdown
+==================
 */
-void Cache_Flush(void)
+void Cache_Shutdown(void)
 {
-	while (cachechain.next != &cachechain)
-		Cache_Free(cachechain.next->id);               // reclaim the space
+	Cache_StopLoader();
+
+	Cache_CloseStore();
 }
 
 /*
-=================
-Cache_Check
+==================
+Cache_FitGap
 
-Runs cache validation
-=================
+Returns an address a block fits at in a space between start and end
+clipped by low and high, or 0 if it doesn't fit
+==================
 */
-void Cache_Check(void)
-{}
+inline byte_t * Cache_FitGap(byte_t *start, byte_t *end, byte_t *low, byte_t *high, size_t size)
+{
+	if (start < low)
+		start = low;
+	if (end > high)
+		end = high;
+
+	if (start >= end || (size_t)(end - start) < size)
+		return 0;
+	return start;
+}
 
 /*
-=================
-Cache_Print
+==================
+Cache_LinkBlock
+==================
+*/
+static cache_t * Cache_LinkBlock(cacheshard_t *shard, byte_t *addr, size_t size, cache_t *prev)
+{
+	cache_t *new = (cache_t *)addr;
 
-Prints out cache statistics
-=================
+	Q_memset(new, 0, sizeof(cache_t));
+	new->size = size;
+	new->shard = shard;
+
+	new->prev = prev;
+	new->next = prev->next;
+	prev->next->prev = new;
+	prev->next = new;
+
+	Cache_GapReindex(shard, prev);
+	Cache_GapReindex(shard, new);
+
+	Cache_MakeLRU(shard, new);
+	return new;
+}
+
+/*
+==================
+Cache_TryAlloc
+
+Looks for a free block of memory in a shard region between the high and low hunk marks,
+size should already include the header and padding
+
+Takes the smallest space that fits among the best indexed one and the
+spaces at the bottom and at the top of the shard
+==================
 */
-void Cache_Print(void)
+static cache_t * Cache_TryAlloc(cacheshard_t *shard, size_t size, qboolean_t nobottom)
 {
-	cache_t *cache;
+	cache_t *chain, *cache, *bestprev = 0;
+	byte_t *low, *high, *addr, *best = 0;
+	size_t gap, bestgap = 0;
+
+#ifdef PARANOID	
+	if (size == 0)
+		Sys_Error("Cache_TryAlloc: bad size");
+#endif
+
+	chain = &shard->chain;
+	low = Cache_ShardLow(shard);
+	high = Cache_ShardHigh(shard);
+
+	//
+	// is the shard completely empty?
+	//
+	if (chain->next == chain) {
+		addr = Cache_FitGap(low, high, low, high, size);
+		if (!addr)
+			return 0;
+
+		return Cache_LinkBlock(shard, addr, size, chain);
+	}
+
+	//
+	// best fitting space between blocks,
+	// spaces clipped by the hunk marks being moved are skipped
+	//
+	for (cache = Cache_GapCeil(shard, size, 0); cache; cache = Cache_GapCeil(shard, cache->gap, cache)) {
+		addr = Cache_FitGap((byte_t *)cache + cache->size, (byte_t *)cache->next, low, high, size);
+		if (addr) {
+			best = addr;
+			bestprev = cache;
+			bestgap = cache->gap;
+			break;
+		}
+	}
+
+	//
+	// space at the bottom
+	//
+	if (!nobottom) {
+		addr = Cache_FitGap(low, (byte_t *)chain->next, low, high, size);
+		gap = (byte_t *)chain->next - low;
+		if (addr && (!best || gap < bestgap)) {
+			best = addr;
+			bestprev = chain;
+			bestgap = gap;
+		}
+	}
+
+	//
+	// space at the top
+	//
+	cache = chain->prev;
+	addr = Cache_FitGap((byte_t *)cache + cache->size, high, low, high, size);
+	gap = high - ((byte_t *)cache + cache->size);
+	if (addr && (!best || gap < bestgap)) {
+		best = addr;
+		bestprev = cache;
+		bestgap = gap;
+	}
+
+	if (!best)
+		return 0;            // couldn't allocate
+
+	return Cache_LinkBlock(shard, best, size, bestprev);
+}
+
+/*
+==================
+Cache_Move
+
+Moves a block within its shard or throws it out if there is no space
+==================
+*/
+static void Cache_Move(cacheshard_t *shard, cache_t *cache)
+{
+	cache_t *new;
+	
+#ifdef PARANOID
+	if (!cache)
+		Sys_Error("Cache_Move: null cache");
+#endif
+
+	//
+	// clear up space at the bottom, so only allocate it late
+	//
+	new = Cache_TryAlloc(shard, cache->size, true);
+	if (new) {
+		Q_memcpy(new + 1, cache + 1, cache->size - sizeof(cache_t));
+		Q_strcpy(new->name, cache->name);
+		new->id = cache->id;
+
+		Cache_FreeBlock(shard, cache);
+		*new->id = (void *)(new + 1);
+	} else {
+		Cache_FreeBlock(shard, cache);
+	}
+}
+
+/*
+==================
+Cache_Resplit
+
+Gives the shards new regions, a region bound that would cut a block is moved to the
+nearest edge of the block, so no block is moved or thrown out, they only get relinked
+to the shards owning them now, the LRU order of merged shards is kept roughly;
+expects all shards to be locked
+==================
+*/
+static void Cache_Resplit(byte_t **lows, byte_t **highs)
+{
+	cacheshard_t *shard;
+	cache_t *cache, *next, *blocks, *lru, **tail;
+	byte_t *start, *end;
+	int i;
+
+	//
+	// chain all blocks in address order through gap_right, then in LRU order,
+	// the oldest first, through gap_left; the gaps indexes are rebuilt anyway
+	//
+	tail = &blocks;
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+		for (cache = shard->chain.next; cache != &shard->chain; cache = cache->next) {
+			cache->gap_height = 0;
+			*tail = cache;
+			tail = &cache->gap_right;
+		}
+	}
+	*tail = 0;
+
+	tail = &lru;
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+		for (cache = shard->chain.lru_prev; cache != &shard->chain; cache = next) {
+			next = cache->lru_prev;
+			cache->lru_next = cache->lru_prev = 0;
+			*tail = cache;
+			tail = &cache->gap_left;
+		}
+
+		shard->chain.next = shard->chain.prev = &shard->chain;
+		shard->chain.lru_next = shard->chain.lru_prev = &shard->chain;
+		shard->gaps = 0;
+	}
+	*tail = 0;
+
+	//
+	// move the bounds cutting the blocks, several bounds within
+	// one block leave the shards in between with empty regions
+	//
+	i = 1;
+	for (cache = blocks; cache; cache = cache->gap_right) {
+		start = (byte_t *)cache;
+		end = start + cache->size;
+		for (; i < CACHESHARDS && lows[i] < end; i++) {
+			if (lows[i] > start)
+				lows[i] = highs[i - 1] = (lows[i] - start < end - lows[i]) ? start : end;
+		}
+	}
+
+	for (i = 0; i < CACHESHARDS; i++) {
+		cache_shards[i].low = lows[i];
+		cache_shards[i].high = highs[i];
+	}
+
+	//
+	// relink the blocks
+	//
+	i = 0;
+	for (cache = blocks; cache; cache = next) {
+		next = cache->gap_right;
+		while ((byte_t *)cache >= cache_shards[i].high)
+			i++;
+
+		shard = &cache_shards[i];
+		cache->shard = shard;
+		cache->prev = shard->chain.prev;
+		cache->next = &shard->chain;
+		shard->chain.prev->next = cache;
+		shard->chain.prev = cache;
+	}
+
+	for (cache = lru; cache; cache = next) {
+		next = cache->gap_left;
+		Cache_MakeLRU(cache->shard, cache);
+	}
+
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+		for (cache = shard->chain.next; cache != &shard->chain; cache = cache->next)
+			Cache_GapReindex(shard, cache);
+	}
+}
+
+/*
+==================
+Cache_Rebalance
+
+Splits the shard regions evenly again, all shards get locked in order
+==================
+*/
+static void Cache_Rebalance(void)
+{
+	byte_t *lows[CACHESHARDS], *highs[CACHESHARDS];
+	int i;
+
+	for (i = 0; i < CACHESHARDS; i++)
+		EnterCriticalCode(&cache_shards[i].criticalcode);
+
+	Cache_SplitRegions(lows, highs);
+	Cache_Resplit(lows, highs);
+
+	for (i = CACHESHARDS - 1; i >= 0; i--)
+		LeaveCriticalCode(&cache_shards[i].criticalcode);
+
+	COM_DevPrintf("Cache_Rebalance: shard regions are %d Kb now\n", (int)(Cache_ShardSpan(&cache_shards[1]) / 1024));
+}
+
+/*
+==================
+Cache_MergeShards
+
+Makes room for a block too large for any shard by merging the fewest neighbour
+shards spanning enough together, the merged shard is returned locked,
+returns 0 if the whole cache can't hold the block
+==================
+*/
+static cacheshard_t * Cache_MergeShards(size_t size)
+{
+	byte_t *lows[CACHESHARDS], *highs[CACHESHARDS];
+	byte_t *low, *high;
+	int i, a, b, first = -1, last = -1;
+
+	for (i = 0; i < CACHESHARDS; i++)
+		EnterCriticalCode(&cache_shards[i].criticalcode);
+
+	for (a = 0; a < CACHESHARDS; a++) {
+		low = Cache_ShardLow(&cache_shards[a]);
+		for (b = a; b < CACHESHARDS; b++) {
+			high = Cache_ShardHigh(&cache_shards[b]);
+			if (high > low && (size_t)(high - low) >= size)
+				break;
+		}
+		if (b < CACHESHARDS && (first < 0 || b - a < last - first)) {
+			first = a;
+			last = b;
+		}
+	}
+
+	if (first < 0) {
+		for (i = CACHESHARDS - 1; i >= 0; i--)
+			LeaveCriticalCode(&cache_shards[i].criticalcode);
+		return 0;
+	}
+
+	if (last > first) {
+		for (i = 0; i < CACHESHARDS; i++) {
+			lows[i] = cache_shards[i].low;
+			highs[i] = cache_shards[i].high;
+		}
+		highs[first] = highs[last];
+		for (i = first + 1; i <= last; i++)
+			lows[i] = highs[i] = highs[last];
+
+		Cache_Resplit(lows, highs);
+		COM_DevPrintf("Cache_MergeShards: merged shards %d to %d for %d Kb\n", first, last, (int)(size / 1024));
+	}
+
+	for (i = CACHESHARDS - 1; i >= 0; i--) {
+		if (i != first)
+			LeaveCriticalCode(&cache_shards[i].criticalcode);
+	}
+
+	return &cache_shards[first];
+}
+
+/*
+==================
+Cache_CheckBalance
+
+Rebalances the shards once the hunk has eaten most of a shard region,
+the empty regions of merged shards are left alone
+==================
+*/
+static void Cache_CheckBalance(void)
+{
+	cacheshard_t *shard;
+	size_t share;
+	int i;
+
+	share = (hunk_size - hunk_used_low - hunk_used_high) / CACHESHARDS;
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+		if (shard->high == shard->low)
+			continue;
+		if (Cache_ShardLow(shard) == shard->low && Cache_ShardHigh(shard) == shard->high)
+			continue;                       // not clipped by the hunk
+
+		if (Cache_ShardSpan(shard) * CACHESHARDMIN < share) {
+			Cache_Rebalance();
+			return;
+		}
+	}
+}
+
+/*
+==================
+Cache_FreeLow
+
+Throws things out until the hunk can be expanded to the given point,
+returns false without waiting if a pinned block is in the way
+==================
+*/
+static qboolean_t Cache_FreeLow(size_t mark)
+{	
+	cacheshard_t *shard;
+	cache_t *cache;
+	int i;
+
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+		if (shard->low >= hunk_base + mark)
+			break;                          // upper shards are out of the way
+
+		EnterCriticalCode(&shard->criticalcode);
+
+		while (true) {
+			cache = shard->chain.next;
+			if (cache == &shard->chain)
+				break;                      // nothing in the shard at all
+			if ((byte_t *)cache >= hunk_base + mark)
+				break;                      // there is space to grow the hunk
+			if (cache->pins) {
+				LeaveCriticalCode(&shard->criticalcode);
+				return false;               // being loaded or read
+			}
+			Cache_Move(shard, cache);       // reclaim the space
+		}
+
+		LeaveCriticalCode(&shard->criticalcode);
+	}
+
+	Cache_CheckBalance();
+	return true;
+}
+
+/*
+==================
+Cache_FreeHigh
+
+Throws things out until the hunk can be expanded to the given point,
+returns false without waiting if a pinned block is in the way
+==================
+*/
+static qboolean_t Cache_FreeHigh(size_t mark)
+{
+	cacheshard_t *shard;
+	cache_t *cache;
+	int i;
+
+	for (i = CACHESHARDS - 1; i >= 0; i--) {
+		shard = &cache_shards[i];
+		if (shard->high <= hunk_base + hunk_size - mark)
+			break;                          // lower shards are out of the way
+
+		EnterCriticalCode(&shard->criticalcode);
+
+		while (true) {
+			cache = shard->chain.prev;
+			if (cache == &shard->chain)
+				break;                      // nothing in the shard at all
+			if ((byte_t *)cache + cache->size <= hunk_base + hunk_size - mark)
+				break;                      // there is space to grow the hunk
+			if (cache->pins) {
+				LeaveCriticalCode(&shard->criticalcode);
+				return false;               // being loaded or read
+			}
+			Cache_Move(shard, cache);       // try to move it, or throw it out
+		}
+
+		LeaveCriticalCode(&shard->criticalcode);
+	}
+
+	Cache_CheckBalance();
+	return true;
+}
+
+/*
+==================
+Cache_MakeLRU
+==================
+*/
+static void Cache_MakeLRU(cacheshard_t *shard, cache_t *cache)
+{	
+#ifdef PARANOID
+	if (cache->lru_next || cache->lru_prev)
+		Sys_Error("Cache_MakeLRU: active cache links");
+#endif
+
+	shard->chain.lru_next->lru_prev = cache;
+	cache->lru_next = shard->chain.lru_next;
+	cache->lru_prev = &shard->chain;
+	shard->chain.lru_next = cache;
+}
+
+/*
+==================
+Cache_UnlinkLRU
+==================
+*/
+static void Cache_UnlinkLRU(cache_t *cache)
+{
+#ifdef PARANOID	
+	if (!cache)
+		Sys_Error("Cache_UnlinkLRU: null cache");
+	if (!cache->lru_next || !cache->lru_prev)
+		Sys_Error("Cache_UnlinkLRU: null cache links");
+#endif
+
+	cache->lru_next->lru_prev = cache->lru_prev;
+	cache->lru_prev->lru_next = cache->lru_next;
+	cache->lru_next = cache->lru_prev = 0;
+}
+
+/*
+==================
+Cache_FreeBlock
+==================
+*/
+static void Cache_FreeBlock(cacheshard_t *shard, cache_t *cache)
+{
+	Cache_GapUnindex(shard, cache);
+
+	cache->prev->next = cache->next;
+	cache->next->prev = cache->prev;
+	Cache_GapReindex(shard, cache->prev);
+	cache->next = cache->prev = 0;
+
+	*cache->id = 0;
+	Cache_UnlinkLRU(cache);
+}
+
+/*
+==================
+Cache_AllocBlock
+
+The eviction loop only holds the lock of the shard the block goes to,
+pinned blocks are skipped; a block larger than any shard gets neighbour shards merged,
+returns 0 if the block doesn't fit even with everything unpinned thrown out
+==================
+*/
+static void * Cache_AllocBlock(cacheid_t *id, size_t size, const char *name, qboolean_t pin)
+{
+	cacheshard_t *shard;
+	cache_t *cache, *victim;
+
+#ifdef PARANOID
+	if (!id || size == 0 || !name)
+		Sys_Error("Cache_Alloc: bad params");
+	if (*id)
+		Sys_Error("Cache_Alloc: already allocated");
+#endif
+
+	size = (size + sizeof(cache_t) + (HUNKALIGNMENT - 1)) & ~(HUNKALIGNMENT - 1);
+
+	shard = Cache_ShardForId(id, size);
+	EnterCriticalCode(&shard->criticalcode);
+	if (Cache_ShardSpan(shard) < size) {
+		LeaveCriticalCode(&shard->criticalcode);
+
+		shard = Cache_MergeShards(size);
+		if (!shard)
+			return 0;                       // larger than the whole cache
+	}
+
+	//
+	// find memory for it
+	//
+	while (true) {
+		cache = Cache_TryAlloc(shard, size, false);
+		if (cache)
+			break;
+
+		//
+		// throw out the least recently used block of the shard
+		//
+		for (victim = shard->chain.lru_prev; victim != &shard->chain && victim->pins; victim = victim->lru_prev)
+			;
+		if (victim == &shard->chain) {
+			LeaveCriticalCode(&shard->criticalcode);
+			return 0;
+		}
+
+		Cache_FreeBlock(shard, victim);
+	}
+
+	Q_strncpy(cache->name, name, MAXCACHENAME);
+	cache->id = id;
+	cache->pins = pin ? 1 : 0;
+	*id = (void *)(cache + 1);
+
+	LeaveCriticalCode(&shard->criticalcode);
+	return cache + 1;
+}
+
+/*
+==================
+Cache_Alloc
+==================
+*/
+void * Cache_Alloc(cacheid_t *id, size_t size, const char *name)
+{
+	void *data;
+
+	data = Cache_AllocBlock(id, size, name, false);
+	if (!data)
+		Sys_Error("Cache_Alloc: out of memory for \"%s\" (%d bytes)", name, (int)size);
+
+	return data;
+}
+
+/*
+==================
+Cache_LockPinned
+
+Returns the shard of a pinned block locked,
+the block might get relinked to another shard by a resplit meanwhile
+==================
+*/
+static cacheshard_t * Cache_LockPinned(cache_t *cache)
+{
+	cacheshard_t *shard;
+
+	while (true) {
+		shard = cache->shard;
+		EnterCriticalCode(&shard->criticalcode);
+		if (cache->shard == shard)
+			return shard;
+		LeaveCriticalCode(&shard->criticalcode);
+	}
+}
+
+/*
+==================
+Cache_Bind
+
+Rebinds a block allocated pinned to another id, it stays pinned;
+returns false leaving it as it is if that id is already taken
+==================
+*/
+static qboolean_t Cache_Bind(cacheid_t *pinnedid, cacheid_t *id)
+{
+	cacheshard_t *shard;
+	cache_t *cache;
+
+	cache = (cache_t *)*pinnedid - 1;            // pinned blocks stay in place
+	shard = Cache_LockPinned(cache);
+
+	if (*id) {
+		LeaveCriticalCode(&shard->criticalcode);
+		return false;
+	}
+
+	*pinnedid = 0;
+	cache->id = id;
+	*id = (void *)(cache + 1);
+
+	LeaveCriticalCode(&shard->criticalcode);
+	return true;
+}
+
+/*
+==================
+Cache_LockBlock
+
+Returns the shard of the id's block locked, or 0 with nothing locked if the id is clear;
+the block might be moved or thrown out by another thread meanwhile,
+so it is checked to be still there once its shard is locked
+==================
+*/
+static cacheshard_t * Cache_LockBlock(cacheid_t *id, const char *callerfunc)
+{
+	cacheshard_t *shard;
+	void *data;
+
+	while (true) {
+		data = *id;
+		if (!data)
+			return 0;                       // already thrown out
+
+		shard = Cache_ShardForAddress(data);
+		if (!shard) {
+			EnterCriticalCode(&cache_shards[0].criticalcode);     // regions might be changing, any shard lock holds them
+			shard = Cache_ShardForAddress(data);
+			LeaveCriticalCode(&cache_shards[0].criticalcode);
+			if (!shard)
+				Sys_Error("%s: \"%p\" is out of cache", callerfunc, data);
+		}
+
+		EnterCriticalCode(&shard->criticalcode);
+		if (*id == data && Cache_ShardForAddress(data) == shard)
+			return shard;
+		LeaveCriticalCode(&shard->criticalcode);
+	}
+}
+
+/*
+==================
+Cache_Acquire
+
+Pins the block in place and makes it the most recently used one,
+returns 0 if it has been thrown out already
+==================
+*/
+void * Cache_Acquire(cacheid_t *id)
+{
+	cacheshard_t *shard;
+	cache_t *cache;
+
+#ifdef PARANOID
+	if (!id)
+		Sys_Error("Cache_Acquire: null id");
+#endif
+
+	shard = Cache_LockBlock(id, "Cache_Acquire");
+	if (!shard)
+		return 0;
+
+	cache = (cache_t *)*id - 1;
+	cache->pins++;
+	Cache_UnlinkLRU(cache);
+	Cache_MakeLRU(shard, cache);
+
+	LeaveCriticalCode(&shard->criticalcode);
+	return cache + 1;
+}
+
+/*
+==================
+Cache_Release
+
+Unpins a block acquired or allocated pinned
+==================
+*/
+void Cache_Release(cacheid_t *id)
+{
+	cacheshard_t *shard;
+	cache_t *cache;
+
+#ifdef PARANOID
+	if (!id || !*id)
+		Sys_Error("Cache_Release: not acquired");
+#endif
+
+	cache = (cache_t *)*id - 1;                  // pinned blocks stay in place
+	shard = Cache_LockPinned(cache);
+
+#ifdef PARANOID
+	if (cache->pins <= 0)
+		Sys_Error("Cache_Release: \"%s\" isn't pinned", cache->name);
+#endif
+
+	cache->pins--;
+
+	LeaveCriticalCode(&shard->criticalcode);
+}
+
+/*
+==================
+Cache_Free
+
+Waits for a pinned block to get unpinned
+==================
+*/
+void Cache_Free(cacheid_t *id)
+{
+	cacheshard_t *shard;
+	cache_t *cache;
+
+#ifdef PARANOID
+	if (!id)
+		Sys_Error("Cache_Free: null id");
+#endif
+
+	while (true) {
+		shard = Cache_LockBlock(id, "Cache_Free");
+		if (!shard)
+			return;
+
+		cache = (cache_t *)*id - 1;
+		if (!cache->pins) {
+			Cache_FreeBlock(shard, cache);
+			LeaveCriticalCode(&shard->criticalcode);
+			return;
+		}
+
+		LeaveCriticalCode(&shard->criticalcode);
+		Sys_Yield();                        // wait for the loader or readers to be done with it
+	}
+}
+
+/*
+=================
+Cache_Flush
+
+Flush everything, so new data wil be demand cached
+=================
+*/
+void Cache_Flush(void)
+{
+	cacheshard_t *shard;
+	cache_t *cache, *next;
+	qboolean_t pinned;
+	int i;
+
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+
+		do {
+			pinned = false;
+
+			EnterCriticalCode(&shard->criticalcode);
+			for (cache = shard->chain.next; cache != &shard->chain; cache = next) {
+				next = cache->next;
+				if (cache->pins) pinned = true;                     // wait for the loader or readers to release it
+				else             Cache_FreeBlock(shard, cache);     // reclaim the space
+			}
+			LeaveCriticalCode(&shard->criticalcode);
+
+			if (pinned)
+				Sys_Yield();
+		} while (pinned);
+	}
+
+	Cache_Rebalance();                      // splits the merged shards again
+}
+
+/*
+=================
+Cache_Check
+
+Runs cache validation
+=================
+*/
+void Cache_Check(void)
+{
+	cacheshard_t *shard;
+	cache_t *cache;
+	unsigned indexed;
+	int i;
+
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+		indexed = 0;
+
+		EnterCriticalCode(&shard->criticalcode);
+
+		for (cache = shard->chain.next; cache != &shard->chain; cache = cache->next) {
+			if (cache->shard != shard)
+				Sys_Error("Cache_Check: \"%s\" is in a foreign shard", cache->name);
+			if (cache->next->prev != cache)
+				Sys_Error("Cache_Check: linkage corrupted on \"%s\"", cache->name);
+			if ((byte_t *)cache < shard->low || (byte_t *)cache + cache->size > shard->high)
+				Sys_Error("Cache_Check: \"%s\" is out of its shard region", cache->name);
+			if (cache->next != &shard->chain && (byte_t *)cache + cache->size > (byte_t *)cache->next)
+				Sys_Error("Cache_Check: \"%s\" overlaps the next block", cache->name);
+
+			if (cache->next != &shard->chain && (byte_t *)cache->next - ((byte_t *)cache + cache->size) > 0) {
+				if (!cache->gap_height || cache->gap != (size_t)((byte_t *)cache->next - ((byte_t *)cache + cache->size)))
+					Sys_Error("Cache_Check: gap after \"%s\" is not indexed properly", cache->name);
+				indexed++;
+			} else if (cache->gap_height) {
+				Sys_Error("Cache_Check: \"%s\" is indexed without a gap", cache->name);
+			}
+		}
+
+		if (Cache_GapCount(shard->gaps) != indexed)
+			Sys_Error("Cache_Check: gaps index is out of sync");
+		if (shard->gaps && (unsigned)shard->gaps->gap_height > 2 * (BitscanBackward(indexed) + 2))
+			Sys_Error("Cache_Check: gaps index is unbalanced");
+
+		LeaveCriticalCode(&shard->criticalcode);
+	}
+}
+
+/*
+=================
+Cache_Print
+
+Prints out cache statistics
+=================
+*/
+void Cache_Print(void)
+{
+	cacheshard_t *shard;
+	cache_t *cache;
+	int i;
+
+	for (i = 0; i < CACHESHARDS; i++) {
+		shard = &cache_shards[i];
+
+		EnterCriticalCode(&shard->criticalcode);
+
+		COM_Printf("shard %d: %d Kb\n", i, (int)(Cache_ShardSpan(shard) / 1024));
+		for (cache = shard->chain.next; cache != &shard->chain; cache = cache->next)
+			COM_Printf("  %s: %d\n", cache->name, cache->size);
+
+		LeaveCriticalCode(&shard->criticalcode);
+	}
+}
+
+/*
+============================================================================================================
+
+Cache Store
+
+An optional file mapped store keeping loaded blocks between runs. Entries are keyed by the content
+hash the requester gives to Cache_RequestStored, and the whole store gets dropped once the build
+changes. Only the cache I/O thread touches the store after it is opened, stored blocks get paged
+in from the file on demand as they are copied, so nothing is read up front. The entries are checked
+against the store bounds and the data against its CRC, so a torn or damaged store is never trusted.
+
+============================================================================================================
+*/
+#define CACHESTOREMAGIC   (('Q' << 24) | ('C' << 16) | ('S' << 8) | '2')
+#define CACHESTOREENTRIES 4096               // power of two
+typedef struct {
+	unsigned key;                            // 0 if the entry is empty
+	unsigned size;
+	unsigned offset;                         // from the store start
+	unsigned crc;                            // COM_ComputeCRC of the data
+} cachestoreentry_t;
+typedef struct {
+	unsigned magic;
+	unsigned buildid;
+	unsigned size;                           // whole store size
+	unsigned used;                           // data area fill
+	unsigned numentries;
+	cachestoreentry_t entries[CACHESTOREENTRIES];
+} cachestoreheader_t;
+static maphandle_t cache_store = BADMAPPING;
+static cachestoreheader_t *cache_storeheader;
+static unsigned cache_storedata;             // data area offset
+
+/*
+==================
+Cache_BuildId
+==================
+*/
+static unsigned Cache_BuildId(void)
+{
+	static const char build[] = BUILDSTRING " " __DATE__ " " __TIME__;
+
+	return COM_ComputeCRC((void *)build, sizeof(build) - 1);
+}
+
+/*
+==================
+Cache_ResetStore
+==================
+*/
+static void Cache_ResetStore(void)
+{
+	Q_memset(cache_storeheader->entries, 0, sizeof(cache_storeheader->entries));
+	cache_storeheader->used = 0;
+	cache_storeheader->numentries = 0;
+	cache_storeheader->buildid = Cache_BuildId();
+	cache_storeheader->magic = CACHESTOREMAGIC;
+}
+
+/*
+==================
+Cache_StoreEntryValid
+
+Tells if an entry's data lies within the data area of the store
+==================
+*/
+inline qboolean_t Cache_StoreEntryValid(cachestoreentry_t *entry)
+{
+	return entry->offset >= cache_storedata && entry->offset <= cache_storeheader->size &&
+		entry->size <= cache_storeheader->size - entry->offset;
+}
+
+/*
+==================
+Cache_OpenStore
+
+Must be called before any requests are made
+==================
+*/
+void Cache_OpenStore(const char *filename, size_t size)
+{
+	void *view;
+	unsigned i;
+
+#ifdef PARANOID
+	if (!filename || !filename[0])
+		Sys_Error("Cache_OpenStore: bad params");
+#endif
+
+	if (cache_store != BADMAPPING)
+		Sys_Error("Cache_OpenStore: store is already open");
+
+	cache_storedata = (sizeof(cachestoreheader_t) + (HUNKALIGNMENT - 1)) & ~(HUNKALIGNMENT - 1);
+	if (size < cache_storedata * 2)
+		size = cache_storedata * 2;
+	if (size > UINT_MAX)
+		size = UINT_MAX & ~(HUNKALIGNMENT - 1);
+
+	cache_store = Sys_MapFile(filename, size, &view);
+	if (cache_store == BADMAPPING) {
+		COM_DevPrintf("Cache_OpenStore: failed to map \"%s\", running without store\n", filename);
+		return;
+	}
+	cache_storeheader = (cachestoreheader_t *)view;
+
+	if (cache_storeheader->magic != CACHESTOREMAGIC || cache_storeheader->buildid != Cache_BuildId() ||
+		cache_storeheader->size != (unsigned)size || cache_storeheader->used > size - cache_storedata) {
+		cache_storeheader->size = (unsigned)size;
+		Cache_ResetStore();                      // stale or foreign store
+	}
+
+	for (i = 0; i < CACHESTOREENTRIES; i++) {
+		if (cache_storeheader->entries[i].key && !Cache_StoreEntryValid(&cache_storeheader->entries[i])) {
+			COM_DevPrintf("Cache_OpenStore: \"%s\" is damaged, dropping it\n", filename);
+			Cache_ResetStore();
+			break;
+		}
+	}
+
+	COM_DevPrintf("Cache_OpenStore: \"%s\" has %d entries, %d Kb\n", filename, cache_storeheader->numentries, cache_storeheader->used / 1024);
+}
+
+/*
+==================
+Cache_CloseStore
+==================
+*/
+static void Cache_CloseStore(void)
+{
+	if (cache_store == BADMAPPING)
+		return;
+
+	Sys_UnmapFile(cache_store);
+	cache_store = BADMAPPING;
+	cache_storeheader = 0;
+}
+
+/*
+==================
+Cache_StoreEntry
+
+Returns the entry having the key, or the empty one it should go to
+==================
+*/
+static cachestoreentry_t * Cache_StoreEntry(unsigned key)
+{
+	cachestoreentry_t *entry;
+	unsigned i;
+
+	for (i = key & (CACHESTOREENTRIES - 1); ; i = (i + 1) & (CACHESTOREENTRIES - 1)) {
+		entry = &cache_storeheader->entries[i];
+		if (!entry->key || entry->key == key)
+			return entry;
+	}
+}
+
+/*
+==================
+Cache_StoreLoad
+
+Returns false if the block isn't stored or its data is damaged
+==================
+*/
+static qboolean_t Cache_StoreLoad(unsigned key, void *data, size_t size)
+{
+	cachestoreentry_t *entry;
+
+	if (cache_store == BADMAPPING)
+		return false;
+
+	entry = Cache_StoreEntry(key);
+	if (entry->key != key || entry->size != size || !Cache_StoreEntryValid(entry))
+		return false;
+
+	Q_memcpy(data, (byte_t *)cache_storeheader + entry->offset, size);
+	if (COM_ComputeCRC(data, size) != entry->crc) {
+		COM_DevPrintf("Cache_StoreLoad: stored data of %08x is damaged\n", key);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+==================
+Cache_StoreSave
+
+The store gets dropped as a whole once it's full; the data is written
+before the entry, but the mapped pages reach the file in no particular order,
+so an interrupted save may leave a broken entry, caught by the CRC on load
+==================
+*/
+static void Cache_StoreSave(unsigned key, void *data, size_t size)
+{
+	cachestoreentry_t *entry;
+	unsigned offset, capacity, space;
+
+	if (cache_store == BADMAPPING)
+		return;
+
+	capacity = cache_storeheader->size - cache_storedata;
+	space = (unsigned)((size + (HUNKALIGNMENT - 1)) & ~(HUNKALIGNMENT - 1));
+	if (size > capacity || space > capacity)
+		return;
+
+	if (cache_storeheader->used + space > capacity || cache_storeheader->numentries >= CACHESTOREENTRIES / 4 * 3) {
+		COM_DevPrintf("Cache_StoreSave: store is full, dropping it\n");
+		Cache_ResetStore();
+	}
+
+	offset = cache_storedata + cache_storeheader->used;
+	Q_memcpy((byte_t *)cache_storeheader + offset, data, size);
+	cache_storeheader->used += space;
+
+	entry = Cache_StoreEntry(key);
+	if (!entry->key)
+		cache_storeheader->numentries++;     // otherwise the old data is left until the store gets dropped
+	entry->offset = offset;
+	entry->size = (unsigned)size;
+	entry->crc = COM_ComputeCRC(data, size);
+	entry->key = key;
+
+	Sys_FlushMapping(cache_store, (byte_t *)cache_storeheader + offset, size);
+}
+
+/*
+============================================================================================================
+
+Cache Requests
+
+Blocks are allocated pinned and filled by loaders on the cache I/O thread, then get bound to
+the requester's id, so the requester never sees a block that is still being loaded. A ready
+request keeps its block pinned until it's released, so its data can't be moved or thrown out
+while the requester uses it.
+
+============================================================================================================
+*/
+#define CACHEREQUESTBITS 8
+#define MAXCACHEREQUESTS (1 << CACHEREQUESTBITS)
+#define CACHESERIALMASK (INT_MAX >> CACHEREQUESTBITS)
+typedef struct {
+	volatile int  state;                     // cacherequeststate_t, 0 if the slot is free
+	qboolean_t    released;                  // nobody waits for the request anymore
+	unsigned      serial;                    // tells stale handles on slot reuse
+
+	cacheid_t *   id;
+	unsigned      key;                       // content hash for the store, 0 if not stored
+	cacheid_t     pinnedid;                  // holds the block while it's being loaded
+	void *        data;                      // pinned for the request once ready, 0 if failed
+	size_t        size;
+	char          name[MAXCACHENAME];
+	cacheloader_t loader;
+	void *        param;
+} cacherequestslot_t;
+static cacherequestslot_t cache_requests[MAXCACHEREQUESTS];
+static int cache_queue[MAXCACHEREQUESTS];        // slot indices, can't overflow as slots are limited too
+static unsigned cache_queuehead, cache_queuetail;
+static criticalcode_t requestcriticalcode;
+
+static threadhandle_t cache_loader = BADTHREAD;
+static synchandle_t cache_loadsignal = BADSYNC;  // counts queued requests
+static volatile qboolean_t cache_loaderquit;
+
+/*
+==================
+Cache_RequestSlot
+==================
+*/
+static cacherequestslot_t * Cache_RequestSlot(cacherequest_t request, const char *callerfunc)
+{
+	cacherequestslot_t *req;
+
+	if (request == BADREQUEST)
+		Sys_Error("%s: bad request", callerfunc);
+
+	req = &cache_requests[request & (MAXCACHEREQUESTS - 1)];
+	if (!req->state || (req->serial & CACHESERIALMASK) != (unsigned)request >> CACHEREQUESTBITS)
+		Sys_Error("%s: stale request", callerfunc);
+
+	return req;
+}
+
+/*
+==================
+Cache_FinishRequest
+
+Frees the slot if its owner has already released it
+==================
+*/
+static void Cache_FinishRequest(cacherequestslot_t *req, cacherequeststate_t state)
+{
+	qboolean_t released;
+
+	EnterCriticalCode(&requestcriticalcode);
+
+	released = req->released;
+	if (!released)
+		req->state = state;
+
+	LeaveCriticalCode(&requestcriticalcode);
+
+	if (released) {
+		if (req->data)
+			Cache_Release(req->id);
+		req->data = 0;
+
+		EnterCriticalCode(&requestcriticalcode);
+		req->state = 0;
+		req->serial++;
+		LeaveCriticalCode(&requestcriticalcode);
+	}
+}
+
+/*
+==================
+Cache_LoaderThread
+==================
+*/
+static void Cache_LoaderThread(void *param)
+{
+	cacherequestslot_t *req;
+	void *data;
+	qboolean_t loaded;
+
+	while (true) {
+		Sys_SyncWait(cache_loadsignal);
+		if (cache_loaderquit)
+			break;
+
+		EnterCriticalCode(&requestcriticalcode);
+		req = &cache_requests[cache_queue[cache_queuetail++ & (MAXCACHEREQUESTS - 1)]];
+		req->state = cacherequest_loading;
+		LeaveCriticalCode(&requestcriticalcode);
+
+		req->data = Cache_Acquire(req->id);
+		if (req->data) {
+			Cache_FinishRequest(req, cacherequest_ready);    // got cached meanwhile
+			continue;
+		}
+
+		data = Cache_AllocBlock(&req->pinnedid, req->size, req->name, true);
+		if (!data) {
+			COM_DevPrintf("Cache_LoaderThread: no room for \"%s\" (%d bytes)\n", req->name, (int)req->size);
+			Cache_FinishRequest(req, cacherequest_failed);
+			continue;
+		}
+
+		if (req->key && Cache_StoreLoad(req->key, data, req->size)) {
+			loaded = true;
+		} else {
+			loaded = req->loader(data, req->size, req->param);
+			if (loaded && req->key)
+				Cache_StoreSave(req->key, data, req->size);
+		}
+		//
+		// the request keeps the block pinned, or the one that
+		// has got bound to its id meanwhile, throwing out the copy
+		//
+		while (loaded) {
+			if (Cache_Bind(&req->pinnedid, req->id)) {
+				req->data = data;
+				break;
+			}
+			req->data = Cache_Acquire(req->id);
+			if (req->data)
+				break;
+		}
+		if (req->pinnedid) {
+			Cache_Release(&req->pinnedid);
+			Cache_Free(&req->pinnedid);
+		}
+
+		Cache_FinishRequest(req, loaded ? cacherequest_ready : cacherequest_failed);
+	}
+}
+
+/*
+==================
+Cache_StartLoader
+==================
+*/
+static void Cache_StartLoader(void)
+{
+	cache_loadsignal = Sys_SyncNewSemaphore(0, MAXCACHEREQUESTS + 1, 0);
+	if (cache_loadsignal == BADSYNC)
+		Sys_Error("Cache_StartLoader: failed to create the load signal");
+
+	cache_loaderquit = false;
+	cache_loader = Sys_NewThread(Cache_LoaderThread, 0);
+	if (cache_loader == BADTHREAD)
+		Sys_Error("Cache_StartLoader: failed to start the cache I/O thread");
+}
+
+/*
+==================
+Cache_StopLoader
+==================
+*/
+static void Cache_StopLoader(void)
+{
+	if (cache_loader == BADTHREAD)
+		return;
+
+	cache_loaderquit = true;
+	Sys_SyncUnlock(cache_loadsignal);
+	Sys_WaitThread(cache_loader);
+	Sys_SyncLoose(cache_loadsignal);
+
+	cache_loader = BADTHREAD;
+	cache_loadsignal = BADSYNC;
+}
+
+/*
+==================
+Cache_RequestStored
+
+Queues a block to be loaded on the cache I/O thread, the store is checked
+for the key before calling the loader, the request must be released by Cache_ReleaseRequest
+==================
+*/
+cacherequest_t Cache_RequestStored(cacheid_t *id, size_t size, const char *name, unsigned key, cacheloader_t loader, void *param)
+{
+	cacherequestslot_t *req;
+	void *data;
+	int i;
+
+#ifdef PARANOID
+	if (!id || size == 0 || !name || !loader)
+		Sys_Error("Cache_RequestStored: bad params");
+#endif
+
+	data = Cache_Acquire(id);                       // already cached
+
+	EnterCriticalCode(&requestcriticalcode);
+
+	for (i = 0; i < MAXCACHEREQUESTS; i++) {
+		if (!cache_requests[i].state)
+			break;
+	}
+	if (i == MAXCACHEREQUESTS) {
+		LeaveCriticalCode(&requestcriticalcode);
+		if (data)
+			Cache_Release(id);
+		COM_DevPrintf("Cache_RequestStored: too many requests for \"%s\"\n", name);
+		return BADREQUEST;
+	}
+
+	req = &cache_requests[i];
+	req->released = false;
+	req->id = id;
+	req->key = key;
+	req->pinnedid = 0;
+	req->size = size;
+	Q_strncpy(req->name, name, MAXCACHENAME);
+	req->loader = loader;
+	req->param = param;
+	req->data = data;
+
+	if (!data) {
+		req->state = cacherequest_queued;
+		cache_queue[cache_queuehead++ & (MAXCACHEREQUESTS - 1)] = i;
+	} else {
+		req->state = cacherequest_ready;
+	}
+
+	LeaveCriticalCode(&requestcriticalcode);
+
+	if (!data)
+		Sys_SyncUnlock(cache_loadsignal);
+
+	return (cacherequest_t)(((req->serial & CACHESERIALMASK) << CACHEREQUESTBITS) | i);
+}
+
+/*
+==================
+Cache_Request
+==================
+*/
+cacherequest_t Cache_Request(cacheid_t *id, size_t size, const char *name, cacheloader_t loader, void *param)
+{
+	return Cache_RequestStored(id, size, name, 0, loader, param);
+}
+
+/*
+==================
+Cache_RequestState
+==================
+*/
+cacherequeststate_t Cache_RequestState(cacherequest_t request)
+{
+	return (cacherequeststate_t)Cache_RequestSlot(request, "Cache_RequestState")->state;
+}
+
+/*
+==================
+Cache_RequestData
+
+Returns the placeholder until the request is ready, the block is pinned
+for the request, so the data stays valid until Cache_ReleaseRequest
+==================
+*/
+void * Cache_RequestData(cacherequest_t request, void *placeholder)
+{
+	cacherequestslot_t *req;
+
+	req = Cache_RequestSlot(request, "Cache_RequestData");
+	if (req->state != cacherequest_ready)
+		return placeholder;
+
+	return req->data;
+}
+
+/*
+==================
+Cache_WaitRequest
+==================
+*/
+cacherequeststate_t Cache_WaitRequest(cacherequest_t request)
+{
+	cacherequestslot_t *req;
+
+	req = Cache_RequestSlot(request, "Cache_WaitRequest");
+	while (req->state == cacherequest_queued || req->state == cacherequest_loading)
+		Sys_Yield();
+
+	return (cacherequeststate_t)req->state;
+}
+
+/*
+==================
+Cache_ReleaseRequest
+
+The loaded block gets unpinned but stays in cache, so it can be moved or
+thrown out from now on, and the request gets invalid
+==================
+*/
+void Cache_ReleaseRequest(cacherequest_t request)
+{
+	cacherequestslot_t *req;
+
+	req = Cache_RequestSlot(request, "Cache_ReleaseRequest");
+
+	EnterCriticalCode(&requestcriticalcode);
+
+	if (req->state == cacherequest_queued || req->state == cacherequest_loading) {
+		req->released = true;                        // the loader frees it when done
+		LeaveCriticalCode(&requestcriticalcode);
+		return;
+	}
 
-	EnterCriticalCode(&cachecriticalcode);
+	LeaveCriticalCode(&requestcriticalcode);
 
-	for (cache = cachechain.next; cache != &cachechain; cache = cache->next)
-		COM_Printf("%s: %d\n", cache->name, cache->size);
+	if (req->data)
+		Cache_Release(req->id);
+	req->data = 0;
 
-	LeaveCriticalCode(&cachecriticalcode);
+	EnterCriticalCode(&requestcriticalcode);
+	req->state = 0;
+	req->serial++;
+	LeaveCriticalCode(&requestcriticalcode);
 }
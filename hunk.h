@@ -29,6 +29,8 @@ size_t Hunk_Size(void);
 size_t Hunk_LowMark(void);
 size_t Hunk_HighMark(void);
 
+// the allocs return 0 if a pinned cache block (being loaded or acquired) is in the way,
+// they can be retried once it's released
 void * Hunk_LowAlloc(size_t size);
 void * Hunk_LowAllocNamed(size_t size, const char *name);
 
@@ -58,6 +60,7 @@ void Zone_Init(size_t size, size_t zminfrag);    // zminfrag is a minimally requ
 
 void * Zone_Alloc(size_t size);
 void Zone_Free(void *addr);
+unsigned Zone_AllocCount(void);
 
 void Zone_Check(void);
 void Zone_Print(void);
@@ -68,17 +71,56 @@ void Zone_Print(void);
 Cache memory allocator primary goal is to minimize used memory size
 and avoid same data repeats, load and store.
 
+Cache uses the hunk memory left between the low and the high marks, split into
+independently locked shards, so it can be used by multiple threads at once.
+A cached block may be moved or thrown out at any time, clearing its id. A thread
+that shares the cache with others must hold the block with Cache_Acquire while using
+the data, it stays in place and gets marked as recently used until Cache_Release.
+Cache_Free and Cache_Flush wait for acquired blocks to be released.
+
 =========================================================================================================================
 */
 typedef void * cacheid_t;
 
 void Cache_Init(void);
-
-void * Cache_Alloc(cacheid_t *id, size_t size);
-void Cache_Free(cacheid_t *id, void *addr);
-void Cache_Flush(cacheid_t *id);
-
-void Cache_Check(cacheid_t *id);
-void Cache_Print(cacheid_t *id);
+void Cache_Shutdown(void);
+
+void * Cache_Alloc(cacheid_t *id, size_t size, const char *name);
+void Cache_Free(cacheid_t *id);
+void Cache_Flush(void);
+
+void * Cache_Acquire(cacheid_t *id);    // returns 0 if thrown out already
+void Cache_Release(cacheid_t *id);
+
+void Cache_Check(void);
+void Cache_Print(void);
+
+#define CACHESTOREDEFSIZE (64 * 1024 * 1024)
+void Cache_OpenStore(const char *filename, size_t size);    // persistent store keeping requested blocks between runs
+
+//
+// Cache requests load blocks in the background: a loader callback fills a new block
+// on the cache I/O thread, while the requester polls the request and uses its own placeholder
+// data until the block is ready. Loaders must not allocate hunk memory. A request
+// fails if its block doesn't fit into the cache with all the unpinned blocks thrown out.
+// A ready request keeps its block pinned like Cache_Acquire, until Cache_ReleaseRequest.
+//
+#define BADREQUEST BADHANDLE
+typedef int cacherequest_t;
+typedef enum {
+	cacherequest_queued = 1,
+	cacherequest_loading,
+	cacherequest_ready,
+	cacherequest_failed
+} cacherequeststate_t;
+typedef qboolean_t (*cacheloader_t)(void *data, size_t size, void *param);    // runs on the cache I/O thread, returns false if failed
+
+cacherequest_t      Cache_Request(cacheid_t *id, size_t size, const char *name, cacheloader_t loader, void *param);  // returns BADREQUEST if too many in flight
+cacherequest_t      Cache_RequestStored(cacheid_t *id, size_t size, const char *name, unsigned key,                  // key is the content hash of the source data,
+                                    cacheloader_t loader, void *param);                                             // the loader is skipped if the store has it
+cacherequeststate_t Cache_RequestState(cacherequest_t request);
+void *              Cache_RequestData(cacherequest_t request, void *placeholder);                                   // placeholder until the block is ready, valid till released
+cacherequeststate_t Cache_WaitRequest(cacherequest_t request);
+void                Cache_ReleaseRequest(cacherequest_t request);
 
 #endif // #ifndef HUNK_H
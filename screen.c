@@ -1,8 +1,21 @@
 // screen.c
 
 #include "screen.h"
+#include "cvar.h"
 #include "vid.h"
 
+static cvarhandle_t vid_mode, vid_windowed;
+
+/*
+=================
+SCR_VidChanged
+=================
+*/
+static void SCR_VidChanged(cvarhandle_t id, void *param)
+{
+	VID_SetMode(Cvar_Int(vid_mode), Cvar_Bool(vid_windowed));
+}
+
 /*
 =================
 SCR_Init
@@ -10,17 +23,16 @@ SCR_Init
 */
 void SCR_Init(void)
 {
-	int vid_mode;
-	qboolean_t vid_windowed;
-	
 	//
 	// basic video initialization
 	//
 	VID_Init();
 	
-	Cvar_VariableInt("vid_mode", &vid_mode, 0);
-	Cvar_VariableBoolean("vid_windowed", &vid_windowed, false);
-	VID_SetMode(vid_mode, vid_windowed);
+	vid_mode = Cvar_Register("vid_mode", "0", CVAR_LATCH);             // a mode change and a window change
+	vid_windowed = Cvar_Register("vid_windowed", "0", CVAR_LATCH);     // set together restart the video once
+	Cvar_SetCallback(vid_mode, SCR_VidChanged, 0);
+	Cvar_SetCallback(vid_windowed, SCR_VidChanged, 0);
+	VID_SetMode(Cvar_Int(vid_mode), Cvar_Bool(vid_windowed));
 };
 
 /*
@@ -30,5 +42,8 @@ SCR_Shutdown
 */
 void SCR_Shutdown(void)
 {
+	Cvar_SetCallback(vid_mode, 0, 0);
+	Cvar_SetCallback(vid_windowed, 0, 0);
+
 	VID_Shutdown();
 }
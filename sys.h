@@ -34,6 +34,8 @@ typedef struct {
 void Sys_BeginBenchmark(benchmark_t *benchmark);
 void Sys_Benchmark(benchmark_t *benchmark, qboolean_t rewrite);
 
+double Sys_FloatTime(void);                                                    // secs since Sys_Init
+
 qboolean_t Sys_Sleep(unsigned msecs);
 void       Sys_SleepForever(void);
 void Sys_Yield(void);
@@ -59,13 +61,30 @@ unsigned   Sys_FRead(filehandle_t id, void *buf, unsigned count);
 unsigned   Sys_FWrite(filehandle_t id, void *buf, unsigned count);
 qboolean_t Sys_FSeek(filehandle_t id, size_t count, seekorigin_t origin, size_t *out);
 size_t     Sys_FTell(filehandle_t id);
-void       Sys_FFlush(filehandle_t id);
+qboolean_t Sys_FFlush(filehandle_t id);                                         // returns false in case of error
 
 // filesystem
 qboolean_t Sys_Mkdir(const char *dirname);
 qboolean_t Sys_Rmdir(const char *dirname);
 
 qboolean_t Sys_Unlink(const char *filename);
+qboolean_t Sys_Rename(const char *oldname, const char *newname);               // replaces newname if it exists, as a single step
+qboolean_t Sys_FileTime(const char *filename, qw_t *o_time);                   // last write time, comparable only to the other ones; false if missing
+
+// memory mapped files
+#define BADMAPPING BADHANDLE
+typedef int maphandle_t;
+maphandle_t Sys_MapFile(const char *filename, size_t size, void **out);      // creates the file if missing, returns BADMAPPING in case of error
+maphandle_t Sys_MapFileForReading(const char *filename, const void **out, size_t *o_size);  // maps the whole file read only, returns BADMAPPING if missing or empty
+void        Sys_UnmapFile(maphandle_t id);
+void        Sys_FlushMapping(maphandle_t id, void *data, size_t size);       // starts writing back the dirty pages of the range
+
+// directory change notifications
+#define BADWATCH BADHANDLE
+typedef int watchhandle_t;
+watchhandle_t Sys_WatchDirectory(const char *dirname);                       // files written, created, renamed or deleted, returns BADWATCH in case of error
+qboolean_t    Sys_DirectoryChanged(watchhandle_t id);                        // never blocks, true once per batch of changes since the last call
+void          Sys_UnwatchDirectory(watchhandle_t id);
 
 #define MAXFILENAME 1024
 extern char sys_exebasename[MAXFILENAME];
@@ -142,5 +161,22 @@ void       Sys_SyncUnlock(synchandle_t id);
 void       Sys_SyncWait(synchandle_t id);
 qboolean_t Sys_SyncWaitTime(synchandle_t id, unsigned msecs);                            // returns false if timeout
 
+// threads
+#define BADTHREAD BADHANDLE
+typedef int threadhandle_t;
+typedef void (*threadfunc_t)(void *param);
+threadhandle_t Sys_NewThread(threadfunc_t func, void *param);                            // returns BADTHREAD in case of error
+void           Sys_WaitThread(threadhandle_t id);                                        // waits for the thread to end and frees the handle
+
+// local stream sockets, never block
+#define BADSOCKET BADHANDLE
+typedef int sockethandle_t;
+sockethandle_t Sys_ListenLocal(const char *path);                                        // returns BADSOCKET in case of error
+sockethandle_t Sys_AcceptLocal(sockethandle_t id);                                       // returns BADSOCKET if no connection is pending
+int            Sys_SocketRecv(sockethandle_t id, void *buf, unsigned count);             // returns bytes read, 0 if nothing pending, BADRETURN if closed
+int            Sys_SocketSend(sockethandle_t id, const void *buf, unsigned count);       // returns bytes sent, BADRETURN if closed
+unsigned       Sys_PollSockets(const sockethandle_t *ids, unsigned count, qboolean_t *o_readable, qboolean_t *o_writable, unsigned msecs);  // returns count of ready ones
+void           Sys_CloseSocket(sockethandle_t id);                                       // listening socket file gets removed as well
+
 #endif // #ifndef SYS_H
 
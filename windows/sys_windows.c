@@ -27,6 +27,7 @@ GENERAL SYSTEM IO
 ====================================================================================================
 */
 static qw_t pfreq;                               // performance counter frequency got by QueryPerformanceFrequency in Sys_Init
+static qw_t pstart;                              // performance counter at Sys_Init
 
 static qboolean_t silentabort;                   // true if -silentabort cmdline arg was specified
 qboolean_t sys_underdebugger;                    // true if the debugger is attached to the running process
@@ -292,6 +293,16 @@ inline qw_t Sys_PerformanceCounter(void)
 	return PerformanceCounter.QuadPart;
 }
 
+/*
+=================
+Sys_FloatTime
+=================
+*/
+double Sys_FloatTime(void)
+{
+	return (double)(Sys_PerformanceCounter() - pstart) / (double)pfreq;
+}
+
 /*
 =================
 Sys_BeginBenchmark
@@ -388,6 +399,18 @@ static struct {
 } filehandles[MAXFILEHANDLES] = {0};
 static criticalcode_t filecriticalcode;
 
+#define MAXMAPHANDLES 16
+static struct {
+	HANDLE file;
+	HANDLE mapping;
+	void *view;                              // null if the handle is free
+} maphandles[MAXMAPHANDLES] = {0};
+static criticalcode_t mapcriticalcode;
+
+#define MAXWATCHHANDLES 8
+static HANDLE watchhandles[MAXWATCHHANDLES] = {0};  // null if the handle is free
+static criticalcode_t watchcriticalcode;
+
 char sys_exebasename[MAXFILENAME] = {0};
 char sys_exefilename[MAXFILENAME] = {0};
 char sys_exefilepath[MAXFILENAME] = {0};
@@ -587,15 +610,17 @@ size_t Sys_FTell(filehandle_t id)
 /*
 =================
 Sys_FFlush
+
+Returns false if the buffered data could not be written out
 =================
 */
-void Sys_FFlush(filehandle_t id)
+qboolean_t Sys_FFlush(filehandle_t id)
 {
 #ifdef PARANOID	
 	VerifyFilehandle(id, "Sys_FFlush", false);
 #endif	
 	
-	FlushFileBufferes(filehandles[id].hFile);
+	return FlushFileBuffers(filehandles[id].hFile) == TRUE;
 }
 
 /*
@@ -647,6 +672,304 @@ qboolean_t Sys_Unlink(const char *filename)
 	return DeleteFile(filename);
 }
 
+/*
+=================
+Sys_Rename
+=================
+*/
+qboolean_t Sys_Rename(const char *oldname, const char *newname)
+{
+#ifdef PARANOID
+	if (!oldname || !oldname[0] || !newname || !newname[0])
+		Sys_Error("Sys_Rename: bad filenames");
+#endif
+
+	return MoveFileEx(oldname, newname, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == TRUE;
+}
+
+/*
+=================
+Sys_FileTime
+=================
+*/
+qboolean_t Sys_FileTime(const char *filename, qw_t *o_time)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+
+#ifdef PARANOID
+	if (!filename || !filename[0] || !o_time)
+		Sys_Error("Sys_FileTime: bad params");
+#endif
+
+	if (!GetFileAttributesEx(filename, GetFileExInfoStandard, &data)) {
+		*o_time = 0;
+		return false;
+	}
+
+	*o_time = ((qw_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
+
+/*
+=================
+Sys_MapFile
+
+Opens or creates the file and maps its whole size for reading and writing,
+the file gets grown up to size if shorter
+=================
+*/
+maphandle_t Sys_MapFile(const char *filename, size_t size, void **out)
+{
+	maphandle_t id;
+	HANDLE file, mapping;
+	void *view;
+
+#ifdef PARANOID
+	if (!filename || !filename[0] || size == 0 || !out)
+		Sys_Error("Sys_MapFile: bad params");
+#endif
+
+	*out = 0;
+
+	EnterCriticalCode(&mapcriticalcode);
+
+	for (id = 0; id < MAXMAPHANDLES; id++) {
+		if (!maphandles[id].view)
+			break;
+	}
+	if (id == MAXMAPHANDLES) {
+		LeaveCriticalCode(&mapcriticalcode);
+		COM_DevPrintf("Sys_MapFile: no unoccupied maphandles left\n");
+		return BADMAPPING;
+	}
+
+	file = CreateFile(filename, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) {
+		LeaveCriticalCode(&mapcriticalcode);
+		COM_DevPrintf("Sys_MapFile: CreateFile failed for \"%s\" (code 0x%x)\n", filename, GetLastError());
+		return BADMAPPING;
+	}
+
+	mapping = CreateFileMapping(file, 0, PAGE_READWRITE, (DWORD)((qw_t)size >> 32), (DWORD)size, 0);
+	if (!mapping) {
+		LeaveCriticalCode(&mapcriticalcode);
+		COM_DevPrintf("Sys_MapFile: CreateFileMapping failed for \"%s\" (code 0x%x)\n", filename, GetLastError());
+		CloseHandle(file);
+		return BADMAPPING;
+	}
+
+	view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!view) {
+		LeaveCriticalCode(&mapcriticalcode);
+		COM_DevPrintf("Sys_MapFile: MapViewOfFile failed for \"%s\" (code 0x%x)\n", filename, GetLastError());
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return BADMAPPING;
+	}
+
+	maphandles[id].file = file;
+	maphandles[id].mapping = mapping;
+	maphandles[id].view = view;
+
+	LeaveCriticalCode(&mapcriticalcode);
+
+	*out = view;
+	return id;
+}
+
+/*
+=================
+Sys_MapFileForReading
+
+Others may read the file meanwhile, but not write it
+=================
+*/
+maphandle_t Sys_MapFileForReading(const char *filename, const void **out, size_t *o_size)
+{
+	maphandle_t id;
+	HANDLE file, mapping;
+	LARGE_INTEGER size;
+	void *view;
+
+#ifdef PARANOID
+	if (!filename || !filename[0] || !out || !o_size)
+		Sys_Error("Sys_MapFileForReading: bad params");
+#endif
+
+	*out = 0;
+	*o_size = 0;
+
+	EnterCriticalCode(&mapcriticalcode);
+
+	for (id = 0; id < MAXMAPHANDLES; id++) {
+		if (!maphandles[id].view)
+			break;
+	}
+	if (id == MAXMAPHANDLES) {
+		LeaveCriticalCode(&mapcriticalcode);
+		COM_DevPrintf("Sys_MapFileForReading: no unoccupied maphandles left\n");
+		return BADMAPPING;
+	}
+
+	file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) {
+		LeaveCriticalCode(&mapcriticalcode);
+		return BADMAPPING;                 // missing is not an error here
+	}
+
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || (qw_t)size.QuadPart > (size_t)-1) {
+		LeaveCriticalCode(&mapcriticalcode);
+		CloseHandle(file);
+		return BADMAPPING;
+	}
+
+	mapping = CreateFileMapping(file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mapping) {
+		LeaveCriticalCode(&mapcriticalcode);
+		COM_DevPrintf("Sys_MapFileForReading: CreateFileMapping failed for \"%s\" (code 0x%x)\n", filename, GetLastError());
+		CloseHandle(file);
+		return BADMAPPING;
+	}
+
+	view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		LeaveCriticalCode(&mapcriticalcode);
+		COM_DevPrintf("Sys_MapFileForReading: MapViewOfFile failed for \"%s\" (code 0x%x)\n", filename, GetLastError());
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return BADMAPPING;
+	}
+
+	maphandles[id].file = file;
+	maphandles[id].mapping = mapping;
+	maphandles[id].view = view;
+
+	LeaveCriticalCode(&mapcriticalcode);
+
+	*out = view;
+	*o_size = (size_t)size.QuadPart;
+	return id;
+}
+
+/*
+=================
+Sys_UnmapFile
+
+Dirty pages get written back to the file
+=================
+*/
+void Sys_UnmapFile(maphandle_t id)
+{
+#ifdef PARANOID
+	if (id < 0 || id >= MAXMAPHANDLES || !maphandles[id].view)
+		Sys_Error("Sys_UnmapFile: bad id");
+#endif
+
+	UnmapViewOfFile(maphandles[id].view);
+	CloseHandle(maphandles[id].mapping);
+	CloseHandle(maphandles[id].file);
+
+	EnterCriticalCode(&mapcriticalcode);
+	maphandles[id].view = 0;
+	LeaveCriticalCode(&mapcriticalcode);
+}
+
+/*
+=================
+Sys_FlushMapping
+=================
+*/
+void Sys_FlushMapping(maphandle_t id, void *data, size_t size)
+{
+#ifdef PARANOID
+	if (id < 0 || id >= MAXMAPHANDLES || !maphandles[id].view)
+		Sys_Error("Sys_FlushMapping: bad id");
+#endif
+
+	FlushViewOfFile(data, size);
+}
+
+/*
+=================
+Sys_WatchDirectory
+=================
+*/
+watchhandle_t Sys_WatchDirectory(const char *dirname)
+{
+	watchhandle_t id;
+	HANDLE h;
+
+#ifdef PARANOID
+	if (!dirname || !dirname[0])
+		Sys_Error("Sys_WatchDirectory: bad dirname");
+#endif
+
+	EnterCriticalCode(&watchcriticalcode);
+
+	for (id = 0; id < MAXWATCHHANDLES; id++) {
+		if (!watchhandles[id])
+			break;
+	}
+	if (id == MAXWATCHHANDLES) {
+		LeaveCriticalCode(&watchcriticalcode);
+		COM_DevPrintf("Sys_WatchDirectory: no unoccupied watchhandles left\n");
+		return BADWATCH;
+	}
+
+	h = FindFirstChangeNotification(dirname, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+	if (h == INVALID_HANDLE_VALUE) {
+		LeaveCriticalCode(&watchcriticalcode);
+		COM_DevPrintf("Sys_WatchDirectory: FindFirstChangeNotification failed for \"%s\" (code 0x%x)\n", dirname, GetLastError());
+		return BADWATCH;
+	}
+	watchhandles[id] = h;
+
+	LeaveCriticalCode(&watchcriticalcode);
+
+	return id;
+}
+
+/*
+=================
+Sys_DirectoryChanged
+
+Rearms the notification once signaled, so the changes made
+after the call get reported by the next one
+=================
+*/
+qboolean_t Sys_DirectoryChanged(watchhandle_t id)
+{
+#ifdef PARANOID
+	if (id < 0 || id >= MAXWATCHHANDLES || !watchhandles[id])
+		Sys_Error("Sys_DirectoryChanged: bad id");
+#endif
+
+	if (WaitForSingleObject(watchhandles[id], 0) != WAIT_OBJECT_0)
+		return false;
+
+	FindNextChangeNotification(watchhandles[id]);
+	return true;
+}
+
+/*
+=================
+Sys_UnwatchDirectory
+=================
+*/
+void Sys_UnwatchDirectory(watchhandle_t id)
+{
+#ifdef PARANOID
+	if (id < 0 || id >= MAXWATCHHANDLES || !watchhandles[id])
+		Sys_Error("Sys_UnwatchDirectory: bad id");
+#endif
+
+	FindCloseChangeNotification(watchhandles[id]);
+
+	EnterCriticalCode(&watchcriticalcode);
+	watchhandles[id] = 0;
+	LeaveCriticalCode(&watchcriticalcode);
+}
+
 /*
 ====================================================================================================
 
@@ -1081,6 +1404,345 @@ qboolean_t Sys_SyncWaitTime(synchandle_t id, unsigned msecs);
 	return WaitForSingleObject(synchandles[id].h, msecs) == WAIT_OBJECT_0;
 }
 
+#define MAXTHREADS 32
+static struct {
+	HANDLE       h;
+	threadfunc_t func;
+	void *       param;
+} threadhandles[MAXTHREADS];
+static criticalcode_t threadcriticalcode;
+
+/*
+=================
+ThreadProc
+=================
+*/
+static DWORD WINAPI ThreadProc(LPVOID lpParameter)
+{
+	int id = (int)(size_t)lpParameter;
+
+	threadhandles[id].func(threadhandles[id].param);
+	return 0;
+}
+
+/*
+=================
+Sys_NewThread
+=================
+*/
+threadhandle_t Sys_NewThread(threadfunc_t func, void *param)
+{
+	int id;
+
+#ifdef PARANOID
+	if (!func)
+		Sys_Error("Sys_NewThread: null func");
+#endif
+
+	EnterCriticalCode(&threadcriticalcode);
+
+	for (id = 0; id < MAXTHREADS; id++) {
+		if (!threadhandles[id].func)
+			break;
+	}
+	if (id == MAXTHREADS) {
+		LeaveCriticalCode(&threadcriticalcode);
+		COM_DevPrintf("Sys_NewThread: out of handles\n");
+		return BADTHREAD;
+	}
+	threadhandles[id].func = func;
+	threadhandles[id].param = param;
+
+	LeaveCriticalCode(&threadcriticalcode);
+
+	threadhandles[id].h = CreateThread(0, 0, ThreadProc, (LPVOID)(size_t)id, 0, 0);
+	if (!threadhandles[id].h) {
+		COM_DevPrintf("Sys_NewThread: CreateThread failed (code 0x%x)\n", GetLastError());
+		threadhandles[id].func = 0;
+		return BADTHREAD;
+	}
+
+	return id;
+}
+
+/*
+=================
+Sys_WaitThread
+=================
+*/
+void Sys_WaitThread(threadhandle_t id)
+{
+#ifdef PARANOID
+	if (id < 0 || id >= MAXTHREADS || !threadhandles[id].h)
+		Sys_Error("Sys_WaitThread: bad id");
+#endif
+
+	WaitForSingleObject(threadhandles[id].h, INFINITE);
+	CloseHandle(threadhandles[id].h);
+	threadhandles[id].h = 0;
+	threadhandles[id].func = 0;
+}
+
+/*
+====================================================================================================
+
+LOCAL SOCKETS
+
+AF_UNIX stream sockets, available since Windows 10 1803. All of them are non-blocking,
+so the caller polls them with Sys_PollSockets instead of running a thread per connection.
+
+====================================================================================================
+*/
+#define MAXSOCKETS 64
+static struct {
+	SOCKET s;
+	qboolean_t occupied;
+	qboolean_t listening;                    // path is to be removed on close
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} sockethandles[MAXSOCKETS];
+static criticalcode_t socketcriticalcode;
+static qboolean_t wsastarted;
+
+/*
+=================
+AcquireSockethandle
+
+Returns BADSOCKET if no handles left
+=================
+*/
+static sockethandle_t AcquireSockethandle(SOCKET s)
+{
+	int i;
+
+	EnterCriticalCode(&socketcriticalcode);
+	for (i = 0; i < MAXSOCKETS; i++) {
+		if (!sockethandles[i].occupied) {
+			sockethandles[i].occupied = true;
+			sockethandles[i].listening = false;
+			sockethandles[i].s = s;
+			LeaveCriticalCode(&socketcriticalcode);
+			return i;
+		}
+	}
+	LeaveCriticalCode(&socketcriticalcode);
+
+	COM_DevPrintf("AcquireSockethandle: no unoccupied sockethandles left\n");
+	return BADSOCKET;
+}
+
+/*
+=================
+Sys_ListenLocal
+=================
+*/
+sockethandle_t Sys_ListenLocal(const char *path)
+{
+	WSADATA wsadata;
+	struct sockaddr_un addr;
+	sockethandle_t id;
+	SOCKET s;
+	u_long nonblocking = 1;
+
+#ifdef PARANOID
+	if (!path || !path[0])
+		Sys_Error("Sys_ListenLocal: bad path");
+#endif
+
+	if (Q_strlen(path) >= sizeof(addr.sun_path)) {
+		COM_DevPrintf("Sys_ListenLocal: path \"%s\" is too long\n", path);
+		return BADSOCKET;
+	}
+
+	EnterCriticalCode(&socketcriticalcode);
+	if (!wsastarted) {
+		if (WSAStartup(MAKEWORD(2, 2), &wsadata)) {
+			LeaveCriticalCode(&socketcriticalcode);
+			COM_DevPrintf("Sys_ListenLocal: WSAStartup failed (code 0x%x)\n", WSAGetLastError());
+			return BADSOCKET;
+		}
+		wsastarted = true;
+	}
+	LeaveCriticalCode(&socketcriticalcode);
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET) {
+		COM_DevPrintf("Sys_ListenLocal: socket failed (code 0x%x)\n", WSAGetLastError());
+		return BADSOCKET;
+	}
+
+	Q_memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	Q_strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	DeleteFile(path);                        // left by a crashed run
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR || listen(s, SOMAXCONN) == SOCKET_ERROR ||
+		ioctlsocket(s, FIONBIO, &nonblocking) == SOCKET_ERROR) {
+		COM_DevPrintf("Sys_ListenLocal: can't listen on \"%s\" (code 0x%x)\n", path, WSAGetLastError());
+		closesocket(s);
+		return BADSOCKET;
+	}
+
+	id = AcquireSockethandle(s);
+	if (id == BADSOCKET) {
+		closesocket(s);
+		DeleteFile(path);
+		return BADSOCKET;
+	}
+	sockethandles[id].listening = true;
+	Q_strncpy(sockethandles[id].path, path, sizeof(sockethandles[id].path));
+
+	return id;
+}
+
+/*
+=================
+Sys_AcceptLocal
+=================
+*/
+sockethandle_t Sys_AcceptLocal(sockethandle_t id)
+{
+	sockethandle_t client;
+	SOCKET s;
+	u_long nonblocking = 1;
+
+#ifdef PARANOID
+	if (id < 0 || id >= MAXSOCKETS || !sockethandles[id].occupied || !sockethandles[id].listening)
+		Sys_Error("Sys_AcceptLocal: bad id");
+#endif
+
+	s = accept(sockethandles[id].s, 0, 0);
+	if (s == INVALID_SOCKET)
+		return BADSOCKET;               // WSAEWOULDBLOCK mostly
+
+	if (ioctlsocket(s, FIONBIO, &nonblocking) == SOCKET_ERROR) {
+		closesocket(s);
+		return BADSOCKET;
+	}
+
+	client = AcquireSockethandle(s);
+	if (client == BADSOCKET)
+		closesocket(s);
+
+	return client;
+}
+
+/*
+=================
+Sys_SocketRecv
+=================
+*/
+int Sys_SocketRecv(sockethandle_t id, void *buf, unsigned count)
+{
+	int r;
+
+#ifdef PARANOID
+	if (id < 0 || id >= MAXSOCKETS || !sockethandles[id].occupied)
+		Sys_Error("Sys_SocketRecv: bad id");
+	if (!buf || count == 0)
+		Sys_Error("Sys_SocketRecv: bad params");
+#endif
+
+	r = recv(sockethandles[id].s, buf, (int)count, 0);
+	if (r > 0)
+		return r;
+	if (r == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+		return 0;
+
+	return BADRETURN;                   // closed by the peer or broken
+}
+
+/*
+=================
+Sys_SocketSend
+=================
+*/
+int Sys_SocketSend(sockethandle_t id, const void *buf, unsigned count)
+{
+	int r;
+
+#ifdef PARANOID
+	if (id < 0 || id >= MAXSOCKETS || !sockethandles[id].occupied)
+		Sys_Error("Sys_SocketSend: bad id");
+	if (!buf || count == 0)
+		Sys_Error("Sys_SocketSend: bad params");
+#endif
+
+	r = send(sockethandles[id].s, buf, (int)count, 0);
+	if (r >= 0)
+		return r;
+	if (WSAGetLastError() == WSAEWOULDBLOCK)
+		return 0;
+
+	return BADRETURN;
+}
+
+/*
+=================
+Sys_PollSockets
+
+o_writable might be null if only reads are of interest
+=================
+*/
+unsigned Sys_PollSockets(const sockethandle_t *ids, unsigned count, qboolean_t *o_readable, qboolean_t *o_writable, unsigned msecs)
+{
+	fd_set readset, writeset;
+	struct timeval timeout;
+	unsigned i, ready = 0;
+	int r;
+
+#ifdef PARANOID
+	if (!ids || count == 0 || count > FD_SETSIZE || !o_readable)
+		Sys_Error("Sys_PollSockets: bad params");
+#endif
+
+	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
+	for (i = 0; i < count; i++) {
+		FD_SET(sockethandles[ids[i]].s, &readset);
+		if (o_writable)
+			FD_SET(sockethandles[ids[i]].s, &writeset);
+	}
+
+	timeout.tv_sec = msecs / 1000;
+	timeout.tv_usec = (msecs % 1000) * 1000;
+	r = select(0, &readset, o_writable ? &writeset : 0, 0, &timeout);
+	if (r == SOCKET_ERROR) {
+		COM_DevPrintf("Sys_PollSockets: select failed (code 0x%x)\n", WSAGetLastError());
+		r = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		o_readable[i] = r > 0 && FD_ISSET(sockethandles[ids[i]].s, &readset);
+		if (o_writable)
+			o_writable[i] = r > 0 && FD_ISSET(sockethandles[ids[i]].s, &writeset);
+		if (o_readable[i] || (o_writable && o_writable[i]))
+			ready++;
+	}
+
+	return ready;
+}
+
+/*
+=================
+Sys_CloseSocket
+=================
+*/
+void Sys_CloseSocket(sockethandle_t id)
+{
+#ifdef PARANOID
+	if (id < 0 || id >= MAXSOCKETS || !sockethandles[id].occupied)
+		Sys_Error("Sys_CloseSocket: bad id");
+#endif
+
+	closesocket(sockethandles[id].s);
+	if (sockethandles[id].listening)
+		DeleteFile(sockethandles[id].path);
+
+	EnterCriticalCode(&socketcriticalcode);
+	sockethandles[id].occupied = false;
+	LeaveCriticalCode(&socketcriticalcode);
+}
+
 /*
 ====================================================================================================
 
@@ -1281,6 +1943,7 @@ void Sys_Init(size_t minmemory, size_t maxmemory)
 #endif
 	if (!QueryPerformanceFrequency(&PerformanceFreq)) Sys_Error("No hardware timer available");
 	pfreq = PerformanceFreq.QuadPart;
+	pstart = Sys_PerformanceCounter();
 
 	//
 	// parsing executable name
@@ -1404,6 +2067,9 @@ void Sys_Shutdown(void)
 	if (timeperiod_began)
 		timeEndPeriod(timeperiod);
 
+	if (wsastarted)
+		WSACleanup();
+
 	CoUninitialize();
 
 	if (fancystdout && !attachedstdout)
@@ -3,6 +3,8 @@
 #ifndef SYS_WINDOWS_H
 #define SYS_WINDOWS_H
 
+#include <winsock2.h>                                       // has to go before windows.h
+#include <afunix.h>
 #include <windows.h>
 
 extern HINSTANCE     global_hInstance;                      // original hInstance from WinMain